@@ -27,5 +27,33 @@ static void BM_ProtoflatSerializeAsString(benchmark::State &state)
     }
 }
 
+static void BM_ProtoflatDeserialize(benchmark::State &state)
+{
+    test::Message message;
+    message.data.emplace_back().text_list = {"Hello!", "World!"};
+    auto data = protoflat::serialize(message);
+
+    for (auto _ : state)
+    {
+        std::string_view data_view(data);
+        protoflat::deserialize(data_view, message);
+    }
+}
+
+static void BM_ProtoflatDeserializeReuse(benchmark::State &state)
+{
+    test::Message message;
+    message.data.emplace_back().text_list = {"Hello!", "World!"};
+    auto data = protoflat::serialize(message);
+
+    for (auto _ : state)
+    {
+        std::string_view data_view(data);
+        protoflat::deserialize_reuse(data_view, message);
+    }
+}
+
 BENCHMARK(BM_ProtoflatSerializeToStringWithoutAlloc);
 BENCHMARK(BM_ProtoflatSerializeAsString);
+BENCHMARK(BM_ProtoflatDeserialize);
+BENCHMARK(BM_ProtoflatDeserializeReuse);
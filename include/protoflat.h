@@ -1,5 +1,10 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <ranges>
 #include <string>
 #include <string_view>
 #include <type_traits>
@@ -80,6 +85,11 @@ struct length_delimited
 {
 };
 
+// length_delimited with UTF-8 validation on decode, see protoflat_utf8.h.
+struct utf8_string
+{
+};
+
 struct packed_varint
 {
 };
@@ -88,6 +98,15 @@ struct packed_fixed
 {
 };
 
+// varint of a zigzag-encoded signed value, written by sint32 and sint64 fields.
+struct zigzag_varint
+{
+};
+
+struct packed_zigzag_varint
+{
+};
+
 inline std::string_view protoflat_specialization_type(wire_type type, bool is_packed)
 {
     switch (type)
@@ -112,13 +131,14 @@ struct type_traits
     static bool deserialize(std::string_view &data, T &value);
 };
 
+
 template<>
 struct type_traits<varint>
 {
     template<class T, typename = std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
     static size_t size(T source_value)
     {
-        uint64_t &value = reinterpret_cast<uint64_t &>(source_value);
+        auto value = static_cast<uint64_t>(source_value);
         size_t size = 0;
         do
         {
@@ -132,7 +152,7 @@ struct type_traits<varint>
     template<class T, typename = std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
     static void serialize(T source_value, std::string &data)
     {
-        uint64_t &value = reinterpret_cast<uint64_t &>(source_value);
+        auto value = static_cast<uint64_t>(source_value);
         do
         {
             char byte = value & 0x7f;
@@ -145,27 +165,62 @@ struct type_traits<varint>
         } while (value > 0);
     }
 
-    template<class T, typename = std::enable_if_t<std::is_integral_v<T>>>
+    template<class T, typename = std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
     static bool deserialize(std::string_view &data, T &value)
     {
-        bool result = false;
+        uint64_t result = 0;
         size_t offset = 0;
-        for (auto &c : data)
+        for (auto c : data)
         {
-            uint64_t byte = c;
-            reinterpret_cast<uint64_t &>(value) |= (byte & 0x7f) << 7 * offset;
+            uint64_t byte = static_cast<uint8_t>(c);
+            result |= (byte & 0x7f) << 7 * offset;
 
             ++offset;
             if (byte <= 0x7f)
             {
-                result = true;
+                value = static_cast<T>(result);
+                data.remove_prefix(offset);
+
+                return true;
+            }
+
+            if (offset == 10)
+            {
                 break;
             }
         }
 
-        data.remove_prefix(offset);
+        return false;
+    }
+};
+
+template<>
+struct type_traits<zigzag_varint>
+{
+    template<class T, typename = std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T>>>
+    static size_t size(T value)
+    {
+        return type_traits<varint>::size(zigzag::encode(value));
+    }
+
+    template<class T, typename = std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T>>>
+    static void serialize(T value, std::string &data)
+    {
+        type_traits<varint>::serialize(zigzag::encode(value), data);
+    }
+
+    template<class T, typename = std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T>>>
+    static bool deserialize(std::string_view &data, T &value)
+    {
+        uint64_t encoded = 0;
+        if (!type_traits<varint>::deserialize(data, encoded))
+        {
+            return false;
+        }
 
-        return result;
+        // sint32 keeps only the low 32 bits of the varint, as libprotobuf does.
+        value = static_cast<T>(zigzag::decode(sizeof(T) == 4 ? static_cast<uint32_t>(encoded) : encoded));
+        return true;
     }
 };
 
@@ -181,8 +236,9 @@ struct type_traits<fixed>
     template<class T, typename = std::enable_if_t<std::is_arithmetic_v<T> && sizeof(T) >= 4>>
     static void serialize(T source_value, std::string &data)
     {
-        uint64_t &value = reinterpret_cast<uint64_t &>(source_value);
-        for (int i = 0; i < sizeof(T); ++i)
+        uint64_t value = 0;
+        std::memcpy(&value, &source_value, sizeof(T));
+        for (size_t i = 0; i < sizeof(T); ++i)
         {
             data += static_cast<char>(value & 0xff);
             value >>= 8;
@@ -197,11 +253,12 @@ struct type_traits<fixed>
             return false;
         }
 
-        for (int i = 0; i < sizeof(T); ++i)
+        uint64_t result = 0;
+        for (size_t i = 0; i < sizeof(T); ++i)
         {
-            value |= data[i];
-            value <<= 8;
+            result |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << 8 * i;
         }
+        std::memcpy(&value, &result, sizeof(T));
         data.remove_prefix(sizeof(T));
 
         return true;
@@ -211,25 +268,25 @@ struct type_traits<fixed>
 template<>
 struct type_traits<length_delimited>
 {
-    static size_t size(const std::string &value)
+    static size_t size(std::string_view value)
     {
         return value.size();
     }
 
-    static void serialize(const std::string &value, std::string &data)
+    static void serialize(std::string_view value, std::string &data)
     {
         type_traits<varint>::serialize(type_traits::size(value), data);
         data += value;
     }
 
-    static bool deserialize(std::string_view &data, std::string &value)
+    static bool deserialize(std::string_view &data, std::string_view &value)
     {
         uint64_t size = 0;
         if (type_traits<varint>::deserialize(data, size))
         {
             if (data.size() >= size)
             {
-                value.append(data.substr(0, size));
+                value = data.substr(0, size);
                 data.remove_prefix(size);
 
                 return true;
@@ -238,74 +295,132 @@ struct type_traits<length_delimited>
 
         return false;
     }
+
+    // Any owning string type with assign(const char *, size_t), e.g. small_string.
+    template<class String, typename = std::enable_if_t<!std::is_same_v<String, std::string_view>>>
+    static bool deserialize(std::string_view &data, String &value)
+    {
+        std::string_view source_value;
+        if (type_traits::deserialize(data, source_value))
+        {
+            value.assign(source_value.data(), source_value.size());
+
+            return true;
+        }
+
+        return false;
+    }
 };
 
-template<>
-struct type_traits<packed_varint>
+inline size_t length_prefixed_size(size_t size)
 {
-    template<class T, typename = std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
-    static size_t size(const std::vector<T> &values)
+    return type_traits<varint>::size(size) + size;
+}
+
+inline bool skip_field(std::string_view &data, wire_type type)
+{
+    switch (type)
+    {
+    case wire_type::varint:
+    {
+        uint64_t value = 0;
+        return type_traits<varint>::deserialize(data, value);
+    }
+    case wire_type::fixed64:
+    case wire_type::fixed32:
+    {
+        size_t size = type == wire_type::fixed64 ? 8 : 4;
+        if (data.size() < size)
+        {
+            return false;
+        }
+        data.remove_prefix(size);
+
+        return true;
+    }
+    case wire_type::length_delimited:
+    {
+        std::string_view value;
+        return type_traits<length_delimited>::deserialize(data, value);
+    }
+    default:
+        return false;
+    }
+}
+
+// Packed varints whose elements are written with Element, varint or zigzag_varint.
+template<class Element>
+struct packed_varint_traits
+{
+    template<class Range, class T = std::ranges::range_value_t<Range>, typename = std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
+    static size_t size(const Range &values)
     {
         size_t size = 0;
         for (const auto &value : values)
         {
-            size += type_traits<varint>::size(value);
+            size += type_traits<Element>::size(T(value));
         }
 
         return size;
     }
 
-    template<class T, typename = std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
-    static void serialize(const std::vector<T> &values, std::string &data)
+    template<class Range, class T = std::ranges::range_value_t<Range>, typename = std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
+    static void serialize(const Range &values, std::string &data)
     {
-        type_traits<varint>::serialize(type_traits::size(values), data);
+        type_traits<varint>::serialize(packed_varint_traits::size(values), data);
         for (const auto &value : values)
         {
-            type_traits<varint>::serialize(value, data);
+            type_traits<Element>::serialize(T(value), data);
         }
     }
 
-    template<class T, typename = std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
-    static bool deserialize(std::string_view &data, std::vector<T> &values)
+    template<class Container, class T = typename Container::value_type, typename = std::enable_if_t<std::is_integral_v<T> || std::is_enum_v<T>>>
+    static bool deserialize(std::string_view &data, Container &values)
     {
-        uint64_t size;
-        if (type_traits<varint>::deserialize(data, size))
+        std::string_view packed_data;
+        if (type_traits<length_delimited>::deserialize(data, packed_data))
         {
-            if (data.size() >= size)
+            while (!packed_data.empty())
             {
-                size_t until = data.size() - size;
-                while (data.size() > until)
+                T value;
+                if (type_traits<Element>::deserialize(packed_data, value))
                 {
-                    T value;
-                    if (type_traits<varint>::deserialize(data, value))
-                    {
-                        values.push_back(value);
-                    }
-                    else
-                    {
-                        return false;
-                    }
+                    values.push_back(value);
+                }
+                else
+                {
+                    return false;
                 }
-
-                return true;
             }
+
+            return true;
         }
 
         return false;
     }
 };
 
+template<>
+struct type_traits<packed_varint> : packed_varint_traits<varint>
+{
+};
+
+template<>
+struct type_traits<packed_zigzag_varint> : packed_varint_traits<zigzag_varint>
+{
+};
+
 template<>
 struct type_traits<packed_fixed>
 {
-    template<class T, typename = std::enable_if_t<std::is_arithmetic_v<T> && sizeof(T) >= 4>>
-    static size_t size(const std::vector<T> &values)
+    template<class Range, class T = std::ranges::range_value_t<Range>, typename = std::enable_if_t<std::is_arithmetic_v<T> && sizeof(T) >= 4>>
+    static size_t size(const Range &values)
     {
-        return values.size() * sizeof(T);
+        return std::ranges::size(values) * sizeof(T);
     }
 
-    template<class T, typename = std::enable_if_t<std::is_arithmetic_v<T> && sizeof(T) >= 4>>
-    static void serialize(const std::vector<T> &values, std::string &data)
+    template<class Range, class T = std::ranges::range_value_t<Range>, typename = std::enable_if_t<std::is_arithmetic_v<T> && sizeof(T) >= 4>>
+    static void serialize(const Range &values, std::string &data)
     {
         type_traits<varint>::serialize(type_traits::size(values), data);
         for (auto &value : values)
@@ -314,36 +429,564 @@ struct type_traits<packed_fixed>
         }
     }
 
-    template<class T, typename = std::enable_if_t<std::is_arithmetic_v<T> && sizeof(T) >= 4>>
-    static bool deserialize(std::string_view &data, std::vector<T> &values)
+    template<class Container, class T = typename Container::value_type, typename = std::enable_if_t<std::is_arithmetic_v<T> && sizeof(T) >= 4>>
+    static bool deserialize(std::string_view &data, Container &values)
     {
-        uint64_t size;
-        if (type_traits<varint>::deserialize(data, size))
+        std::string_view packed_data;
+        if (type_traits<length_delimited>::deserialize(data, packed_data) && packed_data.size() % sizeof(T) == 0)
         {
-            if (data.size() >= size)
+            values.reserve(values.size() + packed_data.size() / sizeof(T));
+            while (!packed_data.empty())
             {
-                size_t until = data.size() - size;
-                while (data.size() > until)
+                T value;
+                if (type_traits<fixed>::deserialize(packed_data, value))
                 {
-                    T value;
-                    if (type_traits<fixed>::deserialize(data, value))
-                    {
-                        values.push_back(value);
-                    }
-                    else
-                    {
-                        return false;
-                    }
+                    values.push_back(value);
+                }
+                else
+                {
+                    return false;
                 }
-
-                return true;
             }
+
+            return true;
         }
 
         return false;
     }
 };
 
+enum class decode_mode
+{
+    merge,
+    reuse
+};
+
+template<class T>
+struct embedded_message
+{
+};
+
+template<class T>
+struct type_traits<embedded_message<T>>
+{
+    static size_t size(const T &value)
+    {
+        return type_traits<T>::size(value);
+    }
+
+    static void serialize(const T &value, std::string &data)
+    {
+        type_traits<varint>::serialize(type_traits<T>::size(value), data);
+        type_traits<T>::serialize(value, data);
+    }
+
+    template<decode_mode mode = decode_mode::merge>
+    static bool deserialize(std::string_view &data, T &value)
+    {
+        std::string_view message_data;
+        return type_traits<length_delimited>::deserialize(data, message_data) && type_traits<T>::template deserialize<mode>(message_data, value);
+    }
+
+    // Only the first occurrence of a singular submessage is decoded in reuse mode,
+    // later occurrences are merged into it.
+    template<decode_mode mode = decode_mode::merge>
+    static bool deserialize(std::string_view &data, T &value, bool &is_seen)
+    {
+        if constexpr (mode == decode_mode::reuse)
+        {
+            if (!is_seen)
+            {
+                is_seen = true;
+                return deserialize<decode_mode::reuse>(data, value);
+            }
+        }
+
+        is_seen = true;
+        return deserialize<decode_mode::merge>(data, value);
+    }
+
+    static size_t delta_size(const T &baseline, const T &value)
+    {
+        return type_traits<T>::delta_size(baseline, value);
+    }
+
+    static void serialize_delta(const T &baseline, const T &value, std::string &data)
+    {
+        type_traits<varint>::serialize(type_traits<T>::delta_size(baseline, value), data);
+        type_traits<T>::serialize_delta(baseline, value, data);
+    }
+};
+
+template<class Container>
+inline bool starts_with(const Container &values, const Container &prefix)
+{
+    return values.size() >= prefix.size() && std::equal(prefix.begin(), prefix.end(), values.begin());
+}
+
+// Returns the element a repeated field decodes into next. In reuse mode elements
+// left over from the previous contents are handed out before new ones are added,
+// so count ends up as the number of elements actually decoded.
+template<decode_mode mode, class Container>
+inline auto &next_element(Container &values, size_t &count)
+{
+    if constexpr (mode == decode_mode::reuse)
+    {
+        if (count < values.size())
+        {
+            return values[count++];
+        }
+        ++count;
+    }
+
+    return values.emplace_back();
+}
+
+// Returns the value of an optional-like field (std::optional, boxed), constructing
+// it first when the field is absent.
+template<class Optional>
+inline auto &mutable_value(Optional &value)
+{
+    if (!value)
+    {
+        value.emplace();
+    }
+
+    return *value;
+}
+
+template<class Container>
+inline auto appended_elements(const Container &baseline, const Container &values)
+{
+    return std::ranges::subrange(values.begin() + baseline.size(), values.end());
+}
+
+// Table-driven codec. Instead of unrolled per-field code, a message generated with
+// the "codec=table" parameter describes its fields with a constant table of
+// field_entry and all messages share the interpreter below. Field codecs are
+// instantiated once per storage type and encoding, not per field.
+struct field_entry;
+
+struct field_codec
+{
+    size_t (*size)(const field_entry &field, const void *value);
+    void (*serialize)(const field_entry &field, const void *value, std::string &data);
+    bool (*deserialize)(const field_entry &field, wire_type type, std::string_view &data, void *value);
+    void (*clear)(void *value);
+};
+
+struct field_entry
+{
+    uint32_t tag;
+    uint32_t offset;
+    const field_codec *codec;
+
+    constexpr uint32_t number() const
+    {
+        return tag >> 3;
+    }
+
+    constexpr wire_type type() const
+    {
+        return wire_type(tag & 0x7);
+    }
+};
+
+// Fields must be sorted by number.
+struct message_table
+{
+    const field_entry *fields;
+    size_t field_count;
+};
+
+namespace codec
+{
+
+template<class Specialization, class T>
+inline size_t value_size(const field_entry &field, const T &value)
+{
+    auto size = type_traits<Specialization>::size(value);
+    return field.type() == wire_type::length_delimited ? length_prefixed_size(size) : size;
+}
+
+template<class Specialization>
+using packed_specialization = std::conditional_t<std::is_same_v<Specialization, varint>, packed_varint,
+                                                 std::conditional_t<std::is_same_v<Specialization, zigzag_varint>, packed_zigzag_varint, packed_fixed>>;
+
+template<class Specialization, class T>
+constexpr wire_type element_type()
+{
+    if constexpr (std::is_same_v<Specialization, varint> || std::is_same_v<Specialization, zigzag_varint>)
+    {
+        return wire_type::varint;
+    }
+    else
+    {
+        return sizeof(T) == 4 ? wire_type::fixed32 : wire_type::fixed64;
+    }
+}
+
+template<class Specialization, class T>
+struct singular
+{
+    static size_t size(const field_entry &field, const void *value)
+    {
+        auto &field_value = *static_cast<const T *>(value);
+        if (field_value == T{})
+        {
+            return 0;
+        }
+
+        return type_traits<varint>::size(field.tag) + value_size<Specialization>(field, field_value);
+    }
+
+    static void serialize(const field_entry &field, const void *value, std::string &data)
+    {
+        auto &field_value = *static_cast<const T *>(value);
+        if (field_value != T{})
+        {
+            type_traits<varint>::serialize(field.tag, data);
+            type_traits<Specialization>::serialize(field_value, data);
+        }
+    }
+
+    static bool deserialize(const field_entry &field, wire_type type, std::string_view &data, void *value)
+    {
+        if (type != field.type())
+        {
+            return skip_field(data, type);
+        }
+
+        return type_traits<Specialization>::deserialize(data, *static_cast<T *>(value));
+    }
+
+    static void clear(void *value)
+    {
+        if constexpr (requires(T &field_value) { field_value.clear(); })
+        {
+            static_cast<T *>(value)->clear();
+        }
+        else
+        {
+            *static_cast<T *>(value) = {};
+        }
+    }
+};
+
+// Repeated fields written one element per field header: strings, bytes and
+// repeated scalars with [packed = false]. Repeated codecs take the field's container
+// type, e.g. std::vector<int32_t> or small_vector<int32_t, 4>.
+template<class Specialization, class Container, class T = typename Container::value_type>
+struct repeated
+{
+    static size_t size(const field_entry &field, const void *value)
+    {
+        size_t size = 0;
+        for (const auto &element : *static_cast<const Container *>(value))
+        {
+            size += type_traits<varint>::size(field.tag) + value_size<Specialization>(field, static_cast<const T &>(element));
+        }
+
+        return size;
+    }
+
+    static void serialize(const field_entry &field, const void *value, std::string &data)
+    {
+        for (const auto &element : *static_cast<const Container *>(value))
+        {
+            type_traits<varint>::serialize(field.tag, data);
+            type_traits<Specialization>::serialize(static_cast<const T &>(element), data);
+        }
+    }
+
+    static bool deserialize(const field_entry &field, wire_type type, std::string_view &data, void *value)
+    {
+        auto &values = *static_cast<Container *>(value);
+        if constexpr (std::is_same_v<Specialization, varint> || std::is_same_v<Specialization, zigzag_varint> || std::is_same_v<Specialization, fixed>)
+        {
+            if (type == wire_type::length_delimited)
+            {
+                return type_traits<packed_specialization<Specialization>>::deserialize(data, values);
+            }
+        }
+        if (type != field.type())
+        {
+            return skip_field(data, type);
+        }
+
+        T element{};
+        if (!type_traits<Specialization>::deserialize(data, element))
+        {
+            return false;
+        }
+        values.push_back(std::move(element));
+
+        return true;
+    }
+
+    static void clear(void *value)
+    {
+        static_cast<Container *>(value)->clear();
+    }
+};
+
+template<class Specialization, class Container, class T = typename Container::value_type>
+struct packed
+{
+    static size_t size(const field_entry &field, const void *value)
+    {
+        auto &values = *static_cast<const Container *>(value);
+        if (values.empty())
+        {
+            return 0;
+        }
+
+        return type_traits<varint>::size(field.tag) + length_prefixed_size(type_traits<packed_specialization<Specialization>>::size(values));
+    }
+
+    static void serialize(const field_entry &field, const void *value, std::string &data)
+    {
+        auto &values = *static_cast<const Container *>(value);
+        if (!values.empty())
+        {
+            type_traits<varint>::serialize(field.tag, data);
+            type_traits<packed_specialization<Specialization>>::serialize(values, data);
+        }
+    }
+
+    static bool deserialize(const field_entry &, wire_type type, std::string_view &data, void *value)
+    {
+        auto &values = *static_cast<Container *>(value);
+        if (type == wire_type::length_delimited)
+        {
+            return type_traits<packed_specialization<Specialization>>::deserialize(data, values);
+        }
+        if (type != element_type<Specialization, T>())
+        {
+            return skip_field(data, type);
+        }
+
+        T element{};
+        if (!type_traits<Specialization>::deserialize(data, element))
+        {
+            return false;
+        }
+        values.push_back(element);
+
+        return true;
+    }
+
+    static void clear(void *value)
+    {
+        static_cast<Container *>(value)->clear();
+    }
+};
+
+// proto3 optional scalars, stored as std::optional<T>.
+template<class Specialization, class Optional>
+struct optional
+{
+    static size_t size(const field_entry &field, const void *value)
+    {
+        auto &field_value = *static_cast<const Optional *>(value);
+        if (!field_value)
+        {
+            return 0;
+        }
+
+        return type_traits<varint>::size(field.tag) + value_size<Specialization>(field, *field_value);
+    }
+
+    static void serialize(const field_entry &field, const void *value, std::string &data)
+    {
+        auto &field_value = *static_cast<const Optional *>(value);
+        if (field_value)
+        {
+            type_traits<varint>::serialize(field.tag, data);
+            type_traits<Specialization>::serialize(*field_value, data);
+        }
+    }
+
+    static bool deserialize(const field_entry &field, wire_type type, std::string_view &data, void *value)
+    {
+        if (type != field.type())
+        {
+            return skip_field(data, type);
+        }
+
+        return type_traits<Specialization>::deserialize(data, mutable_value(*static_cast<Optional *>(value)));
+    }
+
+    static void clear(void *value)
+    {
+        static_cast<Optional *>(value)->reset();
+    }
+};
+
+// Singular submessages, stored as std::optional<T> or boxed<T>.
+template<class Optional, class T = typename Optional::value_type>
+struct message
+{
+    static size_t size(const field_entry &field, const void *value)
+    {
+        auto &field_value = *static_cast<const Optional *>(value);
+        if (!field_value)
+        {
+            return 0;
+        }
+
+        return type_traits<varint>::size(field.tag) + length_prefixed_size(type_traits<T>::size(*field_value));
+    }
+
+    static void serialize(const field_entry &field, const void *value, std::string &data)
+    {
+        auto &field_value = *static_cast<const Optional *>(value);
+        if (field_value)
+        {
+            type_traits<varint>::serialize(field.tag, data);
+            type_traits<embedded_message<T>>::serialize(*field_value, data);
+        }
+    }
+
+    static bool deserialize(const field_entry &, wire_type type, std::string_view &data, void *value)
+    {
+        if (type != wire_type::length_delimited)
+        {
+            return skip_field(data, type);
+        }
+
+        return type_traits<embedded_message<T>>::deserialize(data, mutable_value(*static_cast<Optional *>(value)));
+    }
+
+    static void clear(void *value)
+    {
+        static_cast<Optional *>(value)->reset();
+    }
+};
+
+template<class Container, class T = typename Container::value_type>
+struct repeated_message
+{
+    static size_t size(const field_entry &field, const void *value)
+    {
+        size_t size = 0;
+        for (const auto &element : *static_cast<const Container *>(value))
+        {
+            size += type_traits<varint>::size(field.tag) + length_prefixed_size(type_traits<T>::size(element));
+        }
+
+        return size;
+    }
+
+    static void serialize(const field_entry &field, const void *value, std::string &data)
+    {
+        for (const auto &element : *static_cast<const Container *>(value))
+        {
+            type_traits<varint>::serialize(field.tag, data);
+            type_traits<embedded_message<T>>::serialize(element, data);
+        }
+    }
+
+    static bool deserialize(const field_entry &, wire_type type, std::string_view &data, void *value)
+    {
+        if (type != wire_type::length_delimited)
+        {
+            return skip_field(data, type);
+        }
+
+        return type_traits<embedded_message<T>>::deserialize(data, static_cast<Container *>(value)->emplace_back());
+    }
+
+    static void clear(void *value)
+    {
+        static_cast<Container *>(value)->clear();
+    }
+};
+
+template<class Codec>
+inline constexpr field_codec instance{&Codec::size, &Codec::serialize, &Codec::deserialize, &Codec::clear};
+
+} // namespace codec
+
+inline size_t table_size(const message_table &table, const void *value)
+{
+    auto base = static_cast<const char *>(value);
+    size_t size = 0;
+    for (size_t i = 0; i < table.field_count; ++i)
+    {
+        auto &field = table.fields[i];
+        size += field.codec->size(field, base + field.offset);
+    }
+
+    return size;
+}
+
+inline void table_serialize(const message_table &table, const void *value, std::string &data)
+{
+    auto base = static_cast<const char *>(value);
+    for (size_t i = 0; i < table.field_count; ++i)
+    {
+        auto &field = table.fields[i];
+        field.codec->serialize(field, base + field.offset, data);
+    }
+}
+
+// Fields usually arrive in table order, so the entry after the previous match is
+// tried before falling back to a binary search.
+inline const field_entry *table_find(const message_table &table, uint64_t field_number, size_t &next)
+{
+    if (next < table.field_count && table.fields[next].number() == field_number)
+    {
+        return &table.fields[next++];
+    }
+
+    auto end = table.fields + table.field_count;
+    auto field = std::lower_bound(table.fields, end, field_number, [](const field_entry &entry, uint64_t number) {
+        return entry.number() < number;
+    });
+    if (field == end || field->number() != field_number)
+    {
+        return nullptr;
+    }
+    next = field - table.fields + 1;
+
+    return field;
+}
+
+inline bool table_deserialize(const message_table &table, std::string_view &data, void *value)
+{
+    auto base = static_cast<char *>(value);
+    size_t next = 0;
+    while (!data.empty())
+    {
+        uint64_t header_value = 0;
+        if (!type_traits<varint>::deserialize(data, header_value))
+        {
+            return false;
+        }
+
+        auto header = field_header::decode(header_value);
+        auto field = table_find(table, header.field_number, next);
+        if (field != nullptr ? !field->codec->deserialize(*field, header.field_type, data, base + field->offset) : !skip_field(data, header.field_type))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Resets every field; strings and vectors keep their capacity.
+inline void table_clear(const message_table &table, void *value)
+{
+    auto base = static_cast<char *>(value);
+    for (size_t i = 0; i < table.field_count; ++i)
+    {
+        auto &field = table.fields[i];
+        field.codec->clear(base + field.offset);
+    }
+}
+
 template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
 inline void serialize_to_string(const T &value, std::string &data)
 {
@@ -370,4 +1013,127 @@ inline bool deserialize(std::string_view &data, T &value)
     return type_traits<T>::deserialize(data, value);
 }
 
+// Decodes data into value with protobuf MergeFrom semantics: set scalar fields
+// overwrite, repeated fields are appended to and submessages are merged recursively.
+template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+inline bool merge(std::string_view &data, T &value)
+{
+    return type_traits<T>::deserialize(data, value);
+}
+
+// Same result as deserialize, but value is cleared without releasing its storage:
+// strings and vectors keep their capacity, and repeated and present submessages are
+// decoded into the existing objects, so a reused value stops allocating once warm.
+template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+inline bool deserialize_reuse(std::string_view &data, T &value)
+{
+    return type_traits<T>::template deserialize<decode_mode::reuse>(data, value);
+}
+
+namespace batch
+{
+
+// How many messages ahead deserialize_batch prefetches, and how many bytes of each
+// input and destination.
+inline constexpr size_t prefetch_distance = 4;
+inline constexpr size_t prefetch_bytes = 256;
+
+template<bool is_write>
+inline void prefetch(const void *address, size_t size)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    auto begin = static_cast<const char *>(address);
+    for (size_t offset = 0; offset < std::min(size, prefetch_bytes); offset += 64)
+    {
+        __builtin_prefetch(begin + offset, is_write ? 1 : 0);
+    }
+#else
+    (void)address;
+    (void)size;
+#endif
+}
+
+// Calls decode(inputs[i], values[i]) in order, prefetching the input and the
+// destination prefetch_distance messages ahead. Stops at the first failure and
+// returns the number of messages decoded.
+template<class Inputs, class Values, class Decode>
+inline size_t deserialize(const Inputs &inputs, Values &values, Decode decode)
+{
+    auto count = std::min<size_t>(std::ranges::size(inputs), std::ranges::size(values));
+    for (size_t i = 0; i < std::min(count, prefetch_distance); ++i)
+    {
+        std::string_view data = inputs[i];
+        prefetch<false>(data.data(), data.size());
+        prefetch<true>(&values[i], sizeof(values[i]));
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (i + prefetch_distance < count)
+        {
+            std::string_view next_data = inputs[i + prefetch_distance];
+            prefetch<false>(next_data.data(), next_data.size());
+            prefetch<true>(&values[i + prefetch_distance], sizeof(values[i]));
+        }
+
+        std::string_view data = inputs[i];
+        if (!decode(data, values[i]))
+        {
+            return i;
+        }
+    }
+
+    return count;
+}
+
+} // namespace batch
+
+// Decodes a batch of independent messages, inputs[i] into values[i], with the
+// semantics of deserialize. While one message is decoded the inputs and destinations
+// of the next ones are prefetched, which hides most cache misses when the batch is
+// cold. Stops at the first malformed message and returns how many were decoded, so
+// all succeeded when the result is min(size(inputs), size(values)).
+template<class Inputs, class Values>
+inline size_t deserialize_batch(const Inputs &inputs, Values &values)
+{
+    return batch::deserialize(inputs, values, [](std::string_view &data, auto &value) { return deserialize(data, value); });
+}
+
+// deserialize_batch with the semantics of deserialize_reuse.
+template<class Inputs, class Values>
+inline size_t deserialize_batch_reuse(const Inputs &inputs, Values &values)
+{
+    return batch::deserialize(inputs, values, [](std::string_view &data, auto &value) { return deserialize_reuse(data, value); });
+}
+
+// Appends to data a patch that turns baseline into value when merged into it
+// (see apply_delta). Only changed scalar fields, appended repeated elements and
+// recursive deltas of changed submessages are written. Merge semantics cannot
+// express removals, so false is returned and nothing is written when a repeated
+// field is not an extension of its baseline or a submessage was cleared; the
+// caller should send a full snapshot instead.
+template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+inline bool serialize_delta_to_string(const T &baseline, const T &value, std::string &data)
+{
+    if (!type_traits<T>::delta_compatible(baseline, value))
+    {
+        return false;
+    }
+
+    auto size = data.size() + type_traits<T>::delta_size(baseline, value);
+    if (data.capacity() < size)
+    {
+        data.reserve(size);
+    }
+    type_traits<T>::serialize_delta(baseline, value, data);
+
+    return true;
+}
+
+template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+inline bool apply_delta(std::string_view &data, T &value)
+{
+    return merge(data, value);
+}
+
 } // namespace protoflat
@@ -0,0 +1,269 @@
+#pragma once
+
+#include <protoflat_columns.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Arrow C data interface, copied verbatim from the specification so that no Arrow
+// dependency is needed: https://arrow.apache.org/docs/format/CDataInterface.html
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema
+{
+    // Array type description
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+
+    // Release callback
+    void (*release)(struct ArrowSchema *);
+    // Opaque producer-specific data
+    void *private_data;
+};
+
+struct ArrowArray
+{
+    // Array data description
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+
+    // Release callback
+    void (*release)(struct ArrowArray *);
+    // Opaque producer-specific data
+    void *private_data;
+};
+
+#endif // ARROW_C_DATA_INTERFACE
+
+namespace protoflat
+{
+
+namespace arrow
+{
+
+struct schema_private
+{
+    std::string format;
+    std::string name;
+    std::vector<ArrowSchema *> children;
+};
+
+struct array_private
+{
+    // Keeps the exported columns alive until every array referencing them is released.
+    std::shared_ptr<const void> owner;
+    std::vector<const void *> buffers;
+    std::vector<ArrowArray *> children;
+};
+
+inline void release_schema(ArrowSchema *schema)
+{
+    auto private_data = static_cast<schema_private *>(schema->private_data);
+    for (auto child : private_data->children)
+    {
+        if (child->release)
+        {
+            child->release(child);
+        }
+        delete child;
+    }
+    delete private_data;
+
+    schema->release = nullptr;
+}
+
+inline void release_array(ArrowArray *array)
+{
+    auto private_data = static_cast<array_private *>(array->private_data);
+    for (auto child : private_data->children)
+    {
+        if (child->release)
+        {
+            child->release(child);
+        }
+        delete child;
+    }
+    delete private_data;
+
+    array->release = nullptr;
+}
+
+inline void init_schema(ArrowSchema *schema, std::string format, std::string_view name, int64_t flags, size_t children_count)
+{
+    auto private_data = new schema_private{std::move(format), std::string(name), {}};
+    for (size_t i = 0; i < children_count; ++i)
+    {
+        private_data->children.push_back(new ArrowSchema{});
+    }
+
+    *schema = ArrowSchema{};
+    schema->format = private_data->format.c_str();
+    schema->name = private_data->name.c_str();
+    schema->flags = flags;
+    schema->n_children = static_cast<int64_t>(children_count);
+    schema->children = private_data->children.data();
+    schema->release = release_schema;
+    schema->private_data = private_data;
+}
+
+inline void init_array(ArrowArray *array, const std::shared_ptr<const void> &owner, size_t length, size_t null_count, std::vector<const void *> buffers, size_t children_count)
+{
+    auto private_data = new array_private{owner, std::move(buffers), {}};
+    for (size_t i = 0; i < children_count; ++i)
+    {
+        private_data->children.push_back(new ArrowArray{});
+    }
+
+    *array = ArrowArray{};
+    array->length = static_cast<int64_t>(length);
+    array->null_count = static_cast<int64_t>(null_count);
+    array->n_buffers = static_cast<int64_t>(private_data->buffers.size());
+    array->n_children = static_cast<int64_t>(children_count);
+    array->buffers = private_data->buffers.data();
+    array->children = private_data->children.data();
+    array->release = release_array;
+    array->private_data = private_data;
+}
+
+template<class T>
+inline std::string format()
+{
+    if constexpr (std::is_enum_v<T>)
+    {
+        return format<std::underlying_type_t<T>>();
+    }
+    else if constexpr (std::is_floating_point_v<T>)
+    {
+        return sizeof(T) == 4 ? "f" : "g";
+    }
+    else
+    {
+        static_assert(std::is_integral_v<T> && (sizeof(T) == 4 || sizeof(T) == 8));
+        if constexpr (sizeof(T) == 4)
+        {
+            return std::is_signed_v<T> ? "i" : "I";
+        }
+        else
+        {
+            return std::is_signed_v<T> ? "l" : "L";
+        }
+    }
+}
+
+inline size_t null_count(const bitmap &validity)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < validity.size(); ++i)
+    {
+        count += !validity[i];
+    }
+
+    return count;
+}
+
+// Every column type exports itself as one Arrow array without copying: the Arrow
+// buffers point straight into the column vectors.
+template<class T>
+inline void export_column(const std::vector<T> &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array);
+inline void export_column(const bitmap &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array);
+inline void export_column(const binary_column &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array);
+inline void export_column(const utf8_column &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array);
+template<class Values>
+inline void export_column(const list_column<Values> &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array);
+template<class T>
+inline void export_column(const struct_column<T> &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array);
+template<class T>
+inline void export_column(const columns<T> &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array);
+
+template<class T>
+inline void export_column(const std::vector<T> &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array)
+{
+    init_schema(schema, format<T>(), name, 0, 0);
+    init_array(array, owner, length, 0, {nullptr, column.data()}, 0);
+}
+
+inline void export_column(const bitmap &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array)
+{
+    init_schema(schema, "b", name, 0, 0);
+    init_array(array, owner, length, 0, {nullptr, column.bits.data()}, 0);
+}
+
+inline void export_column(const binary_column &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array)
+{
+    init_schema(schema, "Z", name, 0, 0);
+    init_array(array, owner, length, 0, {nullptr, column.offsets.data(), column.data.data()}, 0);
+}
+
+inline void export_column(const utf8_column &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array)
+{
+    init_schema(schema, "U", name, 0, 0);
+    init_array(array, owner, length, 0, {nullptr, column.offsets.data(), column.data.data()}, 0);
+}
+
+template<class Values>
+inline void export_column(const list_column<Values> &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array)
+{
+    init_schema(schema, "+L", name, 0, 1);
+    init_array(array, owner, length, 0, {nullptr, column.offsets.data()}, 1);
+    export_column(column.values, column.offsets.back(), "item", owner, schema->children[0], array->children[0]);
+}
+
+template<class T>
+inline void export_fields(const columns<T> &column, size_t length, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array)
+{
+    size_t index = 0;
+    type_traits<columns<T>>::visit(column, [&](std::string_view field_name, const auto &field) {
+        export_column(field, length, field_name, owner, schema->children[index], array->children[index]);
+        ++index;
+    });
+}
+
+template<class T>
+inline void export_column(const struct_column<T> &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array)
+{
+    init_schema(schema, "+s", name, ARROW_FLAG_NULLABLE, type_traits<columns<T>>::field_count);
+    init_array(array, owner, length, null_count(column.validity), {column.validity.bits.data()}, type_traits<columns<T>>::field_count);
+    export_fields(column.fields, length, owner, schema, array);
+}
+
+template<class T>
+inline void export_column(const columns<T> &column, size_t length, std::string_view name, const std::shared_ptr<const void> &owner, ArrowSchema *schema, ArrowArray *array)
+{
+    init_schema(schema, "+s", name, 0, type_traits<columns<T>>::field_count);
+    init_array(array, owner, length, 0, {nullptr}, type_traits<columns<T>>::field_count);
+    export_fields(column, length, owner, schema, array);
+}
+
+} // namespace arrow
+
+// Hands batch over to an Arrow consumer as a struct array with one child per field.
+// The batch is moved into storage shared by the exported arrays and freed once the
+// consumer has released all of them, so no values are copied.
+template<class T>
+inline void export_arrow(column_batch<T> &&batch, ArrowSchema *schema, ArrowArray *array)
+{
+    auto owner = std::make_shared<const column_batch<T>>(std::move(batch));
+    arrow::export_column(owner->fields, owner->size, "", owner, schema, array);
+}
+
+} // namespace protoflat
@@ -0,0 +1,580 @@
+#pragma once
+
+#include <protoflat.h>
+
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace protoflat
+{
+
+// Coroutine based message streams over non-blocking file descriptors (Linux).
+// Messages are framed like embedded messages: a varint length followed by the
+// serialized message, so a stream is a sequence of embedded_message<T>.
+//
+//   protoflat::task<> session(protoflat::epoll_executor &executor, int fd)
+//   {
+//       protoflat::async_stream stream(executor, fd);
+//       test::Message message;
+//       while (co_await stream.read_message(message))
+//       {
+//           if (!co_await stream.write_message(message))
+//           {
+//               break;
+//           }
+//       }
+//       executor.forget(fd);
+//       close(fd);
+//   }
+//
+//   executor.spawn(session(executor, fd));
+//   executor.run();
+//
+// An executor and the streams using it belong to one thread; run one executor per
+// thread and distribute connections between them to use several cores.
+template<class T = void>
+class task;
+
+namespace async
+{
+
+struct promise_base
+{
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+
+    struct final_awaiter
+    {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        template<class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            return handle.promise().continuation;
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    final_awaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    // Errors are reported through return values, as everywhere else in protoflat.
+    void unhandled_exception() noexcept
+    {
+        std::terminate();
+    }
+};
+
+template<class T>
+struct promise : promise_base
+{
+    std::optional<T> value;
+
+    task<T> get_return_object();
+
+    void return_value(T result)
+    {
+        value = std::move(result);
+    }
+
+    T result()
+    {
+        return std::move(*value);
+    }
+};
+
+template<>
+struct promise<void> : promise_base
+{
+    task<void> get_return_object();
+
+    void return_void()
+    {
+    }
+
+    void result()
+    {
+    }
+};
+
+// Runs a task to completion without anyone awaiting it; the frame frees itself.
+struct detached
+{
+    struct promise_type
+    {
+        detached get_return_object()
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+} // namespace async
+
+// Lazily started coroutine: the body runs when the task is awaited and the awaiting
+// coroutine is resumed once it finishes.
+template<class T>
+class task
+{
+public:
+    using promise_type = async::promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> handle)
+        : _handle(handle)
+    {
+    }
+
+    task(task &&another) noexcept
+        : _handle(std::exchange(another._handle, {}))
+    {
+    }
+
+    task &operator=(task &&another) noexcept
+    {
+        if (this != &another)
+        {
+            if (_handle)
+            {
+                _handle.destroy();
+            }
+            _handle = std::exchange(another._handle, {});
+        }
+
+        return *this;
+    }
+
+    ~task()
+    {
+        if (_handle)
+        {
+            _handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+    {
+        _handle.promise().continuation = continuation;
+        return _handle;
+    }
+
+    T await_resume()
+    {
+        return _handle.promise().result();
+    }
+
+private:
+    std::coroutine_handle<promise_type> _handle;
+};
+
+template<class T>
+inline task<T> async::promise<T>::get_return_object()
+{
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> async::promise<void>::get_return_object()
+{
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+// Reference executor: suspends coroutines until their descriptor is ready and
+// resumes them from run(). Descriptors are registered on first wait and stay
+// registered until forget, which must be called before closing them.
+class epoll_executor
+{
+public:
+    epoll_executor()
+        : _epoll(epoll_create1(EPOLL_CLOEXEC))
+    {
+    }
+
+    epoll_executor(const epoll_executor &) = delete;
+    epoll_executor &operator=(const epoll_executor &) = delete;
+
+    ~epoll_executor()
+    {
+        if (_epoll >= 0)
+        {
+            close(_epoll);
+        }
+    }
+
+    bool is_valid() const
+    {
+        return _epoll >= 0;
+    }
+
+    struct wait_awaiter
+    {
+        epoll_executor &executor;
+        int fd;
+        bool is_write;
+        bool is_registered = true;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            is_registered = executor.wait(fd, is_write, handle);
+            return is_registered;
+        }
+
+        // False when the descriptor could not be watched, e.g. it is a regular file.
+        bool await_resume() const noexcept
+        {
+            return is_registered;
+        }
+    };
+
+    wait_awaiter readable(int fd)
+    {
+        return {*this, fd, false};
+    }
+
+    wait_awaiter writable(int fd)
+    {
+        return {*this, fd, true};
+    }
+
+    // Coroutines still waiting on fd are never resumed.
+    void forget(int fd)
+    {
+        auto it = _descriptors.find(fd);
+        if (it == _descriptors.end())
+        {
+            return;
+        }
+
+        _waiting_count -= (it->second.reader ? 1 : 0) + (it->second.writer ? 1 : 0);
+        if (it->second.is_added)
+        {
+            epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        _descriptors.erase(it);
+    }
+
+    // Starts the task right away; it runs until its first suspension and later from run().
+    void spawn(task<> value)
+    {
+        [](task<> value) -> async::detached {
+            co_await value;
+        }(std::move(value));
+    }
+
+    // Resumes waiting coroutines until none are left or stop is called.
+    bool run()
+    {
+        _is_stopped = false;
+
+        constexpr int max_events = 64;
+        epoll_event events[max_events];
+        while (!_is_stopped && _waiting_count != 0)
+        {
+            auto count = epoll_wait(_epoll, events, max_events, -1);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+
+            for (int i = 0; i < count; ++i)
+            {
+                auto it = _descriptors.find(events[i].data.fd);
+                if (it == _descriptors.end())
+                {
+                    continue;
+                }
+
+                // Errors and hang ups wake both sides so they can observe them.
+                auto flags = events[i].events;
+                auto failed = (flags & (EPOLLERR | EPOLLHUP)) != 0;
+                auto &descriptor = it->second;
+                auto reader = (flags & EPOLLIN) || failed ? std::exchange(descriptor.reader, {}) : std::coroutine_handle<>{};
+                auto writer = (flags & EPOLLOUT) || failed ? std::exchange(descriptor.writer, {}) : std::coroutine_handle<>{};
+                _waiting_count -= (reader ? 1 : 0) + (writer ? 1 : 0);
+                arm(it->first, descriptor);
+
+                if (reader)
+                {
+                    reader.resume();
+                }
+                if (writer)
+                {
+                    writer.resume();
+                }
+            }
+        }
+
+        return true;
+    }
+
+    void stop()
+    {
+        _is_stopped = true;
+    }
+
+private:
+    struct descriptor_state
+    {
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+        bool is_added = false;
+    };
+
+    bool wait(int fd, bool is_write, std::coroutine_handle<> handle)
+    {
+        auto &descriptor = _descriptors[fd];
+        (is_write ? descriptor.writer : descriptor.reader) = handle;
+        if (!arm(fd, descriptor))
+        {
+            (is_write ? descriptor.writer : descriptor.reader) = {};
+            return false;
+        }
+        ++_waiting_count;
+
+        return true;
+    }
+
+    // One-shot registration for whichever sides are waiting, so a descriptor never
+    // wakes the loop for a side nobody waits on.
+    bool arm(int fd, descriptor_state &descriptor)
+    {
+        if (!descriptor.reader && !descriptor.writer)
+        {
+            return true;
+        }
+
+        epoll_event event{};
+        event.events = EPOLLONESHOT | (descriptor.reader ? EPOLLIN | EPOLLRDHUP : 0u) | (descriptor.writer ? EPOLLOUT : 0u);
+        event.data.fd = fd;
+        if (epoll_ctl(_epoll, descriptor.is_added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            return false;
+        }
+        descriptor.is_added = true;
+
+        return true;
+    }
+
+    int _epoll;
+    std::unordered_map<int, descriptor_state> _descriptors;
+    size_t _waiting_count = 0;
+    bool _is_stopped = false;
+};
+
+// Buffered message stream over a non-blocking descriptor. Reads pull in whatever
+// bytes are available and decode a message once its whole frame has arrived, so
+// several small messages cost one read call; writes are flushed before returning.
+// A frame longer than max_message_size marks the stream malformed as soon as its
+// length is read, so a peer cannot make the input buffer grow without bound.
+class async_stream
+{
+public:
+    static constexpr size_t default_max_message_size = 64 << 20;
+
+    async_stream(epoll_executor &executor, int fd, size_t read_size = 64 * 1024, size_t max_message_size = default_max_message_size)
+        : _executor(executor)
+        , _fd(fd)
+        , _read_size(read_size)
+        , _max_message_size(max_message_size)
+    {
+    }
+
+    int fd() const
+    {
+        return _fd;
+    }
+
+    // Completes with false on end of stream, read errors and malformed frames.
+    template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+    task<bool> read_message(T &value)
+    {
+        std::string_view frame;
+        while (!next_frame(frame))
+        {
+            if (_is_malformed || !co_await fill())
+            {
+                co_return false;
+            }
+        }
+
+        co_return deserialize(frame, value);
+    }
+
+    // Completes with false when the descriptor fails; the message may then be
+    // partially written.
+    template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+    task<bool> write_message(const T &value)
+    {
+        type_traits<embedded_message<T>>::serialize(value, _output);
+        co_return co_await flush();
+    }
+
+    // Queues a message without writing it, e.g. to send a batch with one flush.
+    template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+    void queue_message(const T &value)
+    {
+        type_traits<embedded_message<T>>::serialize(value, _output);
+    }
+
+    task<bool> flush()
+    {
+        size_t written = 0;
+        while (written < _output.size())
+        {
+            auto size = write(_fd, _output.data() + written, _output.size() - written);
+            if (size >= 0)
+            {
+                written += size;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (!co_await _executor.writable(_fd))
+                {
+                    co_return false;
+                }
+            }
+            else if (errno != EINTR)
+            {
+                _output.erase(0, written);
+                co_return false;
+            }
+        }
+        _output.clear();
+
+        co_return true;
+    }
+
+private:
+    // Takes the next complete frame out of the input buffer.
+    bool next_frame(std::string_view &frame)
+    {
+        std::string_view input(_input);
+        input.remove_prefix(_consumed);
+
+        auto data = input;
+        uint64_t size = 0;
+        if (!type_traits<varint>::deserialize(data, size))
+        {
+            // Up to 10 bytes may just be an incomplete length.
+            _is_malformed = input.size() >= 10;
+            return false;
+        }
+        if (size > _max_message_size)
+        {
+            _is_malformed = true;
+            return false;
+        }
+        if (data.size() < size)
+        {
+            return false;
+        }
+
+        frame = data.substr(0, size);
+        _consumed += input.size() - data.size() + size;
+
+        return true;
+    }
+
+    task<bool> fill()
+    {
+        // Drops consumed bytes before growing, so the buffer stays about one read in size.
+        if (_consumed != 0)
+        {
+            _input.erase(0, _consumed);
+            _consumed = 0;
+        }
+
+        while (true)
+        {
+            auto start = _input.size();
+            _input.resize(start + _read_size);
+            auto size = read(_fd, _input.data() + start, _read_size);
+            _input.resize(start + (size > 0 ? size : 0));
+
+            if (size > 0)
+            {
+                co_return true;
+            }
+            if (size == 0)
+            {
+                co_return false;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (!co_await _executor.readable(_fd))
+                {
+                    co_return false;
+                }
+            }
+            else if (errno != EINTR)
+            {
+                co_return false;
+            }
+        }
+    }
+
+    epoll_executor &_executor;
+    int _fd;
+    size_t _read_size;
+    size_t _max_message_size;
+
+    std::string _input;
+    size_t _consumed = 0;
+    bool _is_malformed = false;
+    std::string _output;
+};
+
+} // namespace protoflat
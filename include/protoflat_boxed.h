@@ -0,0 +1,109 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+
+namespace protoflat
+{
+
+// Out-of-line optional value: the std::optional interface used by protoflat on top
+// of a heap allocation, so an unset field costs one pointer and T may be incomplete
+// where the field is declared. Copies are deep. Generated messages use it for
+// submessages marked with (protoflat.boxed).
+template<class T>
+class boxed
+{
+public:
+    using value_type = T;
+
+    boxed() = default;
+
+    boxed(const T &value)
+        : _value(std::make_unique<T>(value))
+    {
+    }
+
+    boxed(T &&value)
+        : _value(std::make_unique<T>(std::move(value)))
+    {
+    }
+
+    boxed(const boxed &another)
+        : _value(another ? std::make_unique<T>(*another) : nullptr)
+    {
+    }
+
+    boxed(boxed &&another) noexcept = default;
+
+    boxed &operator=(const boxed &another)
+    {
+        if (!another)
+        {
+            reset();
+        }
+        else if (_value)
+        {
+            *_value = *another;
+        }
+        else
+        {
+            _value = std::make_unique<T>(*another);
+        }
+
+        return *this;
+    }
+
+    boxed &operator=(boxed &&another) noexcept = default;
+
+    explicit operator bool() const
+    {
+        return _value != nullptr;
+    }
+
+    bool has_value() const
+    {
+        return _value != nullptr;
+    }
+
+    T &operator*()
+    {
+        return *_value;
+    }
+
+    const T &operator*() const
+    {
+        return *_value;
+    }
+
+    T *operator->()
+    {
+        return _value.get();
+    }
+
+    const T *operator->() const
+    {
+        return _value.get();
+    }
+
+    template<class... Args>
+    T &emplace(Args &&...args)
+    {
+        _value = std::make_unique<T>(std::forward<Args>(args)...);
+        return *_value;
+    }
+
+    void reset()
+    {
+        _value.reset();
+    }
+
+    friend bool operator==(const boxed &a, const boxed &b)
+    {
+        return a && b ? *a == *b : !a && !b;
+    }
+
+private:
+    std::unique_ptr<T> _value;
+};
+
+} // namespace protoflat
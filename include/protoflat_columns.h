@@ -0,0 +1,227 @@
+#pragma once
+
+#include <protoflat.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace protoflat
+{
+
+// Struct-of-arrays storage for decoded messages. Every column holds one entry per
+// row and is laid out like the matching Arrow array: bits are packed LSB first and
+// variable length entries are addressed by int64 offsets with a leading zero, as in
+// Arrow's large binary, string and list types, so a batch cannot outgrow them.
+// columns<T> is generated per message when protoc-gen-protoflat runs with the
+// "columns" parameter.
+template<class T>
+struct columns;
+
+struct bitmap
+{
+    std::vector<uint8_t> bits;
+    size_t length = 0;
+
+    size_t size() const
+    {
+        return length;
+    }
+
+    bool operator[](size_t index) const
+    {
+        return (bits[index / 8] >> (index % 8)) & 1;
+    }
+
+    void push_back(bool value)
+    {
+        if (length % 8 == 0)
+        {
+            bits.push_back(0);
+        }
+        ++length;
+        assign_back(value);
+    }
+
+    void emplace_back()
+    {
+        push_back(false);
+    }
+
+    void assign_back(bool value)
+    {
+        auto index = length - 1;
+        auto mask = static_cast<uint8_t>(1 << (index % 8));
+        bits[index / 8] = value ? bits[index / 8] | mask : bits[index / 8] & ~mask;
+    }
+
+    void clear()
+    {
+        bits.clear();
+        length = 0;
+    }
+
+    using value_type = bool;
+};
+
+struct binary_column
+{
+    std::vector<int64_t> offsets{0};
+    std::string data;
+
+    size_t size() const
+    {
+        return offsets.size() - 1;
+    }
+
+    std::string_view operator[](size_t index) const
+    {
+        return std::string_view(data).substr(offsets[index], offsets[index + 1] - offsets[index]);
+    }
+
+    void push_back(std::string_view value)
+    {
+        data.append(value);
+        offsets.push_back(static_cast<int64_t>(data.size()));
+    }
+
+    void emplace_back()
+    {
+        offsets.push_back(offsets.back());
+    }
+
+    void assign_back(std::string_view value)
+    {
+        data.resize(offsets[offsets.size() - 2]);
+        data.append(value);
+        offsets.back() = static_cast<int64_t>(data.size());
+    }
+
+    void clear()
+    {
+        offsets.assign(1, 0);
+        data.clear();
+    }
+};
+
+// Same layout as binary_column, kept apart so that string fields can be told from
+// bytes fields, e.g. when exporting to Arrow.
+struct utf8_column : binary_column
+{
+};
+
+// Repeated fields: entry i spans values[offsets[i]..offsets[i + 1]).
+template<class Values>
+struct list_column
+{
+    std::vector<int64_t> offsets{0};
+    Values values;
+
+    size_t size() const
+    {
+        return offsets.size() - 1;
+    }
+
+    void emplace_back()
+    {
+        offsets.push_back(offsets.back());
+    }
+
+    void clear()
+    {
+        offsets.assign(1, 0);
+        if constexpr (requires { values.clear(); })
+        {
+            values.clear();
+        }
+        else
+        {
+            type_traits<Values>::clear(values);
+        }
+    }
+};
+
+// Singular submessages: absent rows have their validity bit unset and default
+// values in the child columns.
+template<class T>
+struct struct_column
+{
+    bitmap validity;
+    columns<T> fields;
+
+    size_t size() const
+    {
+        return validity.size();
+    }
+
+    void emplace_back()
+    {
+        validity.emplace_back();
+        type_traits<columns<T>>::emplace_back(fields);
+    }
+
+    void clear()
+    {
+        validity.clear();
+        type_traits<columns<T>>::clear(fields);
+    }
+};
+
+template<class T>
+struct column_batch
+{
+    columns<T> fields;
+    size_t size = 0;
+
+    void clear()
+    {
+        type_traits<columns<T>>::clear(fields);
+        size = 0;
+    }
+};
+
+// Decodes one serialized T straight into a new row of batch. The row is kept even
+// if decoding fails so that all columns stay the same length.
+template<class T>
+inline bool append_row(std::string_view data, column_batch<T> &batch)
+{
+    type_traits<columns<T>>::emplace_back(batch.fields);
+    ++batch.size;
+
+    return type_traits<columns<T>>::deserialize(data, batch.fields);
+}
+
+// Appends a row for every occurrence of the repeated message field described by
+// header in a serialized parent message, skipping all other fields, e.g.
+// append_field_rows(data, type_traits<test::Message>::data_header, batch).
+template<class T>
+inline bool append_field_rows(std::string_view data, field_header header, column_batch<T> &batch)
+{
+    while (!data.empty())
+    {
+        uint64_t header_value = 0;
+        if (!type_traits<varint>::deserialize(data, header_value))
+        {
+            return false;
+        }
+
+        auto field = field_header::decode(header_value);
+        if (field.field_number == header.field_number && field.field_type == wire_type::length_delimited)
+        {
+            std::string_view message_data;
+            if (!type_traits<length_delimited>::deserialize(data, message_data) || !append_row(message_data, batch))
+            {
+                return false;
+            }
+        }
+        else if (!skip_field(data, field.field_type))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+} // namespace protoflat
@@ -0,0 +1,1127 @@
+#pragma once
+
+#include <protoflat.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+namespace protoflat
+{
+
+// The part of google/protobuf/descriptor.proto the dynamic codec needs. These are
+// decoded with protoflat's own table codec, so loading a schema needs no libprotobuf.
+namespace descriptor
+{
+
+struct FieldOptions
+{
+    std::optional<bool> packed;
+
+    bool operator==(const FieldOptions &) const = default;
+};
+
+struct FieldDescriptorProto
+{
+    enum Type
+    {
+        TYPE_DOUBLE = 1,
+        TYPE_FLOAT = 2,
+        TYPE_INT64 = 3,
+        TYPE_UINT64 = 4,
+        TYPE_INT32 = 5,
+        TYPE_FIXED64 = 6,
+        TYPE_FIXED32 = 7,
+        TYPE_BOOL = 8,
+        TYPE_STRING = 9,
+        TYPE_GROUP = 10,
+        TYPE_MESSAGE = 11,
+        TYPE_BYTES = 12,
+        TYPE_UINT32 = 13,
+        TYPE_ENUM = 14,
+        TYPE_SFIXED32 = 15,
+        TYPE_SFIXED64 = 16,
+        TYPE_SINT32 = 17,
+        TYPE_SINT64 = 18,
+    };
+
+    enum Label
+    {
+        LABEL_OPTIONAL = 1,
+        LABEL_REQUIRED = 2,
+        LABEL_REPEATED = 3,
+    };
+
+    std::string name;
+    int32_t number = 0;
+    int32_t label = 0;
+    int32_t type = 0;
+    std::string type_name;
+    std::optional<FieldOptions> options;
+    std::optional<int32_t> oneof_index;
+    std::string json_name;
+    bool proto3_optional = false;
+
+    bool operator==(const FieldDescriptorProto &) const = default;
+};
+
+struct DescriptorProto
+{
+    std::string name;
+    std::vector<FieldDescriptorProto> field;
+    std::vector<DescriptorProto> nested_type;
+
+    bool operator==(const DescriptorProto &) const = default;
+};
+
+struct FileDescriptorProto
+{
+    std::string name;
+    std::string package;
+    std::vector<DescriptorProto> message_type;
+    std::string syntax;
+
+    bool operator==(const FileDescriptorProto &) const = default;
+};
+
+struct FileDescriptorSet
+{
+    std::vector<FileDescriptorProto> file;
+
+    bool operator==(const FileDescriptorSet &) const = default;
+};
+
+} // namespace descriptor
+
+template<>
+struct type_traits<descriptor::FieldOptions>
+{
+    inline static constexpr field_entry fields[] = {
+        {field_header::encode({2, wire_type::varint}), offsetof(descriptor::FieldOptions, packed), &codec::instance<codec::optional<varint, std::optional<bool>>>},
+    };
+    inline static constexpr message_table table{fields, 1};
+
+    static size_t size(const descriptor::FieldOptions &value)
+    {
+        return table_size(table, &value);
+    }
+
+    static void serialize(const descriptor::FieldOptions &value, std::string &data)
+    {
+        table_serialize(table, &value, data);
+    }
+
+    template<decode_mode mode = decode_mode::merge>
+    static bool deserialize(std::string_view &data, descriptor::FieldOptions &value)
+    {
+        return table_deserialize(table, data, &value);
+    }
+};
+
+template<>
+struct type_traits<descriptor::FieldDescriptorProto>
+{
+    inline static constexpr field_entry fields[] = {
+        {field_header::encode({1, wire_type::length_delimited}), offsetof(descriptor::FieldDescriptorProto, name), &codec::instance<codec::singular<length_delimited, std::string>>},
+        {field_header::encode({3, wire_type::varint}), offsetof(descriptor::FieldDescriptorProto, number), &codec::instance<codec::singular<varint, int32_t>>},
+        {field_header::encode({4, wire_type::varint}), offsetof(descriptor::FieldDescriptorProto, label), &codec::instance<codec::singular<varint, int32_t>>},
+        {field_header::encode({5, wire_type::varint}), offsetof(descriptor::FieldDescriptorProto, type), &codec::instance<codec::singular<varint, int32_t>>},
+        {field_header::encode({6, wire_type::length_delimited}), offsetof(descriptor::FieldDescriptorProto, type_name), &codec::instance<codec::singular<length_delimited, std::string>>},
+        {field_header::encode({8, wire_type::length_delimited}), offsetof(descriptor::FieldDescriptorProto, options), &codec::instance<codec::message<std::optional<descriptor::FieldOptions>>>},
+        {field_header::encode({9, wire_type::varint}), offsetof(descriptor::FieldDescriptorProto, oneof_index), &codec::instance<codec::optional<varint, std::optional<int32_t>>>},
+        {field_header::encode({10, wire_type::length_delimited}), offsetof(descriptor::FieldDescriptorProto, json_name), &codec::instance<codec::singular<length_delimited, std::string>>},
+        {field_header::encode({17, wire_type::varint}), offsetof(descriptor::FieldDescriptorProto, proto3_optional), &codec::instance<codec::singular<varint, bool>>},
+    };
+    inline static constexpr message_table table{fields, 9};
+
+    static size_t size(const descriptor::FieldDescriptorProto &value)
+    {
+        return table_size(table, &value);
+    }
+
+    static void serialize(const descriptor::FieldDescriptorProto &value, std::string &data)
+    {
+        table_serialize(table, &value, data);
+    }
+
+    template<decode_mode mode = decode_mode::merge>
+    static bool deserialize(std::string_view &data, descriptor::FieldDescriptorProto &value)
+    {
+        return table_deserialize(table, data, &value);
+    }
+};
+
+template<>
+struct type_traits<descriptor::DescriptorProto>
+{
+    inline static constexpr field_entry fields[] = {
+        {field_header::encode({1, wire_type::length_delimited}), offsetof(descriptor::DescriptorProto, name), &codec::instance<codec::singular<length_delimited, std::string>>},
+        {field_header::encode({2, wire_type::length_delimited}), offsetof(descriptor::DescriptorProto, field), &codec::instance<codec::repeated_message<std::vector<descriptor::FieldDescriptorProto>>>},
+        {field_header::encode({3, wire_type::length_delimited}), offsetof(descriptor::DescriptorProto, nested_type), &codec::instance<codec::repeated_message<std::vector<descriptor::DescriptorProto>>>},
+    };
+    inline static constexpr message_table table{fields, 3};
+
+    static size_t size(const descriptor::DescriptorProto &value)
+    {
+        return table_size(table, &value);
+    }
+
+    static void serialize(const descriptor::DescriptorProto &value, std::string &data)
+    {
+        table_serialize(table, &value, data);
+    }
+
+    template<decode_mode mode = decode_mode::merge>
+    static bool deserialize(std::string_view &data, descriptor::DescriptorProto &value)
+    {
+        return table_deserialize(table, data, &value);
+    }
+};
+
+template<>
+struct type_traits<descriptor::FileDescriptorProto>
+{
+    inline static constexpr field_entry fields[] = {
+        {field_header::encode({1, wire_type::length_delimited}), offsetof(descriptor::FileDescriptorProto, name), &codec::instance<codec::singular<length_delimited, std::string>>},
+        {field_header::encode({2, wire_type::length_delimited}), offsetof(descriptor::FileDescriptorProto, package), &codec::instance<codec::singular<length_delimited, std::string>>},
+        {field_header::encode({4, wire_type::length_delimited}), offsetof(descriptor::FileDescriptorProto, message_type), &codec::instance<codec::repeated_message<std::vector<descriptor::DescriptorProto>>>},
+        {field_header::encode({12, wire_type::length_delimited}), offsetof(descriptor::FileDescriptorProto, syntax), &codec::instance<codec::singular<length_delimited, std::string>>},
+    };
+    inline static constexpr message_table table{fields, 4};
+
+    static size_t size(const descriptor::FileDescriptorProto &value)
+    {
+        return table_size(table, &value);
+    }
+
+    static void serialize(const descriptor::FileDescriptorProto &value, std::string &data)
+    {
+        table_serialize(table, &value, data);
+    }
+
+    template<decode_mode mode = decode_mode::merge>
+    static bool deserialize(std::string_view &data, descriptor::FileDescriptorProto &value)
+    {
+        return table_deserialize(table, data, &value);
+    }
+};
+
+template<>
+struct type_traits<descriptor::FileDescriptorSet>
+{
+    inline static constexpr field_entry fields[] = {
+        {field_header::encode({1, wire_type::length_delimited}), offsetof(descriptor::FileDescriptorSet, file), &codec::instance<codec::repeated_message<std::vector<descriptor::FileDescriptorProto>>>},
+    };
+    inline static constexpr message_table table{fields, 1};
+
+    static size_t size(const descriptor::FileDescriptorSet &value)
+    {
+        return table_size(table, &value);
+    }
+
+    static void serialize(const descriptor::FileDescriptorSet &value, std::string &data)
+    {
+        table_serialize(table, &value, data);
+    }
+
+    template<decode_mode mode = decode_mode::merge>
+    static bool deserialize(std::string_view &data, descriptor::FileDescriptorSet &value)
+    {
+        return table_deserialize(table, data, &value);
+    }
+};
+
+// Codec for messages known only at run time, e.g. from a schema registry. A schema
+// compiles a serialized FileDescriptorSet (protoc --descriptor_set_out) into one
+// field table per message; messages are then decoded into a dynamic_message or
+// streamed to a visitor without materializing them.
+//
+//   protoflat::dynamic::schema schema;
+//   schema.load(descriptor_set);
+//   auto type = schema.find("test.Message");
+//   protoflat::dynamic::dynamic_message message(*type);
+//   message.deserialize(data);
+//   auto text = message.get_string(*type->find("text"));
+namespace dynamic
+{
+
+enum class field_kind : uint8_t
+{
+    int32,
+    int64,
+    uint32,
+    uint64,
+    sint32,
+    sint64,
+    fixed32,
+    fixed64,
+    sfixed32,
+    sfixed64,
+    float32,
+    float64,
+    boolean,
+    enumeration,
+    string,
+    bytes,
+    message
+};
+
+struct message_type;
+
+struct field
+{
+    std::string name;
+    std::string json_name;
+    uint32_t number = 0;
+    // Position in message_type::fields and in dynamic_message storage.
+    uint32_t index = 0;
+    field_kind kind = field_kind::int32;
+    bool is_repeated = false;
+    bool is_packed = false;
+    // Singular fields written whenever they are set, even to their default value:
+    // proto2 fields, proto3 optional fields, oneof members and submessages.
+    bool has_presence = false;
+    const message_type *message = nullptr;
+
+    bool is_scalar() const
+    {
+        return kind != field_kind::string && kind != field_kind::bytes && kind != field_kind::message;
+    }
+
+    // Wire type of a single element.
+    wire_type element_wire_type() const
+    {
+        switch (kind)
+        {
+        case field_kind::fixed32:
+        case field_kind::sfixed32:
+        case field_kind::float32:
+            return wire_type::fixed32;
+        case field_kind::fixed64:
+        case field_kind::sfixed64:
+        case field_kind::float64:
+            return wire_type::fixed64;
+        case field_kind::string:
+        case field_kind::bytes:
+        case field_kind::message:
+            return wire_type::length_delimited;
+        default:
+            return wire_type::varint;
+        }
+    }
+};
+
+struct message_type
+{
+    std::string full_name;
+    // Sorted by number.
+    std::vector<field> fields;
+    // Position + 1 of the field with a given number, for numbers below its size.
+    std::vector<uint32_t> number_index;
+
+    const field *find(uint32_t number) const
+    {
+        if (number < number_index.size())
+        {
+            auto position = number_index[number];
+            return position != 0 ? &fields[position - 1] : nullptr;
+        }
+
+        auto it = std::lower_bound(fields.begin(), fields.end(), number, [](const field &entry, uint32_t value) {
+            return entry.number < value;
+        });
+        return it != fields.end() && it->number == number ? &*it : nullptr;
+    }
+
+    const field *find(std::string_view name) const
+    {
+        for (auto &entry : fields)
+        {
+            if (entry.name == name)
+            {
+                return &entry;
+            }
+        }
+
+        return nullptr;
+    }
+};
+
+// Scalars are kept as 64-bit patterns: signed kinds sign-extended, unsigned kinds
+// zero-extended, bool as 0 or 1 and both float kinds as the bits of a double.
+template<class T>
+inline uint64_t to_bits(T value)
+{
+    if constexpr (std::is_floating_point_v<T>)
+    {
+        double number = value;
+        uint64_t bits = 0;
+        std::memcpy(&bits, &number, sizeof(bits));
+        return bits;
+    }
+    else if constexpr (std::is_signed_v<T> || std::is_enum_v<T>)
+    {
+        return static_cast<uint64_t>(static_cast<int64_t>(value));
+    }
+    else
+    {
+        return static_cast<uint64_t>(value);
+    }
+}
+
+template<class T>
+inline T from_bits(uint64_t bits)
+{
+    if constexpr (std::is_floating_point_v<T>)
+    {
+        double number = 0;
+        std::memcpy(&number, &bits, sizeof(number));
+        return static_cast<T>(number);
+    }
+    else if constexpr (std::is_same_v<T, bool>)
+    {
+        return bits != 0;
+    }
+    else
+    {
+        return static_cast<T>(bits);
+    }
+}
+
+namespace detail
+{
+
+inline size_t scalar_size(field_kind kind, uint64_t bits)
+{
+    switch (kind)
+    {
+    case field_kind::fixed32:
+    case field_kind::sfixed32:
+    case field_kind::float32:
+        return 4;
+    case field_kind::fixed64:
+    case field_kind::sfixed64:
+    case field_kind::float64:
+        return 8;
+    case field_kind::sint32:
+    case field_kind::sint64:
+        return type_traits<varint>::size(zigzag::encode(static_cast<int64_t>(bits)));
+    default:
+        return type_traits<varint>::size(bits);
+    }
+}
+
+inline void serialize_scalar(field_kind kind, uint64_t bits, std::string &data)
+{
+    switch (kind)
+    {
+    case field_kind::fixed32:
+    case field_kind::sfixed32:
+        type_traits<fixed>::serialize(static_cast<uint32_t>(bits), data);
+        break;
+    case field_kind::float32:
+        type_traits<fixed>::serialize(from_bits<float>(bits), data);
+        break;
+    case field_kind::fixed64:
+    case field_kind::sfixed64:
+    case field_kind::float64:
+        type_traits<fixed>::serialize(bits, data);
+        break;
+    case field_kind::sint32:
+    case field_kind::sint64:
+        type_traits<varint>::serialize(zigzag::encode(static_cast<int64_t>(bits)), data);
+        break;
+    default:
+        type_traits<varint>::serialize(bits, data);
+        break;
+    }
+}
+
+// Expects the element wire type of kind.
+inline bool deserialize_scalar(field_kind kind, std::string_view &data, uint64_t &bits)
+{
+    switch (kind)
+    {
+    case field_kind::fixed32:
+    case field_kind::sfixed32:
+    case field_kind::float32:
+    {
+        uint32_t value = 0;
+        if (!type_traits<fixed>::deserialize(data, value))
+        {
+            return false;
+        }
+        if (kind == field_kind::float32)
+        {
+            float number = 0;
+            std::memcpy(&number, &value, sizeof(number));
+            bits = to_bits(number);
+        }
+        else
+        {
+            bits = kind == field_kind::sfixed32 ? to_bits(static_cast<int32_t>(value)) : value;
+        }
+        return true;
+    }
+    case field_kind::fixed64:
+    case field_kind::sfixed64:
+    case field_kind::float64:
+        return type_traits<fixed>::deserialize(data, bits);
+    default:
+        break;
+    }
+
+    if (!type_traits<varint>::deserialize(data, bits))
+    {
+        return false;
+    }
+
+    switch (kind)
+    {
+    case field_kind::int32:
+    case field_kind::enumeration:
+        bits = to_bits(static_cast<int32_t>(bits));
+        break;
+    case field_kind::uint32:
+        bits = static_cast<uint32_t>(bits);
+        break;
+    case field_kind::sint32:
+        bits = to_bits(static_cast<int32_t>(zigzag::decode(static_cast<uint32_t>(bits))));
+        break;
+    case field_kind::sint64:
+        bits = to_bits(zigzag::decode(bits));
+        break;
+    case field_kind::boolean:
+        bits = bits != 0;
+        break;
+    default:
+        break;
+    }
+
+    return true;
+}
+
+// Calls on_element(bits) for every element of a packed run.
+template<class OnElement>
+inline bool deserialize_packed(field_kind kind, std::string_view &data, OnElement &&on_element)
+{
+    std::string_view packed_data;
+    if (!type_traits<length_delimited>::deserialize(data, packed_data))
+    {
+        return false;
+    }
+
+    while (!packed_data.empty())
+    {
+        uint64_t bits = 0;
+        if (!deserialize_scalar(kind, packed_data, bits))
+        {
+            return false;
+        }
+        on_element(bits);
+    }
+
+    return true;
+}
+
+} // namespace detail
+
+// Compiled message types. Types stay valid, at the same address, for the lifetime
+// of the schema; load can be called again to add more files.
+class schema
+{
+public:
+    schema() = default;
+    schema(const schema &) = delete;
+    schema &operator=(const schema &) = delete;
+
+    // Fails on malformed input, groups and references to types not loaded so far
+    // (files must come after their dependencies, as protoc writes them). A schema
+    // that failed to load may hold partially compiled types and should be dropped.
+    bool load(std::string_view file_descriptor_set)
+    {
+        descriptor::FileDescriptorSet set;
+        if (!deserialize(file_descriptor_set, set))
+        {
+            return false;
+        }
+
+        std::vector<std::pair<field *, std::string>> references;
+        for (auto &file : set.file)
+        {
+            auto prefix = file.package.empty() ? std::string() : file.package + ".";
+            for (auto &message : file.message_type)
+            {
+                if (!add_message(message, prefix, file.syntax, references))
+                {
+                    return false;
+                }
+            }
+        }
+
+        // Fully qualified names start with a dot.
+        for (auto &[field, type_name] : references)
+        {
+            auto type = type_name.starts_with('.') ? find(std::string_view(type_name).substr(1)) : nullptr;
+            if (type == nullptr)
+            {
+                return false;
+            }
+            field->message = type;
+        }
+
+        return true;
+    }
+
+    const message_type *find(std::string_view full_name) const
+    {
+        auto it = _types.find(full_name);
+        return it != _types.end() ? it->second : nullptr;
+    }
+
+private:
+    bool add_message(const descriptor::DescriptorProto &message, const std::string &prefix, const std::string &syntax, std::vector<std::pair<field *, std::string>> &references)
+    {
+        using descriptor::FieldDescriptorProto;
+
+        auto &type = _messages.emplace_back();
+        type.full_name = prefix + message.name;
+        if (!_types.emplace(type.full_name, &type).second)
+        {
+            return false;
+        }
+
+        bool is_proto3 = syntax == "proto3";
+        std::vector<std::pair<uint32_t, const std::string *>> type_names;
+        for (auto &source : message.field)
+        {
+            auto &entry = type.fields.emplace_back();
+            entry.name = source.name;
+            entry.json_name = source.json_name;
+            entry.number = source.number;
+            entry.is_repeated = source.label == FieldDescriptorProto::LABEL_REPEATED;
+
+            static constexpr field_kind kinds[] = {
+                field_kind::float64, field_kind::float32, field_kind::int64, field_kind::uint64, field_kind::int32, field_kind::fixed64,
+                field_kind::fixed32, field_kind::boolean, field_kind::string, field_kind::message, field_kind::message, field_kind::bytes,
+                field_kind::uint32, field_kind::enumeration, field_kind::sfixed32, field_kind::sfixed64, field_kind::sint32, field_kind::sint64};
+            if (source.type < FieldDescriptorProto::TYPE_DOUBLE || source.type > FieldDescriptorProto::TYPE_SINT64 || source.type == FieldDescriptorProto::TYPE_GROUP)
+            {
+                return false;
+            }
+            entry.kind = kinds[source.type - 1];
+
+            // Repeated scalars are packed by default since proto3.
+            bool is_packed = syntax != "proto2" && !syntax.empty();
+            if (source.options && source.options->packed)
+            {
+                is_packed = *source.options->packed;
+            }
+            entry.is_packed = entry.is_repeated && entry.is_scalar() && is_packed;
+            entry.has_presence = !entry.is_repeated && (!is_proto3 || entry.kind == field_kind::message || source.proto3_optional || source.oneof_index.has_value());
+            if (entry.kind == field_kind::message)
+            {
+                type_names.emplace_back(entry.number, &source.type_name);
+            }
+        }
+
+        std::sort(type.fields.begin(), type.fields.end(), [](const field &a, const field &b) { return a.number < b.number; });
+        for (uint32_t i = 0; i < type.fields.size(); ++i)
+        {
+            type.fields[i].index = i;
+        }
+        // The field vector no longer moves, so its elements can be referenced.
+        for (auto &[number, type_name] : type_names)
+        {
+            auto it = std::lower_bound(type.fields.begin(), type.fields.end(), number, [](const field &entry, uint32_t value) { return entry.number < value; });
+            references.emplace_back(&*it, *type_name);
+        }
+
+        // Dense lookup for the usual small field numbers.
+        constexpr uint32_t max_indexed_number = 256;
+        if (!type.fields.empty())
+        {
+            type.number_index.resize(std::min(type.fields.back().number, max_indexed_number) + 1);
+            for (auto &entry : type.fields)
+            {
+                if (entry.number <= max_indexed_number)
+                {
+                    type.number_index[entry.number] = entry.index + 1;
+                }
+            }
+        }
+
+        for (auto &nested : message.nested_type)
+        {
+            if (!add_message(nested, type.full_name + ".", syntax, references))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    std::deque<message_type> _messages;
+    std::map<std::string, const message_type *, std::less<>> _types;
+};
+
+// Message of a type compiled by a schema. Scalars are accessed as any arithmetic
+// type (see to_bits), strings and bytes as std::string_view.
+class dynamic_message
+{
+public:
+    dynamic_message() = default;
+
+    explicit dynamic_message(const message_type &type)
+        : _type(&type)
+    {
+        _slots.reserve(type.fields.size());
+        for (auto &entry : type.fields)
+        {
+            auto &slot = _slots.emplace_back();
+            if (entry.kind == field_kind::message)
+            {
+                slot.value.emplace<std::vector<dynamic_message>>();
+            }
+            else if (entry.is_repeated)
+            {
+                entry.is_scalar() ? void(slot.value.emplace<std::vector<uint64_t>>()) : void(slot.value.emplace<std::vector<std::string>>());
+            }
+            else if (!entry.is_scalar())
+            {
+                slot.value.emplace<std::string>();
+            }
+        }
+    }
+
+    const message_type *type() const
+    {
+        return _type;
+    }
+
+    // Singular fields: whether the field was set; repeated fields: whether it is not empty.
+    bool has(const field &entry) const
+    {
+        auto &slot = _slots[entry.index];
+        if (entry.kind == field_kind::message || entry.is_repeated)
+        {
+            return count(entry) != 0;
+        }
+
+        return slot.is_set;
+    }
+
+    // Number of elements of a repeated field.
+    size_t count(const field &entry) const
+    {
+        return std::visit(
+            [](const auto &value) -> size_t {
+                if constexpr (requires { value.size(); } && !std::is_same_v<std::decay_t<decltype(value)>, std::string>)
+                {
+                    return value.size();
+                }
+                else
+                {
+                    return 0;
+                }
+            },
+            _slots[entry.index].value);
+    }
+
+    template<class T>
+    T get(const field &entry, size_t index = 0) const
+    {
+        auto &slot = _slots[entry.index];
+        return from_bits<T>(entry.is_repeated ? std::get<std::vector<uint64_t>>(slot.value)[index] : std::get<uint64_t>(slot.value));
+    }
+
+    std::string_view get_string(const field &entry, size_t index = 0) const
+    {
+        auto &slot = _slots[entry.index];
+        return entry.is_repeated ? std::string_view(std::get<std::vector<std::string>>(slot.value)[index]) : std::string_view(std::get<std::string>(slot.value));
+    }
+
+    // Singular submessages must be present, see has.
+    const dynamic_message &get_message(const field &entry, size_t index = 0) const
+    {
+        return std::get<std::vector<dynamic_message>>(_slots[entry.index].value)[index];
+    }
+
+    template<class T>
+    void set(const field &entry, T value)
+    {
+        auto &slot = _slots[entry.index];
+        std::get<uint64_t>(slot.value) = to_bits(value);
+        slot.is_set = true;
+    }
+
+    void set_string(const field &entry, std::string_view value)
+    {
+        auto &slot = _slots[entry.index];
+        std::get<std::string>(slot.value).assign(value.data(), value.size());
+        slot.is_set = true;
+    }
+
+    template<class T>
+    void add(const field &entry, T value)
+    {
+        std::get<std::vector<uint64_t>>(_slots[entry.index].value).push_back(to_bits(value));
+    }
+
+    void add_string(const field &entry, std::string_view value)
+    {
+        std::get<std::vector<std::string>>(_slots[entry.index].value).emplace_back(value);
+    }
+
+    // Creates the submessage when it is absent.
+    dynamic_message &mutable_message(const field &entry)
+    {
+        auto &messages = std::get<std::vector<dynamic_message>>(_slots[entry.index].value);
+        if (messages.empty())
+        {
+            messages.emplace_back(*entry.message);
+        }
+
+        return messages.front();
+    }
+
+    dynamic_message &add_message(const field &entry)
+    {
+        return std::get<std::vector<dynamic_message>>(_slots[entry.index].value).emplace_back(*entry.message);
+    }
+
+    void clear(const field &entry)
+    {
+        auto &slot = _slots[entry.index];
+        std::visit(
+            [](auto &value) {
+                if constexpr (std::is_same_v<std::decay_t<decltype(value)>, uint64_t>)
+                {
+                    value = 0;
+                }
+                else
+                {
+                    value.clear();
+                }
+            },
+            slot.value);
+        slot.is_set = false;
+    }
+
+    // Strings and repeated fields keep their capacity.
+    void clear()
+    {
+        for (auto &entry : _type->fields)
+        {
+            clear(entry);
+        }
+    }
+
+    size_t size() const
+    {
+        size_t size = 0;
+        for (auto &entry : _type->fields)
+        {
+            auto header_size = type_traits<varint>::size(field_header::encode({entry.number, entry.element_wire_type()}));
+            auto &slot = _slots[entry.index];
+            if (entry.kind == field_kind::message)
+            {
+                for (auto &message : std::get<std::vector<dynamic_message>>(slot.value))
+                {
+                    size += header_size + length_prefixed_size(message.size());
+                }
+            }
+            else if (entry.is_packed)
+            {
+                auto &values = std::get<std::vector<uint64_t>>(slot.value);
+                if (!values.empty())
+                {
+                    size += header_size + length_prefixed_size(packed_size(entry, values));
+                }
+            }
+            else if (entry.is_repeated && entry.is_scalar())
+            {
+                for (auto bits : std::get<std::vector<uint64_t>>(slot.value))
+                {
+                    size += header_size + detail::scalar_size(entry.kind, bits);
+                }
+            }
+            else if (entry.is_repeated)
+            {
+                for (auto &value : std::get<std::vector<std::string>>(slot.value))
+                {
+                    size += header_size + length_prefixed_size(value.size());
+                }
+            }
+            else if (is_written(entry, slot))
+            {
+                size += header_size + (entry.is_scalar() ? detail::scalar_size(entry.kind, std::get<uint64_t>(slot.value)) : length_prefixed_size(std::get<std::string>(slot.value).size()));
+            }
+        }
+
+        return size;
+    }
+
+    void serialize(std::string &data) const
+    {
+        for (auto &entry : _type->fields)
+        {
+            auto header = field_header::encode({entry.number, entry.element_wire_type()});
+            auto &slot = _slots[entry.index];
+            if (entry.kind == field_kind::message)
+            {
+                for (auto &message : std::get<std::vector<dynamic_message>>(slot.value))
+                {
+                    type_traits<varint>::serialize(header, data);
+                    type_traits<varint>::serialize(message.size(), data);
+                    message.serialize(data);
+                }
+            }
+            else if (entry.is_packed)
+            {
+                auto &values = std::get<std::vector<uint64_t>>(slot.value);
+                if (!values.empty())
+                {
+                    type_traits<varint>::serialize(field_header::encode({entry.number, wire_type::length_delimited}), data);
+                    type_traits<varint>::serialize(packed_size(entry, values), data);
+                    for (auto bits : values)
+                    {
+                        detail::serialize_scalar(entry.kind, bits, data);
+                    }
+                }
+            }
+            else if (entry.is_repeated && entry.is_scalar())
+            {
+                for (auto bits : std::get<std::vector<uint64_t>>(slot.value))
+                {
+                    type_traits<varint>::serialize(header, data);
+                    detail::serialize_scalar(entry.kind, bits, data);
+                }
+            }
+            else if (entry.is_repeated)
+            {
+                for (auto &value : std::get<std::vector<std::string>>(slot.value))
+                {
+                    type_traits<varint>::serialize(header, data);
+                    type_traits<length_delimited>::serialize(value, data);
+                }
+            }
+            else if (is_written(entry, slot))
+            {
+                type_traits<varint>::serialize(header, data);
+                if (entry.is_scalar())
+                {
+                    detail::serialize_scalar(entry.kind, std::get<uint64_t>(slot.value), data);
+                }
+                else
+                {
+                    type_traits<length_delimited>::serialize(std::get<std::string>(slot.value), data);
+                }
+            }
+        }
+    }
+
+    // Merges data into the message, like protoflat::merge for generated messages.
+    bool deserialize(std::string_view &data)
+    {
+        while (!data.empty())
+        {
+            uint64_t header_value = 0;
+            if (!type_traits<varint>::deserialize(data, header_value))
+            {
+                return false;
+            }
+
+            auto header = field_header::decode(header_value);
+            auto entry = header.field_number <= UINT32_MAX ? _type->find(static_cast<uint32_t>(header.field_number)) : nullptr;
+            if (entry == nullptr)
+            {
+                if (!skip_field(data, header.field_type))
+                {
+                    return false;
+                }
+                continue;
+            }
+
+            auto &slot = _slots[entry->index];
+            if (entry->is_repeated && entry->is_scalar() && header.field_type == wire_type::length_delimited)
+            {
+                auto &values = std::get<std::vector<uint64_t>>(slot.value);
+                if (!detail::deserialize_packed(entry->kind, data, [&](uint64_t bits) { values.push_back(bits); }))
+                {
+                    return false;
+                }
+                continue;
+            }
+            if (header.field_type != entry->element_wire_type())
+            {
+                if (!skip_field(data, header.field_type))
+                {
+                    return false;
+                }
+                continue;
+            }
+
+            bool is_decoded = false;
+            if (entry->kind == field_kind::message)
+            {
+                std::string_view message_data;
+                is_decoded = type_traits<length_delimited>::deserialize(data, message_data) && (entry->is_repeated ? add_message(*entry) : mutable_message(*entry)).deserialize(message_data);
+            }
+            else if (!entry->is_scalar())
+            {
+                std::string_view value;
+                is_decoded = type_traits<length_delimited>::deserialize(data, value);
+                if (is_decoded)
+                {
+                    entry->is_repeated ? add_string(*entry, value) : set_string(*entry, value);
+                }
+            }
+            else
+            {
+                uint64_t bits = 0;
+                is_decoded = detail::deserialize_scalar(entry->kind, data, bits);
+                if (is_decoded && entry->is_repeated)
+                {
+                    std::get<std::vector<uint64_t>>(slot.value).push_back(bits);
+                }
+                else if (is_decoded)
+                {
+                    std::get<uint64_t>(slot.value) = bits;
+                    slot.is_set = true;
+                }
+            }
+            if (!is_decoded)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    friend bool operator==(const dynamic_message &a, const dynamic_message &b)
+    {
+        return a._type == b._type && a._slots == b._slots;
+    }
+
+private:
+    struct slot
+    {
+        std::variant<uint64_t, std::string, std::vector<uint64_t>, std::vector<std::string>, std::vector<dynamic_message>> value;
+        bool is_set = false;
+
+        bool operator==(const slot &) const = default;
+    };
+
+    static bool is_written(const field &entry, const slot &slot)
+    {
+        if (entry.has_presence)
+        {
+            return slot.is_set;
+        }
+
+        // Like protobuf, floats compare by bits, so -0.0 is written.
+        return entry.is_scalar() ? std::get<uint64_t>(slot.value) != 0 : !std::get<std::string>(slot.value).empty();
+    }
+
+    static size_t packed_size(const field &entry, const std::vector<uint64_t> &values)
+    {
+        size_t size = 0;
+        for (auto bits : values)
+        {
+            size += detail::scalar_size(entry.kind, bits);
+        }
+
+        return size;
+    }
+
+    const message_type *_type = nullptr;
+    std::vector<slot> _slots;
+};
+
+// Streams the fields of a message to visitor as they are decoded, without building
+// a dynamic_message. The visitor provides
+//
+//   void on_scalar(const field &entry, uint64_t bits);          // see from_bits
+//   void on_string(const field &entry, std::string_view value); // string and bytes
+//   bool on_message_begin(const field &entry);                  // false skips it
+//   void on_message_end(const field &entry);
+//
+// Unknown fields are skipped; packed and unpacked repeated scalars both arrive one
+// element at a time.
+template<class Visitor>
+inline bool visit(const message_type &type, std::string_view data, Visitor &visitor)
+{
+    while (!data.empty())
+    {
+        uint64_t header_value = 0;
+        if (!type_traits<varint>::deserialize(data, header_value))
+        {
+            return false;
+        }
+
+        auto header = field_header::decode(header_value);
+        auto entry = header.field_number <= UINT32_MAX ? type.find(static_cast<uint32_t>(header.field_number)) : nullptr;
+        if (entry == nullptr || (header.field_type != entry->element_wire_type() && !(entry->is_repeated && entry->is_scalar() && header.field_type == wire_type::length_delimited)))
+        {
+            if (!skip_field(data, header.field_type))
+            {
+                return false;
+            }
+            continue;
+        }
+
+        if (entry->is_scalar() && header.field_type == wire_type::length_delimited)
+        {
+            if (!detail::deserialize_packed(entry->kind, data, [&](uint64_t bits) { visitor.on_scalar(*entry, bits); }))
+            {
+                return false;
+            }
+        }
+        else if (entry->is_scalar())
+        {
+            uint64_t bits = 0;
+            if (!detail::deserialize_scalar(entry->kind, data, bits))
+            {
+                return false;
+            }
+            visitor.on_scalar(*entry, bits);
+        }
+        else
+        {
+            std::string_view value;
+            if (!type_traits<length_delimited>::deserialize(data, value))
+            {
+                return false;
+            }
+            if (entry->kind != field_kind::message)
+            {
+                visitor.on_string(*entry, value);
+            }
+            else if (visitor.on_message_begin(*entry))
+            {
+                if (!visit(*entry->message, value, visitor))
+                {
+                    return false;
+                }
+                visitor.on_message_end(*entry);
+            }
+        }
+    }
+
+    return true;
+}
+
+} // namespace dynamic
+
+} // namespace protoflat
@@ -0,0 +1,819 @@
+#pragma once
+
+#include <protoflat.h>
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace protoflat
+{
+
+// proto3 JSON mapping for generated messages (protoc-gen-protoflat "json" parameter):
+// fields are keyed by their lowerCamelCase JSON name, 64-bit integers are written
+// as strings, bytes as base64 and enums by name. Fields with default values are
+// omitted. Parsing accepts JSON and original field names, quoted or unquoted
+// numbers, and null for any field. JSON is written into the same std::string sink
+// as the binary encoding.
+namespace json
+{
+
+namespace detail
+{
+
+inline bool is_escaped(char c)
+{
+    return static_cast<uint8_t>(c) < 0x20 || c == '"' || c == '\\';
+}
+
+// Position of the first quote, backslash or control character: the next byte the
+// writer has to escape, and where a string token the reader scans stops being a
+// plain copy of its contents. Handles 32 or 16 bytes per step where AVX2 or SSE2
+// is enabled at compile time, and finishes the tail byte by byte.
+inline size_t find_escaped(const char *data, size_t size)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    auto quote = _mm256_set1_epi8('"');
+    auto backslash = _mm256_set1_epi8('\\');
+    auto control = _mm256_set1_epi8(0x1f);
+    for (; i + 32 <= size; i += 32)
+    {
+        auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        auto is_control = _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control);
+        auto matches = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash)), is_control);
+        if (auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(matches)))
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE2__)
+    auto quote = _mm_set1_epi8('"');
+    auto backslash = _mm_set1_epi8('\\');
+    auto control = _mm_set1_epi8(0x1f);
+    for (; i + 16 <= size; i += 16)
+    {
+        auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        auto is_control = _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control);
+        auto matches = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)), is_control);
+        if (auto mask = static_cast<uint32_t>(_mm_movemask_epi8(matches)))
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < size; ++i)
+    {
+        if (is_escaped(data[i]))
+        {
+            return i;
+        }
+    }
+
+    return size;
+}
+
+inline constexpr char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+inline int base64_value(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+    {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z')
+    {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0' + 52;
+    }
+    // Both the standard and the URL-safe alphabet are accepted.
+    if (c == '+' || c == '-')
+    {
+        return 62;
+    }
+    if (c == '/' || c == '_')
+    {
+        return 63;
+    }
+
+    return -1;
+}
+
+inline void append_utf8(uint32_t code_point, std::string &data)
+{
+    if (code_point < 0x80)
+    {
+        data += static_cast<char>(code_point);
+    }
+    else if (code_point < 0x800)
+    {
+        data += static_cast<char>(0xc0 | code_point >> 6);
+        data += static_cast<char>(0x80 | (code_point & 0x3f));
+    }
+    else if (code_point < 0x10000)
+    {
+        data += static_cast<char>(0xe0 | code_point >> 12);
+        data += static_cast<char>(0x80 | (code_point >> 6 & 0x3f));
+        data += static_cast<char>(0x80 | (code_point & 0x3f));
+    }
+    else
+    {
+        data += static_cast<char>(0xf0 | code_point >> 18);
+        data += static_cast<char>(0x80 | (code_point >> 12 & 0x3f));
+        data += static_cast<char>(0x80 | (code_point >> 6 & 0x3f));
+        data += static_cast<char>(0x80 | (code_point & 0x3f));
+    }
+}
+
+} // namespace detail
+
+inline void write_string(std::string_view value, std::string &data)
+{
+    static constexpr char hex[] = "0123456789abcdef";
+
+    data += '"';
+    while (!value.empty())
+    {
+        auto position = detail::find_escaped(value.data(), value.size());
+        data.append(value.data(), position);
+        if (position == value.size())
+        {
+            break;
+        }
+
+        auto c = static_cast<uint8_t>(value[position]);
+        switch (c)
+        {
+        case '"':
+            data += "\\\"";
+            break;
+        case '\\':
+            data += "\\\\";
+            break;
+        case '\n':
+            data += "\\n";
+            break;
+        case '\r':
+            data += "\\r";
+            break;
+        case '\t':
+            data += "\\t";
+            break;
+        case '\b':
+            data += "\\b";
+            break;
+        case '\f':
+            data += "\\f";
+            break;
+        default:
+            data += "\\u00";
+            data += hex[c >> 4];
+            data += hex[c & 0xf];
+            break;
+        }
+        value.remove_prefix(position + 1);
+    }
+    data += '"';
+}
+
+inline void write_bytes(std::string_view value, std::string &data)
+{
+    data += '"';
+    size_t i = 0;
+    for (; i + 3 <= value.size(); i += 3)
+    {
+        uint32_t chunk = static_cast<uint8_t>(value[i]) << 16 | static_cast<uint8_t>(value[i + 1]) << 8 | static_cast<uint8_t>(value[i + 2]);
+        data += detail::base64_alphabet[chunk >> 18];
+        data += detail::base64_alphabet[chunk >> 12 & 0x3f];
+        data += detail::base64_alphabet[chunk >> 6 & 0x3f];
+        data += detail::base64_alphabet[chunk & 0x3f];
+    }
+    if (i < value.size())
+    {
+        uint32_t chunk = static_cast<uint8_t>(value[i]) << 16;
+        if (i + 1 < value.size())
+        {
+            chunk |= static_cast<uint8_t>(value[i + 1]) << 8;
+        }
+        data += detail::base64_alphabet[chunk >> 18];
+        data += detail::base64_alphabet[chunk >> 12 & 0x3f];
+        data += i + 1 < value.size() ? detail::base64_alphabet[chunk >> 6 & 0x3f] : '=';
+        data += '=';
+    }
+    data += '"';
+}
+
+template<class T>
+inline void write_number(T value, std::string &data)
+{
+    char buffer[32];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    data.append(buffer, result.ptr);
+}
+
+template<class T>
+inline void write_value(const T &value, std::string &data)
+{
+    if constexpr (std::is_same_v<T, bool>)
+    {
+        data += value ? "true" : "false";
+    }
+    else if constexpr (std::is_enum_v<T>)
+    {
+        auto name = type_traits<T>::name(value);
+        if (name.empty())
+        {
+            write_number(static_cast<std::underlying_type_t<T>>(value), data);
+        }
+        else
+        {
+            data += '"';
+            data += name;
+            data += '"';
+        }
+    }
+    else if constexpr (std::is_floating_point_v<T>)
+    {
+        if (std::isnan(value))
+        {
+            data += "\"NaN\"";
+        }
+        else if (std::isinf(value))
+        {
+            data += value > 0 ? "\"Infinity\"" : "\"-Infinity\"";
+        }
+        else
+        {
+            write_number(value, data);
+        }
+    }
+    else if constexpr (std::is_integral_v<T> && sizeof(T) == 8)
+    {
+        // Not every JSON reader keeps 64-bit integers exact.
+        data += '"';
+        write_number(value, data);
+        data += '"';
+    }
+    else if constexpr (std::is_integral_v<T>)
+    {
+        write_number(value, data);
+    }
+    else if constexpr (std::is_convertible_v<const T &, std::string_view>)
+    {
+        write_string(value, data);
+    }
+    else
+    {
+        type_traits<T>::to_json(value, data);
+    }
+}
+
+template<class Range>
+inline void write_array(const Range &values, std::string &data)
+{
+    data += '[';
+    bool is_first = true;
+    for (const auto &value : values)
+    {
+        if (!is_first)
+        {
+            data += ',';
+        }
+        is_first = false;
+        write_value(static_cast<const typename Range::value_type &>(value), data);
+    }
+    data += ']';
+}
+
+template<class Range>
+inline void write_bytes_array(const Range &values, std::string &data)
+{
+    data += '[';
+    bool is_first = true;
+    for (const auto &value : values)
+    {
+        if (!is_first)
+        {
+            data += ',';
+        }
+        is_first = false;
+        write_bytes(value, data);
+    }
+    data += ']';
+}
+
+// Writes a member name, quoted and followed by a colon, e.g. "\"textList\":".
+inline void write_key(std::string_view key, bool &is_first, std::string &data)
+{
+    if (!is_first)
+    {
+        data += ',';
+    }
+    is_first = false;
+    data += key;
+}
+
+class reader
+{
+public:
+    // Objects and arrays nested deeper fail the parse, as in libprotobuf, so that
+    // hostile input cannot exhaust the stack.
+    static constexpr size_t max_depth = 100;
+
+    explicit reader(std::string_view data)
+        : _data(data)
+    {
+    }
+
+    bool at_end()
+    {
+        skip_whitespace();
+        return _data.empty();
+    }
+
+    // Calls read_member(std::string_view key) for every member whose value is not
+    // null, with the reader positioned at the value; read_member must consume it.
+    template<class ReadMember>
+    bool read_object(ReadMember &&read_member)
+    {
+        if (_depth == max_depth)
+        {
+            return false;
+        }
+
+        ++_depth;
+        auto result = read_members(read_member);
+        --_depth;
+
+        return result;
+    }
+
+    template<class ReadElement>
+    bool read_elements(ReadElement &&read_element)
+    {
+        if (consume_literal("null"))
+        {
+            return true;
+        }
+        if (_depth == max_depth)
+        {
+            return false;
+        }
+
+        ++_depth;
+        auto result = read_array_elements(read_element);
+        --_depth;
+
+        return result;
+    }
+
+    template<class Container>
+    bool read_array(Container &values)
+    {
+        return read_elements([&] {
+            typename Container::value_type value{};
+            if (!read_value(value))
+            {
+                return false;
+            }
+            values.push_back(std::move(value));
+            return true;
+        });
+    }
+
+    template<class Container>
+    bool read_bytes_array(Container &values)
+    {
+        return read_elements([&] { return read_bytes(values.emplace_back()); });
+    }
+
+    template<class T>
+    bool read_value(T &value)
+    {
+        if constexpr (std::is_same_v<T, bool>)
+        {
+            if (consume_literal("true"))
+            {
+                value = true;
+                return true;
+            }
+
+            value = false;
+            return consume_literal("false");
+        }
+        else if constexpr (std::is_enum_v<T>)
+        {
+            std::string_view name;
+            std::string buffer;
+            if (peek('"'))
+            {
+                return read_string(name, buffer) && type_traits<T>::parse(name, value);
+            }
+
+            std::underlying_type_t<T> number = 0;
+            if (!read_number(number))
+            {
+                return false;
+            }
+            value = static_cast<T>(number);
+
+            return true;
+        }
+        else if constexpr (std::is_arithmetic_v<T>)
+        {
+            return read_number(value);
+        }
+        else if constexpr (requires(std::string_view source) { value.assign(source.data(), source.size()); })
+        {
+            std::string_view string_value;
+            std::string buffer;
+            if (!read_string(string_value, buffer))
+            {
+                return false;
+            }
+            value.assign(string_value.data(), string_value.size());
+
+            return true;
+        }
+        else
+        {
+            return type_traits<T>::from_json(*this, value);
+        }
+    }
+
+    template<class String>
+    bool read_bytes(String &value)
+    {
+        std::string_view encoded;
+        std::string buffer;
+        if (!read_string(encoded, buffer))
+        {
+            return false;
+        }
+
+        std::string decoded;
+        decoded.reserve(encoded.size() / 4 * 3 + 3);
+        uint32_t chunk = 0;
+        int bits = 0;
+        for (auto c : encoded)
+        {
+            if (c == '=')
+            {
+                break;
+            }
+            auto digit = detail::base64_value(c);
+            if (digit < 0)
+            {
+                return false;
+            }
+            chunk = chunk << 6 | digit;
+            bits += 6;
+            if (bits >= 8)
+            {
+                bits -= 8;
+                decoded += static_cast<char>(chunk >> bits & 0xff);
+            }
+        }
+        value.assign(decoded.data(), decoded.size());
+
+        return true;
+    }
+
+    // Skips any value, e.g. of an unknown field.
+    bool skip_value()
+    {
+        skip_whitespace();
+        if (_data.empty())
+        {
+            return false;
+        }
+
+        switch (_data[0])
+        {
+        case '{':
+            return read_object([&](std::string_view) { return skip_value(); });
+        case '[':
+            return read_elements([&] { return skip_value(); });
+        case '"':
+        {
+            std::string_view value;
+            std::string buffer;
+            return read_string(value, buffer);
+        }
+        default:
+        {
+            if (consume_literal("true") || consume_literal("false") || consume_literal("null"))
+            {
+                return true;
+            }
+            double value = 0;
+            return read_number(value);
+        }
+        }
+    }
+
+    // value points into the input unless the string has escapes, in which case it
+    // is decoded into buffer.
+    bool read_string(std::string_view &value, std::string &buffer)
+    {
+        if (!consume('"'))
+        {
+            return false;
+        }
+
+        auto position = detail::find_escaped(_data.data(), _data.size());
+        if (position < _data.size() && _data[position] == '"')
+        {
+            value = _data.substr(0, position);
+            _data.remove_prefix(position + 1);
+            return true;
+        }
+
+        buffer.clear();
+        while (position < _data.size())
+        {
+            buffer.append(_data.data(), position);
+            auto c = _data[position];
+            _data.remove_prefix(position + 1);
+            if (c == '"')
+            {
+                value = buffer;
+                return true;
+            }
+            // Control characters must be escaped.
+            if (c != '\\' || !read_escape(buffer))
+            {
+                return false;
+            }
+            position = detail::find_escaped(_data.data(), _data.size());
+        }
+
+        return false;
+    }
+
+    bool consume(char c)
+    {
+        skip_whitespace();
+        if (!_data.empty() && _data[0] == c)
+        {
+            _data.remove_prefix(1);
+            return true;
+        }
+
+        return false;
+    }
+
+private:
+    template<class ReadMember>
+    bool read_members(ReadMember &read_member)
+    {
+        if (!consume('{'))
+        {
+            return false;
+        }
+        if (consume('}'))
+        {
+            return true;
+        }
+
+        std::string key_buffer;
+        do
+        {
+            std::string_view key;
+            if (!read_string(key, key_buffer) || !consume(':'))
+            {
+                return false;
+            }
+            if (consume_literal("null"))
+            {
+                continue;
+            }
+            if (!read_member(key))
+            {
+                return false;
+            }
+        } while (consume(','));
+
+        return consume('}');
+    }
+
+    template<class ReadElement>
+    bool read_array_elements(ReadElement &read_element)
+    {
+        if (!consume('['))
+        {
+            return false;
+        }
+        if (consume(']'))
+        {
+            return true;
+        }
+
+        do
+        {
+            if (!read_element())
+            {
+                return false;
+            }
+        } while (consume(','));
+
+        return consume(']');
+    }
+
+    void skip_whitespace()
+    {
+        while (!_data.empty() && (_data[0] == ' ' || _data[0] == '\n' || _data[0] == '\r' || _data[0] == '\t'))
+        {
+            _data.remove_prefix(1);
+        }
+    }
+
+    bool peek(char c)
+    {
+        skip_whitespace();
+        return !_data.empty() && _data[0] == c;
+    }
+
+    bool consume_literal(std::string_view literal)
+    {
+        skip_whitespace();
+        if (_data.starts_with(literal))
+        {
+            _data.remove_prefix(literal.size());
+            return true;
+        }
+
+        return false;
+    }
+
+    bool read_hex(uint32_t &value)
+    {
+        if (_data.size() < 4)
+        {
+            return false;
+        }
+
+        auto result = std::from_chars(_data.data(), _data.data() + 4, value, 16);
+        if (result.ec != std::errc() || result.ptr != _data.data() + 4)
+        {
+            return false;
+        }
+        _data.remove_prefix(4);
+
+        return true;
+    }
+
+    bool read_escape(std::string &buffer)
+    {
+        if (_data.empty())
+        {
+            return false;
+        }
+
+        auto c = _data[0];
+        _data.remove_prefix(1);
+        switch (c)
+        {
+        case '"':
+        case '\\':
+        case '/':
+            buffer += c;
+            return true;
+        case 'n':
+            buffer += '\n';
+            return true;
+        case 'r':
+            buffer += '\r';
+            return true;
+        case 't':
+            buffer += '\t';
+            return true;
+        case 'b':
+            buffer += '\b';
+            return true;
+        case 'f':
+            buffer += '\f';
+            return true;
+        case 'u':
+        {
+            uint32_t code_point = 0;
+            if (!read_hex(code_point))
+            {
+                return false;
+            }
+            if (code_point >= 0xd800 && code_point < 0xdc00)
+            {
+                uint32_t low = 0;
+                if (!_data.starts_with("\\u"))
+                {
+                    return false;
+                }
+                _data.remove_prefix(2);
+                if (!read_hex(low) || low < 0xdc00 || low >= 0xe000)
+                {
+                    return false;
+                }
+                code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+            }
+            detail::append_utf8(code_point, buffer);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    template<class T>
+    bool read_number(T &value)
+    {
+        skip_whitespace();
+
+        // Numbers may be quoted, and floats may be the special strings.
+        std::string_view token = _data;
+        bool is_quoted = !token.empty() && token[0] == '"';
+        if (is_quoted)
+        {
+            auto end = token.find('"', 1);
+            if (end == std::string_view::npos)
+            {
+                return false;
+            }
+            token = token.substr(1, end - 1);
+
+            if constexpr (std::is_floating_point_v<T>)
+            {
+                if (token == "NaN" || token == "Infinity" || token == "-Infinity")
+                {
+                    value = token == "NaN" ? std::numeric_limits<T>::quiet_NaN() : token[0] == '-' ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::infinity();
+                    _data.remove_prefix(token.size() + 2);
+                    return true;
+                }
+            }
+        }
+
+        auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+        if constexpr (std::is_integral_v<T>)
+        {
+            // Integral values written in float notation, e.g. 1e3 or 5.0.
+            if (result.ec == std::errc() && result.ptr != token.data() + token.size() && (*result.ptr == '.' || *result.ptr == 'e' || *result.ptr == 'E'))
+            {
+                double number = 0;
+                result = std::from_chars(token.data(), token.data() + token.size(), number);
+                // The upper bound is 2^digits: max() itself rounds up to it as a double.
+                if (result.ec != std::errc() || number != std::trunc(number) || number < static_cast<double>(std::numeric_limits<T>::min()) || number >= std::ldexp(1.0, std::numeric_limits<T>::digits))
+                {
+                    return false;
+                }
+                value = static_cast<T>(number);
+            }
+        }
+        if (result.ec != std::errc() || (is_quoted && result.ptr != token.data() + token.size()))
+        {
+            return false;
+        }
+        _data.remove_prefix(is_quoted ? token.size() + 2 : result.ptr - token.data());
+
+        return true;
+    }
+
+    std::string_view _data;
+    size_t _depth = 0;
+};
+
+} // namespace json
+
+template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+inline void to_json(const T &value, std::string &data)
+{
+    type_traits<T>::to_json(value, data);
+}
+
+template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+inline std::string to_json(const T &value)
+{
+    std::string data;
+    to_json(value, data);
+    return data;
+}
+
+template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+inline bool from_json(std::string_view data, T &value)
+{
+    value = {};
+    json::reader reader(data);
+    return type_traits<T>::from_json(reader, value) && reader.at_end();
+}
+
+} // namespace protoflat
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <protoflat.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace protoflat
+{
+
+// Free list of serialization buffers. Released buffers are cleared but keep their
+// capacity, so a loop that serializes and sends one message at a time stops
+// allocating once its buffers have grown. At most max_buffers are retained and
+// buffers above max_capacity are freed instead, so a single huge message does not
+// pin its memory. A pool is not synchronized; local() returns the calling thread's.
+class buffer_pool
+{
+public:
+    static constexpr size_t default_max_buffers = 16;
+    static constexpr size_t default_max_capacity = 1 << 20;
+
+    explicit buffer_pool(size_t max_buffers = default_max_buffers, size_t max_capacity = default_max_capacity)
+        : _max_buffers(max_buffers),
+          _max_capacity(max_capacity)
+    {
+    }
+
+    static buffer_pool &local()
+    {
+        thread_local buffer_pool pool;
+        return pool;
+    }
+
+    std::string acquire()
+    {
+        if (_buffers.empty())
+        {
+            return {};
+        }
+
+        auto buffer = std::move(_buffers.back());
+        _buffers.pop_back();
+        return buffer;
+    }
+
+    void release(std::string &&buffer)
+    {
+        if (_buffers.size() < _max_buffers && buffer.capacity() <= _max_capacity)
+        {
+            buffer.clear();
+            _buffers.push_back(std::move(buffer));
+        }
+    }
+
+    size_t size() const
+    {
+        return _buffers.size();
+    }
+
+    void set_limits(size_t max_buffers, size_t max_capacity)
+    {
+        _max_buffers = max_buffers;
+        _max_capacity = max_capacity;
+
+        auto buffers = std::move(_buffers);
+        _buffers.clear();
+        for (auto &buffer : buffers)
+        {
+            release(std::move(buffer));
+        }
+    }
+
+private:
+    std::vector<std::string> _buffers;
+    size_t _max_buffers;
+    size_t _max_capacity;
+};
+
+// Buffer taken from a buffer_pool and given back to it when destroyed, which must
+// happen on the pool's thread.
+class pooled_buffer
+{
+public:
+    explicit pooled_buffer(buffer_pool &pool = buffer_pool::local())
+        : _pool(&pool),
+          _data(pool.acquire())
+    {
+    }
+
+    pooled_buffer(pooled_buffer &&another) noexcept
+        : _pool(std::exchange(another._pool, nullptr)),
+          _data(std::move(another._data))
+    {
+    }
+
+    pooled_buffer &operator=(pooled_buffer &&another) noexcept
+    {
+        if (this != &another)
+        {
+            give_back();
+            _pool = std::exchange(another._pool, nullptr);
+            _data = std::move(another._data);
+        }
+
+        return *this;
+    }
+
+    ~pooled_buffer()
+    {
+        give_back();
+    }
+
+    std::string &operator*()
+    {
+        return _data;
+    }
+
+    const std::string &operator*() const
+    {
+        return _data;
+    }
+
+    std::string *operator->()
+    {
+        return &_data;
+    }
+
+    const std::string *operator->() const
+    {
+        return &_data;
+    }
+
+    operator std::string_view() const
+    {
+        return _data;
+    }
+
+private:
+    void give_back()
+    {
+        if (_pool)
+        {
+            _pool->release(std::move(_data));
+        }
+    }
+
+    buffer_pool *_pool;
+    std::string _data;
+};
+
+// Same as serialize, into a buffer from the calling thread's buffer_pool.
+template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+inline pooled_buffer serialize_pooled(const T &value)
+{
+    pooled_buffer data;
+    serialize_to_string(value, *data);
+    return data;
+}
+
+// Clears a generated message as deserialize_reuse of empty data would: strings and
+// vectors keep their capacity, but repeated submessages are destroyed, since only a
+// decode knows how many of them it is going to fill.
+template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+inline void reset(T &value)
+{
+    std::string_view data;
+    type_traits<T>::template deserialize<decode_mode::reuse>(data, value);
+}
+
+// Free list of generated messages. Released objects are reset as by reset above, so
+// acquire returns an object equal to T{} whose strings and vectors keep their
+// capacity; decoding into it with deserialize_reuse also reuses its singular
+// submessages. At most max_objects are retained, the rest are destroyed. Like
+// buffer_pool it is not synchronized, and the pool must outlive the objects taken
+// from it.
+template<class T>
+class object_pool
+{
+public:
+    static constexpr size_t default_max_objects = 16;
+
+    class deleter
+    {
+    public:
+        deleter() = default;
+
+        explicit deleter(object_pool *pool)
+            : _pool(pool)
+        {
+        }
+
+        void operator()(T *value) const
+        {
+            if (_pool)
+            {
+                _pool->release(value);
+            }
+            else
+            {
+                delete value;
+            }
+        }
+
+    private:
+        object_pool *_pool = nullptr;
+    };
+
+    using pointer = std::unique_ptr<T, deleter>;
+
+    explicit object_pool(size_t max_objects = default_max_objects)
+        : _max_objects(max_objects)
+    {
+    }
+
+    object_pool(const object_pool &) = delete;
+    object_pool &operator=(const object_pool &) = delete;
+
+    static object_pool &local()
+    {
+        thread_local object_pool pool;
+        return pool;
+    }
+
+    pointer acquire()
+    {
+        if (_objects.empty())
+        {
+            return pointer(new T(), deleter(this));
+        }
+
+        auto value = std::move(_objects.back());
+        _objects.pop_back();
+        return pointer(value.release(), deleter(this));
+    }
+
+    size_t size() const
+    {
+        return _objects.size();
+    }
+
+    void set_max_objects(size_t max_objects)
+    {
+        _max_objects = max_objects;
+        if (_objects.size() > max_objects)
+        {
+            _objects.resize(max_objects);
+        }
+    }
+
+private:
+    void release(T *value)
+    {
+        std::unique_ptr<T> object(value);
+        if (_objects.size() < _max_objects)
+        {
+            reset(*object);
+            _objects.push_back(std::move(object));
+        }
+    }
+
+    std::vector<std::unique_ptr<T>> _objects;
+    size_t _max_objects;
+};
+
+} // namespace protoflat
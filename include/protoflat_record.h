@@ -0,0 +1,573 @@
+#pragma once
+
+#include <protoflat.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef PROTOFLAT_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace protoflat
+{
+
+// Record container: serialized messages are grouped into blocks that are compressed
+// independently, so a reader can seek to any block and decompress blocks in parallel.
+//
+//   "PFRC" version
+//   block*              records as varint length + bytes, then compressed
+//   index               varint block count, then per block: varint offset,
+//                       compressed size, uncompressed size, record count, codec id
+//   fixed64 index offset
+//   "PFRC"
+class block_codec
+{
+public:
+    virtual ~block_codec() = default;
+
+    // Ids below 128 are reserved for the codecs shipped with protoflat.
+    virtual uint8_t id() const = 0;
+    virtual void compress(std::string_view source, std::string &data) const = 0;
+    // Appends exactly uncompressed_size bytes to data or returns false.
+    virtual bool decompress(std::string_view source, size_t uncompressed_size, std::string &data) const = 0;
+    // Upper bound of the bytes compressed_size bytes can decompress to, used to
+    // reject corrupt sizes before anything is allocated for them.
+    virtual uint64_t max_uncompressed_size(uint64_t compressed_size) const = 0;
+};
+
+class none_codec : public block_codec
+{
+public:
+    uint8_t id() const override
+    {
+        return 0;
+    }
+
+    void compress(std::string_view source, std::string &data) const override
+    {
+        data.append(source);
+    }
+
+    bool decompress(std::string_view source, size_t uncompressed_size, std::string &data) const override
+    {
+        if (source.size() != uncompressed_size)
+        {
+            return false;
+        }
+        data.append(source);
+
+        return true;
+    }
+
+    uint64_t max_uncompressed_size(uint64_t compressed_size) const override
+    {
+        return compressed_size;
+    }
+};
+
+// Byte-oriented LZ77 in the LZ4 block format: a token with 4-bit literal and match
+// lengths, the literals, a 16-bit match offset and length extensions in 255 steps.
+// Greedy matching over a small hash table favours speed over ratio.
+class lz_codec : public block_codec
+{
+public:
+    uint8_t id() const override
+    {
+        return 1;
+    }
+
+    void compress(std::string_view source, std::string &data) const override
+    {
+        constexpr int hash_bits = 12;
+        constexpr size_t min_match = 4;
+        // The format requires the last 5 bytes to be literals and the last match to
+        // start at least 12 bytes before the end.
+        constexpr size_t last_literals = 5;
+        constexpr size_t match_start_limit = 12;
+
+        std::vector<uint32_t> table(1 << hash_bits, 0);
+        auto begin = reinterpret_cast<const uint8_t *>(source.data());
+        auto end = begin + source.size();
+        auto anchor = begin;
+        auto current = begin;
+
+        if (source.size() > match_start_limit)
+        {
+            auto match_limit = end - last_literals;
+            while (current < end - match_start_limit)
+            {
+                auto sequence = read32(current);
+                auto &entry = table[(sequence * 2654435761u) >> (32 - hash_bits)];
+                auto reference = begin + entry;
+                entry = static_cast<uint32_t>(current - begin);
+
+                if (reference >= current || current - reference > 0xffff || read32(reference) != sequence)
+                {
+                    ++current;
+                    continue;
+                }
+
+                auto match_length = min_match;
+                while (current + match_length < match_limit && reference[match_length] == current[match_length])
+                {
+                    ++match_length;
+                }
+
+                write_sequence(anchor, current - anchor, current - reference, match_length - min_match, data);
+                current += match_length;
+                anchor = current;
+            }
+        }
+
+        auto literal_length = static_cast<size_t>(end - anchor);
+        data += static_cast<char>(std::min<size_t>(literal_length, 15) << 4);
+        write_length(literal_length, data);
+        data.append(reinterpret_cast<const char *>(anchor), literal_length);
+    }
+
+    bool decompress(std::string_view source, size_t uncompressed_size, std::string &data) const override
+    {
+        if (uncompressed_size > max_uncompressed_size(source.size()))
+        {
+            return false;
+        }
+
+        auto start = data.size();
+        auto limit = start + uncompressed_size;
+        data.reserve(limit);
+
+        size_t position = 0;
+        while (position < source.size())
+        {
+            auto token = static_cast<uint8_t>(source[position++]);
+
+            size_t literal_length = token >> 4;
+            if (!read_length(source, position, literal_length) || source.size() - position < literal_length || limit - data.size() < literal_length)
+            {
+                return false;
+            }
+            data.append(source.substr(position, literal_length));
+            position += literal_length;
+
+            if (position == source.size())
+            {
+                break;
+            }
+
+            if (source.size() - position < 2)
+            {
+                return false;
+            }
+            size_t offset = static_cast<uint8_t>(source[position]) | static_cast<size_t>(static_cast<uint8_t>(source[position + 1])) << 8;
+            position += 2;
+
+            size_t match_length = token & 0xf;
+            if (offset == 0 || offset > data.size() - start || !read_length(source, position, match_length) || limit - data.size() < match_length + 4)
+            {
+                return false;
+            }
+            match_length += 4;
+
+            // Matches may overlap the bytes they produce, so copy byte by byte then.
+            auto from = data.size() - offset;
+            if (offset >= match_length)
+            {
+                data.append(data, from, match_length);
+            }
+            else
+            {
+                for (size_t i = 0; i < match_length; ++i)
+                {
+                    data += data[from + i];
+                }
+            }
+        }
+
+        return data.size() == limit;
+    }
+
+    // Every input byte yields at most 255 bytes, through a match length extension.
+    uint64_t max_uncompressed_size(uint64_t compressed_size) const override
+    {
+        return compressed_size > std::numeric_limits<uint64_t>::max() / 255 ? std::numeric_limits<uint64_t>::max() : compressed_size * 255;
+    }
+
+private:
+    static uint32_t read32(const uint8_t *source)
+    {
+        uint32_t value;
+        std::memcpy(&value, source, sizeof(value));
+        return value;
+    }
+
+    static void write_length(size_t length, std::string &data)
+    {
+        if (length < 15)
+        {
+            return;
+        }
+
+        length -= 15;
+        while (length >= 255)
+        {
+            data += static_cast<char>(255);
+            length -= 255;
+        }
+        data += static_cast<char>(length);
+    }
+
+    static bool read_length(std::string_view source, size_t &position, size_t &length)
+    {
+        if (length != 15)
+        {
+            return true;
+        }
+
+        while (position < source.size())
+        {
+            auto byte = static_cast<uint8_t>(source[position++]);
+            length += byte;
+            if (byte != 255)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static void write_sequence(const uint8_t *literals, size_t literal_length, size_t offset, size_t match_length, std::string &data)
+    {
+        data += static_cast<char>(std::min<size_t>(literal_length, 15) << 4 | std::min<size_t>(match_length, 15));
+        write_length(literal_length, data);
+        data.append(reinterpret_cast<const char *>(literals), literal_length);
+        data += static_cast<char>(offset & 0xff);
+        data += static_cast<char>(offset >> 8);
+        write_length(match_length, data);
+    }
+};
+
+#ifdef PROTOFLAT_WITH_ZSTD
+class zstd_codec : public block_codec
+{
+public:
+    explicit zstd_codec(int level = 3)
+        : _level(level)
+    {
+    }
+
+    uint8_t id() const override
+    {
+        return 2;
+    }
+
+    void compress(std::string_view source, std::string &data) const override
+    {
+        auto start = data.size();
+        data.resize(start + ZSTD_compressBound(source.size()));
+        auto size = ZSTD_compress(data.data() + start, data.size() - start, source.data(), source.size(), _level);
+        data.resize(start + (ZSTD_isError(size) ? 0 : size));
+    }
+
+    bool decompress(std::string_view source, size_t uncompressed_size, std::string &data) const override
+    {
+        auto content_size = ZSTD_getFrameContentSize(source.data(), source.size());
+        if (content_size != ZSTD_CONTENTSIZE_UNKNOWN && content_size != uncompressed_size)
+        {
+            return false;
+        }
+
+        auto start = data.size();
+        data.resize(start + uncompressed_size);
+        auto size = ZSTD_decompress(data.data() + start, uncompressed_size, source.data(), source.size());
+        if (ZSTD_isError(size) || size != uncompressed_size)
+        {
+            data.resize(start);
+            return false;
+        }
+
+        return true;
+    }
+
+    // A 4 byte RLE block expands to a full 128 KiB block.
+    uint64_t max_uncompressed_size(uint64_t compressed_size) const override
+    {
+        constexpr uint64_t ratio = (128 << 10) / 4;
+        return compressed_size > std::numeric_limits<uint64_t>::max() / ratio ? std::numeric_limits<uint64_t>::max() : compressed_size * ratio;
+    }
+
+private:
+    int _level;
+};
+#endif
+
+inline const std::vector<const block_codec *> &default_block_codecs()
+{
+    static const none_codec none;
+    static const lz_codec lz;
+#ifdef PROTOFLAT_WITH_ZSTD
+    static const zstd_codec zstd;
+    static const std::vector<const block_codec *> codecs{&none, &lz, &zstd};
+#else
+    static const std::vector<const block_codec *> codecs{&none, &lz};
+#endif
+    return codecs;
+}
+
+struct block_info
+{
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint64_t uncompressed_size = 0;
+    uint64_t record_count = 0;
+    uint8_t codec = 0;
+};
+
+inline constexpr std::string_view record_magic = "PFRC";
+inline constexpr uint8_t record_version = 1;
+
+class record_writer
+{
+public:
+    // Appends the container to data; call finish once all records are written.
+    explicit record_writer(std::string &data, const block_codec &codec = *default_block_codecs()[1], size_t block_size = 64 * 1024)
+        : _data(data)
+        , _codec(codec)
+        , _block_size(block_size)
+    {
+        _data.append(record_magic);
+        _data += static_cast<char>(record_version);
+    }
+
+    void write_record(std::string_view record)
+    {
+        type_traits<varint>::serialize(record.size(), _block);
+        _block.append(record);
+        ++_record_count;
+
+        if (_block.size() >= _block_size)
+        {
+            flush();
+        }
+    }
+
+    template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+    void write(const T &value)
+    {
+        type_traits<embedded_message<T>>::serialize(value, _block);
+        ++_record_count;
+
+        if (_block.size() >= _block_size)
+        {
+            flush();
+        }
+    }
+
+    // Closes the current block, e.g. to make the records written so far seekable.
+    void flush()
+    {
+        if (_record_count == 0)
+        {
+            return;
+        }
+
+        block_info block{_data.size(), 0, _block.size(), _record_count, _codec.id()};
+        _codec.compress(_block, _data);
+        block.size = _data.size() - block.offset;
+        _blocks.push_back(block);
+
+        _block.clear();
+        _record_count = 0;
+    }
+
+    void finish()
+    {
+        flush();
+
+        uint64_t index_offset = _data.size();
+        type_traits<varint>::serialize(_blocks.size(), _data);
+        for (auto &block : _blocks)
+        {
+            type_traits<varint>::serialize(block.offset, _data);
+            type_traits<varint>::serialize(block.size, _data);
+            type_traits<varint>::serialize(block.uncompressed_size, _data);
+            type_traits<varint>::serialize(block.record_count, _data);
+            _data += static_cast<char>(block.codec);
+        }
+        type_traits<fixed>::serialize(index_offset, _data);
+        _data.append(record_magic);
+    }
+
+private:
+    std::string &_data;
+    const block_codec &_codec;
+    size_t _block_size;
+
+    std::string _block;
+    uint64_t _record_count = 0;
+    std::vector<block_info> _blocks;
+};
+
+class record_reader
+{
+public:
+    static constexpr size_t default_max_block_size = 64 << 20;
+
+    // Containers with a block that decompresses to more than max_block_size bytes
+    // are rejected by open.
+    explicit record_reader(std::vector<const block_codec *> codecs = default_block_codecs(), size_t max_block_size = default_max_block_size)
+        : _codecs(std::move(codecs))
+        , _max_block_size(max_block_size)
+    {
+    }
+
+    // data must outlive the reader, e.g. a memory mapped file.
+    bool open(std::string_view data)
+    {
+        _data = {};
+        _blocks.clear();
+
+        auto trailer_size = sizeof(uint64_t) + record_magic.size();
+        if (data.size() < record_magic.size() + 1 + trailer_size || data.substr(0, record_magic.size()) != record_magic || data.substr(data.size() - record_magic.size()) != record_magic || static_cast<uint8_t>(data[record_magic.size()]) != record_version)
+        {
+            return false;
+        }
+
+        uint64_t index_offset = 0;
+        auto trailer = data.substr(data.size() - trailer_size);
+        if (!type_traits<fixed>::deserialize(trailer, index_offset) || index_offset > data.size() - trailer_size)
+        {
+            return false;
+        }
+
+        auto index = data.substr(index_offset, data.size() - trailer_size - index_offset);
+        uint64_t block_count = 0;
+        if (!type_traits<varint>::deserialize(index, block_count))
+        {
+            return false;
+        }
+        for (uint64_t i = 0; i < block_count; ++i)
+        {
+            block_info block;
+            if (!type_traits<varint>::deserialize(index, block.offset) || !type_traits<varint>::deserialize(index, block.size) || !type_traits<varint>::deserialize(index, block.uncompressed_size) || !type_traits<varint>::deserialize(index, block.record_count) || index.empty())
+            {
+                return false;
+            }
+            block.codec = static_cast<uint8_t>(index[0]);
+            index.remove_prefix(1);
+
+            // Records take at least one byte each. read_block fails for blocks of an
+            // unknown codec, so only max_block_size applies to them.
+            auto codec = find_codec(block.codec);
+            if (block.offset > index_offset || block.size > index_offset - block.offset || block.uncompressed_size > _max_block_size || block.record_count > block.uncompressed_size || (codec && block.uncompressed_size > codec->max_uncompressed_size(block.size)))
+            {
+                return false;
+            }
+            _blocks.push_back(block);
+        }
+
+        _data = data;
+        return true;
+    }
+
+    const std::vector<block_info> &blocks() const
+    {
+        return _blocks;
+    }
+
+    // Replaces records with the decompressed block; step through it with
+    // type_traits<length_delimited>::deserialize or read_messages. Safe to call
+    // concurrently for different buffers.
+    bool read_block(size_t index, std::string &records) const
+    {
+        records.clear();
+        auto &block = _blocks[index];
+        auto codec = find_codec(block.codec);
+
+        return codec && codec->decompress(_data.substr(block.offset, block.size), block.uncompressed_size, records);
+    }
+
+    template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+    bool read_messages(size_t index, std::vector<T> &values) const
+    {
+        std::string records;
+        if (!read_block(index, records))
+        {
+            return false;
+        }
+
+        std::string_view data(records);
+        values.reserve(values.size() + _blocks[index].record_count);
+        while (!data.empty())
+        {
+            if (!type_traits<embedded_message<T>>::deserialize(data, values.emplace_back()))
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Decompresses all blocks on thread_count threads and calls
+    // callback(size_t index, std::string_view records) for each of them, concurrently
+    // and in no particular order. Stops early when a block fails or callback
+    // returns false.
+    template<class Callback>
+    bool for_each_block(Callback &&callback, size_t thread_count = std::thread::hardware_concurrency()) const
+    {
+        std::atomic<size_t> next{0};
+        std::atomic<bool> result{true};
+        auto worker = [&] {
+            std::string records;
+            for (auto index = next++; index < _blocks.size() && result; index = next++)
+            {
+                if (!read_block(index, records) || !callback(index, std::string_view(records)))
+                {
+                    result = false;
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < std::min(thread_count, _blocks.size()); ++i)
+        {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+
+        return result;
+    }
+
+private:
+    const block_codec *find_codec(uint8_t id) const
+    {
+        for (auto codec : _codecs)
+        {
+            if (codec->id() == id)
+            {
+                return codec;
+            }
+        }
+
+        return nullptr;
+    }
+
+    std::vector<const block_codec *> _codecs;
+    size_t _max_block_size;
+    std::string_view _data;
+    std::vector<block_info> _blocks;
+};
+
+} // namespace protoflat
@@ -0,0 +1,461 @@
+#pragma once
+
+#include <protoflat.h>
+#include <protoflat_pool.h>
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace protoflat
+{
+
+// Message queue in shared memory between processes on one host (Linux). The ring
+// has a fixed number of slots of a fixed size; any number of producers claim slots
+// and copy a serialized message into them, and a single consumer decodes messages
+// in place. Slots carry sequence numbers (Vyukov's bounded queue), so neither side
+// takes a lock, and an idle side sleeps on a futex in the mapping instead of
+// polling.
+//
+//   protoflat::shared_ring ring;
+//   ring.create(1024, 4096);              // then pass ring.fd() to the peer,
+//   ring.push_message(message);           // which calls ring.open(fd)
+//
+//   protoflat::shared_ring ring;
+//   ring.open(fd);
+//   while (ring.pop_message(message)) ...
+//
+// Messages larger than the slot size are rejected.
+class shared_ring
+{
+public:
+    shared_ring() = default;
+
+    shared_ring(const shared_ring &) = delete;
+    shared_ring &operator=(const shared_ring &) = delete;
+
+    ~shared_ring()
+    {
+        close();
+    }
+
+    // Creates a ring in an anonymous memfd; share it by passing fd() to another
+    // process over a Unix socket or by forking. slot_count must be a power of two.
+    bool create(uint32_t slot_count, uint32_t slot_size)
+    {
+        close();
+        auto fd = static_cast<int>(syscall(SYS_memfd_create, "protoflat_ring", 0u));
+        return fd >= 0 && initialize(fd, slot_count, slot_size);
+    }
+
+    // Creates a ring in a new POSIX shared memory object, which others open by name;
+    // it exists until shm_unlink(name).
+    bool create(const std::string &name, uint32_t slot_count, uint32_t slot_size)
+    {
+        close();
+        auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        // Remove the object this call created, or retries with the name would fail.
+        if (!initialize(fd, slot_count, slot_size))
+        {
+            shm_unlink(name.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    // Maps a ring created elsewhere; the descriptor is duplicated.
+    bool open(int fd)
+    {
+        close();
+        auto duplicate = dup(fd);
+        return duplicate >= 0 && map(duplicate);
+    }
+
+    bool open(const std::string &name)
+    {
+        close();
+        auto fd = shm_open(name.c_str(), O_RDWR, 0);
+        return fd >= 0 && map(fd);
+    }
+
+    void close()
+    {
+        if (_header)
+        {
+            munmap(_header, _mapping_size);
+            _header = nullptr;
+        }
+        if (_fd >= 0)
+        {
+            ::close(_fd);
+            _fd = -1;
+        }
+        _popped = nullptr;
+    }
+
+    bool is_valid() const
+    {
+        return _header != nullptr;
+    }
+
+    int fd() const
+    {
+        return _fd;
+    }
+
+    uint32_t slot_size() const
+    {
+        return _slot_size;
+    }
+
+    // Producer side, safe from any number of threads and processes.
+
+    // Returns false when the ring is full or data is larger than a slot.
+    bool try_push(std::string_view data)
+    {
+        slot *target = nullptr;
+        uint64_t position = 0;
+        if (data.size() > _slot_size || !claim(target, position))
+        {
+            return false;
+        }
+
+        publish(target, position, data);
+        return true;
+    }
+
+    // Waits while the ring is full; false only when data is larger than a slot.
+    bool push(std::string_view data)
+    {
+        if (data.size() > _slot_size)
+        {
+            return false;
+        }
+
+        slot *target = nullptr;
+        uint64_t position = 0;
+        while (!claim(target, position))
+        {
+            wait(_header->space_signal, _header->waiting_producers, [&] { return has_space(); });
+        }
+
+        publish(target, position, data);
+        return true;
+    }
+
+    template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+    bool try_push_message(const T &value)
+    {
+        return try_push(serialize_pooled(value));
+    }
+
+    template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+    bool push_message(const T &value)
+    {
+        return push(serialize_pooled(value));
+    }
+
+    // Consumer side, one thread at a time.
+
+    // Points data into the oldest slot, which stays valid and is not reused until
+    // release is called. Returns false when the ring is empty.
+    bool try_pop(std::string_view &data)
+    {
+        if (!_popped)
+        {
+            auto position = _header->dequeue_position.load(std::memory_order_relaxed);
+            auto source = slot_at(position);
+            if (source->sequence.load(std::memory_order_acquire) != position + 1)
+            {
+                return false;
+            }
+            _popped = source;
+        }
+
+        // The size comes from another process, do not trust it.
+        data = std::string_view(payload(_popped), std::min(_popped->size, _slot_size));
+        return true;
+    }
+
+    // Waits while the ring is empty.
+    void pop(std::string_view &data)
+    {
+        while (!try_pop(data))
+        {
+            wait(_header->data_signal, _header->waiting_consumers, [&] { return has_data(); });
+        }
+    }
+
+    // Hands the slot of the last pop back to the producers.
+    void release()
+    {
+        if (!_popped)
+        {
+            return;
+        }
+
+        auto position = _header->dequeue_position.load(std::memory_order_relaxed);
+        _popped->sequence.store(position + _slot_count, std::memory_order_release);
+        _header->dequeue_position.store(position + 1, std::memory_order_relaxed);
+        _popped = nullptr;
+        wake(_header->space_signal, _header->waiting_producers);
+    }
+
+    // Waits for a message and decodes it straight from its slot. Returns false
+    // when the message is malformed; it is dropped either way.
+    template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+    bool pop_message(T &value)
+    {
+        std::string_view data;
+        pop(data);
+        auto is_decoded = deserialize(data, value);
+        release();
+        return is_decoded;
+    }
+
+    template<class T, typename = std::enable_if_t<std::is_class_v<T>>>
+    bool try_pop_message(T &value, bool &is_decoded)
+    {
+        std::string_view data;
+        if (!try_pop(data))
+        {
+            return false;
+        }
+
+        is_decoded = deserialize(data, value);
+        release();
+        return true;
+    }
+
+private:
+    static constexpr uint64_t magic = 0x31474e4952465000; // "\0PFRING1"
+    static constexpr size_t cache_line_size = 64;
+    // Failed checks before sleeping on the futex.
+    static constexpr int spin_count = 256;
+
+    struct header
+    {
+        uint64_t magic;
+        uint32_t slot_count;
+        uint32_t slot_size;
+        alignas(cache_line_size) std::atomic<uint64_t> enqueue_position;
+        alignas(cache_line_size) std::atomic<uint64_t> dequeue_position;
+        // Futex words, bumped on every wake, and how many are sleeping on them.
+        alignas(cache_line_size) std::atomic<uint32_t> data_signal;
+        std::atomic<uint32_t> waiting_consumers;
+        alignas(cache_line_size) std::atomic<uint32_t> space_signal;
+        std::atomic<uint32_t> waiting_producers;
+    };
+
+    struct slot
+    {
+        std::atomic<uint64_t> sequence;
+        uint32_t size;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free, "shared memory needs address free atomics");
+
+    static size_t slot_stride(uint32_t slot_size)
+    {
+        return (sizeof(slot) + slot_size + cache_line_size - 1) / cache_line_size * cache_line_size;
+    }
+
+    static size_t mapping_size(uint32_t slot_count, uint32_t slot_size)
+    {
+        return sizeof(header) + slot_count * slot_stride(slot_size);
+    }
+
+    static char *payload(slot *value)
+    {
+        return reinterpret_cast<char *>(value) + sizeof(slot);
+    }
+
+    bool initialize(int fd, uint32_t slot_count, uint32_t slot_size)
+    {
+        if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0 || ftruncate(fd, static_cast<off_t>(mapping_size(slot_count, slot_size))) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        auto address = mmap(nullptr, mapping_size(slot_count, slot_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        // The new object is zero filled, so the atomics start out as zero too.
+        _header = static_cast<header *>(address);
+        _fd = fd;
+        _mapping_size = mapping_size(slot_count, slot_size);
+        _header->slot_count = slot_count;
+        _header->slot_size = slot_size;
+        set_geometry(slot_count, slot_size);
+        for (uint32_t i = 0; i < slot_count; ++i)
+        {
+            slot_at(i)->sequence.store(i, std::memory_order_relaxed);
+        }
+        std::atomic_ref(_header->magic).store(magic, std::memory_order_release);
+
+        return true;
+    }
+
+    bool map(int fd)
+    {
+        struct stat status;
+        if (fstat(fd, &status) != 0 || static_cast<size_t>(status.st_size) < sizeof(header))
+        {
+            ::close(fd);
+            return false;
+        }
+
+        auto address = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        _header = static_cast<header *>(address);
+        _fd = fd;
+        _mapping_size = static_cast<size_t>(status.st_size);
+
+        // Read the geometry once: the peer can rewrite the header at any time, and
+        // only the values checked here against the mapping size are safe to use.
+        auto is_ready = std::atomic_ref(_header->magic).load(std::memory_order_acquire) == magic;
+        auto slot_count = std::atomic_ref(_header->slot_count).load(std::memory_order_relaxed);
+        auto slot_size = std::atomic_ref(_header->slot_size).load(std::memory_order_relaxed);
+        if (!is_ready || slot_count == 0 || (slot_count & (slot_count - 1)) != 0 || mapping_size(slot_count, slot_size) > _mapping_size)
+        {
+            close();
+            return false;
+        }
+
+        set_geometry(slot_count, slot_size);
+        return true;
+    }
+
+    void set_geometry(uint32_t slot_count, uint32_t slot_size)
+    {
+        _slots = reinterpret_cast<char *>(_header) + sizeof(header);
+        _slot_count = slot_count;
+        _slot_size = slot_size;
+        _slot_stride = slot_stride(slot_size);
+    }
+
+    slot *slot_at(uint64_t position) const
+    {
+        return reinterpret_cast<slot *>(_slots + (position & (_slot_count - 1)) * _slot_stride);
+    }
+
+    bool claim(slot *&target, uint64_t &position)
+    {
+        position = _header->enqueue_position.load(std::memory_order_relaxed);
+        while (true)
+        {
+            target = slot_at(position);
+            auto sequence = target->sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<int64_t>(sequence - position);
+            if (difference == 0)
+            {
+                if (_header->enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    return true;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = _header->enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void publish(slot *target, uint64_t position, std::string_view data)
+    {
+        std::memcpy(payload(target), data.data(), data.size());
+        target->size = static_cast<uint32_t>(data.size());
+        target->sequence.store(position + 1, std::memory_order_release);
+        wake(_header->data_signal, _header->waiting_consumers);
+    }
+
+    bool has_data() const
+    {
+        auto position = _header->dequeue_position.load(std::memory_order_relaxed);
+        return slot_at(position)->sequence.load(std::memory_order_acquire) == position + 1;
+    }
+
+    bool has_space() const
+    {
+        auto position = _header->enqueue_position.load(std::memory_order_relaxed);
+        return slot_at(position)->sequence.load(std::memory_order_acquire) == position;
+    }
+
+    // Sleeps until is_ready or a wake on signal. Announcing the sleeper before the
+    // last check and the fence in wake make sure one of the two sides sees the other.
+    template<class Ready>
+    static void wait(std::atomic<uint32_t> &signal, std::atomic<uint32_t> &waiting, Ready is_ready)
+    {
+        for (int i = 0; i < spin_count; ++i)
+        {
+            if (is_ready())
+            {
+                return;
+            }
+        }
+
+        auto value = signal.load(std::memory_order_acquire);
+        waiting.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!is_ready())
+        {
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&signal), FUTEX_WAIT, value, nullptr, nullptr, 0);
+        }
+        waiting.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    static void wake(std::atomic<uint32_t> &signal, std::atomic<uint32_t> &waiting)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) != 0)
+        {
+            signal.fetch_add(1, std::memory_order_release);
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&signal), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+    header *_header = nullptr;
+    size_t _mapping_size = 0;
+    // Geometry of the mapping, fixed when it is created or validated when it is
+    // mapped, and never read back from the shared header.
+    char *_slots = nullptr;
+    uint32_t _slot_count = 0;
+    uint32_t _slot_size = 0;
+    size_t _slot_stride = 0;
+    int _fd = -1;
+    // Slot handed out by try_pop and not yet released.
+    slot *_popped = nullptr;
+};
+
+} // namespace protoflat
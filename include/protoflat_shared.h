@@ -0,0 +1,305 @@
+#pragma once
+
+#include <protoflat.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace protoflat
+{
+
+// Reference-counted, copy-on-write optional value: the std::optional interface used
+// by protoflat, where copies share one immutable node. The node also keeps the
+// serialized value once it has been encoded, so a submessage fanned out to many
+// parents is copied in constant time and encoded once. Generated messages use it
+// for submessages marked with (protoflat.shared) or named in "shared=" parameters.
+//
+// Change the value with mutate, which gives the object a node of its own if others
+// still share it and drops the cached encoding when the change is done. emplace and
+// the non-const operator* and operator-> hand out a reference whose later writes the
+// node cannot see, so like a copy-on-write std::string the node then stops being
+// shared (copies take their own) and cached (parents encode the value straight
+// into their own output) until a new value is assigned.
+template<class T>
+class shared
+{
+public:
+    using value_type = T;
+
+    shared() = default;
+
+    shared(const shared &another)
+        : _node(another.shareable_node())
+    {
+    }
+
+    shared(shared &&) noexcept = default;
+
+    shared &operator=(const shared &another)
+    {
+        _node = another.shareable_node();
+        return *this;
+    }
+
+    shared &operator=(shared &&) noexcept = default;
+
+    shared(const T &value)
+        : _node(std::make_shared<node>(value))
+    {
+    }
+
+    shared(T &&value)
+        : _node(std::make_shared<node>(std::move(value)))
+    {
+    }
+
+    explicit operator bool() const
+    {
+        return _node != nullptr;
+    }
+
+    bool has_value() const
+    {
+        return _node != nullptr;
+    }
+
+    const T &operator*() const
+    {
+        return _node->value;
+    }
+
+    const T *operator->() const
+    {
+        return &_node->value;
+    }
+
+    T &operator*()
+    {
+        return leaked_node().value;
+    }
+
+    T *operator->()
+    {
+        return &leaked_node().value;
+    }
+
+    template<class... Args>
+    T &emplace(Args &&...args)
+    {
+        _node = std::make_shared<node>(std::forward<Args>(args)...);
+        _node->is_leaked = true;
+        return _node->value;
+    }
+
+    // Calls fn with the value, constructed first when absent, and returns its result.
+    // The reference must not escape fn.
+    template<class Function>
+    decltype(auto) mutate(Function &&fn)
+    {
+        if (!_node)
+        {
+            _node = std::make_shared<node>();
+        }
+
+        auto &target = mutable_node();
+        struct encoding_guard
+        {
+            node &target;
+
+            ~encoding_guard()
+            {
+                target.is_encoded = false;
+            }
+        } guard{target};
+
+        return std::forward<Function>(fn)(target.value);
+    }
+
+    void reset()
+    {
+        _node.reset();
+    }
+
+    bool is_shared() const
+    {
+        return _node.use_count() > 1;
+    }
+
+    // Whether encoding may be used: false once a reference was handed out.
+    bool is_cacheable() const
+    {
+        return !_node->is_leaked;
+    }
+
+    // The serialized value, encoded on first use and kept until the next mutation.
+    // Safe to call from several threads sharing the node; needs is_cacheable.
+    std::string_view encoding() const
+    {
+        std::lock_guard lock(_node->mutex);
+        if (!_node->is_encoded)
+        {
+            _node->encoding.clear();
+            serialize_to_string(_node->value, _node->encoding);
+            _node->is_encoded = true;
+        }
+
+        return _node->encoding;
+    }
+
+    friend bool operator==(const shared &a, const shared &b)
+    {
+        return a._node == b._node || (a && b && *a == *b);
+    }
+
+private:
+    struct node
+    {
+        template<class... Args>
+        explicit node(Args &&...args)
+            : value(std::forward<Args>(args)...)
+        {
+        }
+
+        T value;
+        std::mutex mutex;
+        std::string encoding;
+        bool is_encoded = false;
+        // A reference to value was handed out, see the class comment.
+        bool is_leaked = false;
+    };
+
+    std::shared_ptr<node> shareable_node() const
+    {
+        if (_node && _node->is_leaked)
+        {
+            return std::make_shared<node>(std::as_const(_node->value));
+        }
+
+        return _node;
+    }
+
+    node &mutable_node()
+    {
+        if (_node.use_count() > 1)
+        {
+            _node = std::make_shared<node>(std::as_const(_node->value));
+        }
+        else
+        {
+            _node->is_encoded = false;
+        }
+
+        return *_node;
+    }
+
+    node &leaked_node()
+    {
+        auto &target = mutable_node();
+        target.is_leaked = true;
+        return target;
+    }
+
+    std::shared_ptr<node> _node;
+};
+
+// Writes shared submessages from their cached encoding when they have one, and
+// decodes them through mutate so that the node stays shareable.
+template<class T>
+struct type_traits<embedded_message<shared<T>>>
+{
+    static size_t size(const shared<T> &value)
+    {
+        return value.is_cacheable() ? value.encoding().size() : type_traits<T>::size(*value);
+    }
+
+    static void serialize(const shared<T> &value, std::string &data)
+    {
+        if (!value.is_cacheable())
+        {
+            type_traits<embedded_message<T>>::serialize(*value, data);
+            return;
+        }
+
+        auto encoding = value.encoding();
+        type_traits<varint>::serialize(encoding.size(), data);
+        data.append(encoding);
+    }
+
+    template<decode_mode mode = decode_mode::merge>
+    static bool deserialize(std::string_view &data, shared<T> &value)
+    {
+        // Decoding in reuse mode clears the value, so a node others still hold is
+        // replaced instead of copied.
+        if constexpr (mode == decode_mode::reuse)
+        {
+            if (value.is_shared())
+            {
+                value.reset();
+            }
+        }
+
+        return value.mutate([&](T &message) { return type_traits<embedded_message<T>>::template deserialize<mode>(data, message); });
+    }
+
+    template<decode_mode mode = decode_mode::merge>
+    static bool deserialize(std::string_view &data, shared<T> &value, bool &is_seen)
+    {
+        if constexpr (mode == decode_mode::reuse)
+        {
+            if (!is_seen)
+            {
+                is_seen = true;
+                return deserialize<decode_mode::reuse>(data, value);
+            }
+        }
+
+        is_seen = true;
+        return deserialize<decode_mode::merge>(data, value);
+    }
+};
+
+namespace codec
+{
+
+// Singular submessages stored as shared<T>, written from their cached encoding.
+template<class Shared>
+struct shared_message : message<Shared>
+{
+    static size_t size(const field_entry &field, const void *value)
+    {
+        auto &field_value = *static_cast<const Shared *>(value);
+        if (!field_value)
+        {
+            return 0;
+        }
+
+        return type_traits<varint>::size(field.tag) + length_prefixed_size(type_traits<embedded_message<Shared>>::size(field_value));
+    }
+
+    static void serialize(const field_entry &field, const void *value, std::string &data)
+    {
+        auto &field_value = *static_cast<const Shared *>(value);
+        if (field_value)
+        {
+            type_traits<varint>::serialize(field.tag, data);
+            type_traits<embedded_message<Shared>>::serialize(field_value, data);
+        }
+    }
+
+    static bool deserialize(const field_entry &, wire_type type, std::string_view &data, void *value)
+    {
+        if (type != wire_type::length_delimited)
+        {
+            return skip_field(data, type);
+        }
+
+        return type_traits<embedded_message<Shared>>::deserialize(data, *static_cast<Shared *>(value));
+    }
+};
+
+} // namespace codec
+
+} // namespace protoflat
@@ -0,0 +1,358 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+namespace protoflat
+{
+
+// Vector with room for N elements inside the object; only larger contents are moved
+// to the heap. Generated messages use it for repeated fields when protoc-gen-protoflat
+// runs with "small_vector=N" or a field sets (protoflat.inline_capacity). It covers
+// the part of the std::vector interface that protoflat and typical callers need.
+template<class T, size_t N>
+class small_vector
+{
+    static_assert(N > 0, "use std::vector for fields without inline capacity");
+
+public:
+    using value_type = T;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using reference = T &;
+    using const_reference = const T &;
+    using pointer = T *;
+    using const_pointer = const T *;
+    using iterator = T *;
+    using const_iterator = const T *;
+
+    small_vector() = default;
+
+    small_vector(std::initializer_list<T> values)
+    {
+        assign(values.begin(), values.end());
+    }
+
+    small_vector(const small_vector &another)
+    {
+        assign(another.begin(), another.end());
+    }
+
+    small_vector(small_vector &&another) noexcept(std::is_nothrow_move_constructible_v<T>)
+    {
+        take(another);
+    }
+
+    ~small_vector()
+    {
+        std::destroy(begin(), end());
+        release();
+    }
+
+    small_vector &operator=(const small_vector &another)
+    {
+        if (this != &another)
+        {
+            clear();
+            assign(another.begin(), another.end());
+        }
+
+        return *this;
+    }
+
+    small_vector &operator=(small_vector &&another) noexcept(std::is_nothrow_move_constructible_v<T>)
+    {
+        if (this != &another)
+        {
+            std::destroy(begin(), end());
+            release();
+            _data = inline_data();
+            _size = 0;
+            _capacity = N;
+            take(another);
+        }
+
+        return *this;
+    }
+
+    iterator begin()
+    {
+        return _data;
+    }
+
+    const_iterator begin() const
+    {
+        return _data;
+    }
+
+    iterator end()
+    {
+        return _data + _size;
+    }
+
+    const_iterator end() const
+    {
+        return _data + _size;
+    }
+
+    T *data()
+    {
+        return _data;
+    }
+
+    const T *data() const
+    {
+        return _data;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    size_t capacity() const
+    {
+        return _capacity;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    T &operator[](size_t index)
+    {
+        return _data[index];
+    }
+
+    const T &operator[](size_t index) const
+    {
+        return _data[index];
+    }
+
+    T &front()
+    {
+        return _data[0];
+    }
+
+    const T &front() const
+    {
+        return _data[0];
+    }
+
+    T &back()
+    {
+        return _data[_size - 1];
+    }
+
+    const T &back() const
+    {
+        return _data[_size - 1];
+    }
+
+    void reserve(size_t capacity)
+    {
+        if (capacity <= _capacity)
+        {
+            return;
+        }
+
+        auto data = std::allocator<T>().allocate(capacity);
+        std::uninitialized_move(begin(), end(), data);
+        std::destroy(begin(), end());
+        release();
+
+        _data = data;
+        _capacity = capacity;
+    }
+
+    template<class... Args>
+    T &emplace_back(Args &&...args)
+    {
+        if (_size == _capacity)
+        {
+            // args may refer to an element, so construct the new one before moving.
+            T value(std::forward<Args>(args)...);
+            reserve(_capacity * 2);
+            return *std::construct_at(_data + _size++, std::move(value));
+        }
+
+        return *std::construct_at(_data + _size++, std::forward<Args>(args)...);
+    }
+
+    void push_back(const T &value)
+    {
+        emplace_back(value);
+    }
+
+    void push_back(T &&value)
+    {
+        emplace_back(std::move(value));
+    }
+
+    void pop_back()
+    {
+        std::destroy_at(_data + --_size);
+    }
+
+    void resize(size_t size)
+    {
+        if (size < _size)
+        {
+            std::destroy(begin() + size, end());
+        }
+        else
+        {
+            if (size > _capacity)
+            {
+                reserve(std::max(size, _capacity * 2));
+            }
+            std::uninitialized_value_construct(end(), begin() + size);
+        }
+        _size = size;
+    }
+
+    // Keeps heap storage, like std::vector.
+    void clear()
+    {
+        std::destroy(begin(), end());
+        _size = 0;
+    }
+
+    template<class Iterator>
+    void assign(Iterator first, Iterator last)
+    {
+        clear();
+        reserve(static_cast<size_t>(std::distance(first, last)));
+        std::uninitialized_copy(first, last, _data);
+        _size = static_cast<size_t>(std::distance(first, last));
+    }
+
+    friend bool operator==(const small_vector &a, const small_vector &b)
+    {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end());
+    }
+
+private:
+    T *inline_data()
+    {
+        return reinterpret_cast<T *>(_storage);
+    }
+
+    bool is_inline() const
+    {
+        return _data == reinterpret_cast<const T *>(_storage);
+    }
+
+    void release()
+    {
+        if (!is_inline())
+        {
+            std::allocator<T>().deallocate(_data, _capacity);
+        }
+    }
+
+    // Expects this to be empty and inline.
+    void take(small_vector &another)
+    {
+        if (another.is_inline())
+        {
+            std::uninitialized_move(another.begin(), another.end(), _data);
+            _size = another._size;
+            another.clear();
+        }
+        else
+        {
+            _data = std::exchange(another._data, another.inline_data());
+            _size = std::exchange(another._size, 0);
+            _capacity = std::exchange(another._capacity, N);
+        }
+    }
+
+    T *_data = inline_data();
+    size_t _size = 0;
+    size_t _capacity = N;
+    alignas(T) unsigned char _storage[N * sizeof(T)];
+};
+
+// String and bytes fields with up to N characters inline, see small_vector. Converts
+// to std::string_view, which is how protoflat reads it; no terminating zero is kept.
+template<size_t N>
+class small_string : public small_vector<char, N>
+{
+public:
+    small_string() = default;
+
+    small_string(std::string_view value)
+    {
+        assign(value);
+    }
+
+    small_string(const char *value)
+        : small_string(std::string_view(value))
+    {
+    }
+
+    small_string &operator=(std::string_view value)
+    {
+        assign(value);
+        return *this;
+    }
+
+    small_string &operator=(const char *value)
+    {
+        return *this = std::string_view(value);
+    }
+
+    void assign(const char *value, size_t size)
+    {
+        small_vector<char, N>::assign(value, value + size);
+    }
+
+    void assign(std::string_view value)
+    {
+        assign(value.data(), value.size());
+    }
+
+    small_string &append(std::string_view value)
+    {
+        auto size = this->size();
+        this->resize(size + value.size());
+        std::memcpy(this->data() + size, value.data(), value.size());
+
+        return *this;
+    }
+
+    small_string &operator+=(std::string_view value)
+    {
+        return append(value);
+    }
+
+    operator std::string_view() const
+    {
+        return std::string_view(this->data(), this->size());
+    }
+
+    friend bool operator==(const small_string &a, const small_string &b)
+    {
+        return std::string_view(a) == std::string_view(b);
+    }
+
+    friend bool operator==(const small_string &a, std::string_view b)
+    {
+        return std::string_view(a) == b;
+    }
+
+    // Both overloads above accept a literal through a converting constructor.
+    friend bool operator==(const small_string &a, const char *b)
+    {
+        return std::string_view(a) == b;
+    }
+};
+
+} // namespace protoflat
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace protoflat
+{
+
+// Field occurrence statistics for profile-guided code generation. Code generated by
+// protoc-gen-protoflat and compiled with PROTOFLAT_FIELD_STATS counts every field
+// its decoders meet; dump writes the counts in the format the generator reads with
+// "profile=path", which then tests the hottest fields first and declares them first.
+namespace field_stats
+{
+
+class counters
+{
+public:
+    // Higher field numbers share the last counter and are not dumped.
+    static constexpr uint32_t max_field_number = 1024;
+
+    void record(uint64_t field_number)
+    {
+        _counts[std::min<uint64_t>(field_number, max_field_number + 1)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count(uint64_t field_number) const
+    {
+        return field_number <= max_field_number ? _counts[field_number].load(std::memory_order_relaxed) : 0;
+    }
+
+    void reset()
+    {
+        for (auto &count : _counts)
+        {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    std::atomic<uint64_t> _counts[max_field_number + 2] = {};
+};
+
+namespace detail
+{
+
+struct registry
+{
+    std::mutex mutex;
+    std::deque<counters> storage;
+    std::map<std::string, counters *, std::less<>> messages;
+};
+
+inline registry &global_registry()
+{
+    static registry instance;
+    return instance;
+}
+
+} // namespace detail
+
+// Returns the counters of a message, which live until the program exits.
+inline counters &register_message(std::string_view message_name)
+{
+    auto &registry = detail::global_registry();
+    std::lock_guard lock(registry.mutex);
+    auto message = registry.messages.find(message_name);
+    if (message == registry.messages.end())
+    {
+        message = registry.messages.emplace(std::string(message_name), &registry.storage.emplace_back()).first;
+    }
+
+    return *message->second;
+}
+
+// Writes "<message full name> <field number> <count>" for every field seen.
+inline void dump(std::ostream &stream)
+{
+    auto &registry = detail::global_registry();
+    std::lock_guard lock(registry.mutex);
+    for (auto &[message_name, message_counters] : registry.messages)
+    {
+        for (uint32_t number = 1; number <= counters::max_field_number; ++number)
+        {
+            if (auto count = message_counters->count(number))
+            {
+                stream << message_name << ' ' << number << ' ' << count << '\n';
+            }
+        }
+    }
+}
+
+inline bool dump(const std::string &path)
+{
+    std::ofstream stream(path);
+    dump(stream);
+    return static_cast<bool>(stream.flush());
+}
+
+inline void reset()
+{
+    auto &registry = detail::global_registry();
+    std::lock_guard lock(registry.mutex);
+    for (auto &message_counters : registry.storage)
+    {
+        message_counters.reset();
+    }
+}
+
+} // namespace field_stats
+
+} // namespace protoflat
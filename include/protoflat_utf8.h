@@ -0,0 +1,447 @@
+#pragma once
+
+#include <protoflat.h>
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+
+namespace protoflat
+{
+
+namespace utf8
+{
+
+namespace detail
+{
+
+inline bool is_valid_scalar(const uint8_t *data, size_t size)
+{
+    size_t i = 0;
+    while (i < size)
+    {
+        if (i + 8 <= size)
+        {
+            uint64_t word = 0;
+            std::memcpy(&word, data + i, sizeof(word));
+            if ((word & 0x8080808080808080ull) == 0)
+            {
+                i += 8;
+                continue;
+            }
+        }
+
+        auto lead = data[i];
+        if (lead < 0x80)
+        {
+            ++i;
+            continue;
+        }
+
+        size_t length = 0;
+        uint32_t code_point = 0;
+        uint32_t min_code_point = 0;
+        if ((lead & 0xe0) == 0xc0)
+        {
+            length = 2;
+            code_point = lead & 0x1f;
+            min_code_point = 0x80;
+        }
+        else if ((lead & 0xf0) == 0xe0)
+        {
+            length = 3;
+            code_point = lead & 0x0f;
+            min_code_point = 0x800;
+        }
+        else if ((lead & 0xf8) == 0xf0)
+        {
+            length = 4;
+            code_point = lead & 0x07;
+            min_code_point = 0x10000;
+        }
+        else
+        {
+            return false;
+        }
+        if (size - i < length)
+        {
+            return false;
+        }
+
+        for (size_t k = 1; k < length; ++k)
+        {
+            auto byte = data[i + k];
+            if ((byte & 0xc0) != 0x80)
+            {
+                return false;
+            }
+            code_point = code_point << 6 | (byte & 0x3f);
+        }
+        if (code_point < min_code_point || code_point > 0x10ffff || (code_point >= 0xd800 && code_point <= 0xdfff))
+        {
+            return false;
+        }
+        i += length;
+    }
+
+    return true;
+}
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+
+// Lookup algorithm of Keiser and Lemire, "Validating UTF-8 In Less Than One
+// Instruction Per Byte" (2021). Each byte is classified by three 16-entry tables
+// indexed by its predecessor's high and low nibble and its own high nibble; the
+// AND of the three lookups is non-zero exactly for invalid two-byte sequences.
+// Lengths of three- and four-byte sequences are checked separately.
+inline constexpr uint8_t too_short = 1 << 0;
+inline constexpr uint8_t too_long = 1 << 1;
+inline constexpr uint8_t overlong_3 = 1 << 2;
+inline constexpr uint8_t too_large = 1 << 3;
+inline constexpr uint8_t surrogate = 1 << 4;
+inline constexpr uint8_t overlong_2 = 1 << 5;
+inline constexpr uint8_t too_large_1000 = 1 << 6;
+inline constexpr uint8_t overlong_4 = 1 << 6;
+inline constexpr uint8_t two_continuations = 1 << 7;
+inline constexpr uint8_t carry = too_short | too_long | two_continuations;
+
+alignas(16) inline constexpr uint8_t byte_1_high_table[16] = {
+    too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+    two_continuations, two_continuations, two_continuations, two_continuations,
+    too_short | overlong_2,
+    too_short,
+    too_short | overlong_3 | surrogate,
+    too_short | too_large | too_large_1000 | overlong_4};
+
+alignas(16) inline constexpr uint8_t byte_1_low_table[16] = {
+    carry | overlong_3 | overlong_2 | overlong_4,
+    carry | overlong_2,
+    carry,
+    carry,
+    carry | too_large,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000 | surrogate,
+    carry | too_large | too_large_1000,
+    carry | too_large | too_large_1000};
+
+alignas(16) inline constexpr uint8_t byte_2_high_table[16] = {
+    too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+    too_long | overlong_2 | two_continuations | overlong_3 | too_large_1000 | overlong_4,
+    too_long | overlong_2 | two_continuations | overlong_3 | too_large,
+    too_long | overlong_2 | two_continuations | surrogate | too_large,
+    too_long | overlong_2 | two_continuations | surrogate | too_large,
+    too_short, too_short, too_short, too_short};
+
+#endif
+
+#if defined(__AVX2__)
+
+struct avx2
+{
+    using vector = __m256i;
+    static constexpr size_t size = 32;
+
+    static vector load(const uint8_t *data)
+    {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+    }
+
+    static vector table(const uint8_t (&values)[16])
+    {
+        return _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(values)));
+    }
+
+    static vector zero()
+    {
+        return _mm256_setzero_si256();
+    }
+
+    static vector splat(uint8_t value)
+    {
+        return _mm256_set1_epi8(static_cast<char>(value));
+    }
+
+    // Bytes of input shifted back by N, the first N taken from the end of previous.
+    template<int N>
+    static vector prev(vector input, vector previous)
+    {
+        return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - N);
+    }
+
+    static vector high_nibbles(vector value)
+    {
+        return _mm256_and_si256(_mm256_srli_epi16(value, 4), splat(0x0f));
+    }
+
+    static vector low_nibbles(vector value)
+    {
+        return _mm256_and_si256(value, splat(0x0f));
+    }
+
+    static vector lookup(vector table, vector index)
+    {
+        return _mm256_shuffle_epi8(table, index);
+    }
+
+    static vector bit_and(vector a, vector b)
+    {
+        return _mm256_and_si256(a, b);
+    }
+
+    static vector bit_or(vector a, vector b)
+    {
+        return _mm256_or_si256(a, b);
+    }
+
+    static vector bit_xor(vector a, vector b)
+    {
+        return _mm256_xor_si256(a, b);
+    }
+
+    static vector saturating_sub(vector a, vector b)
+    {
+        return _mm256_subs_epu8(a, b);
+    }
+
+    static bool is_ascii(vector value)
+    {
+        return _mm256_movemask_epi8(value) == 0;
+    }
+
+    static bool is_zero(vector value)
+    {
+        return _mm256_testz_si256(value, value) != 0;
+    }
+};
+
+#endif
+
+#if defined(__SSSE3__)
+
+struct ssse3
+{
+    using vector = __m128i;
+    static constexpr size_t size = 16;
+
+    static vector load(const uint8_t *data)
+    {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    }
+
+    static vector table(const uint8_t (&values)[16])
+    {
+        return _mm_load_si128(reinterpret_cast<const __m128i *>(values));
+    }
+
+    static vector zero()
+    {
+        return _mm_setzero_si128();
+    }
+
+    static vector splat(uint8_t value)
+    {
+        return _mm_set1_epi8(static_cast<char>(value));
+    }
+
+    template<int N>
+    static vector prev(vector input, vector previous)
+    {
+        return _mm_alignr_epi8(input, previous, 16 - N);
+    }
+
+    static vector high_nibbles(vector value)
+    {
+        return _mm_and_si128(_mm_srli_epi16(value, 4), splat(0x0f));
+    }
+
+    static vector low_nibbles(vector value)
+    {
+        return _mm_and_si128(value, splat(0x0f));
+    }
+
+    static vector lookup(vector table, vector index)
+    {
+        return _mm_shuffle_epi8(table, index);
+    }
+
+    static vector bit_and(vector a, vector b)
+    {
+        return _mm_and_si128(a, b);
+    }
+
+    static vector bit_or(vector a, vector b)
+    {
+        return _mm_or_si128(a, b);
+    }
+
+    static vector bit_xor(vector a, vector b)
+    {
+        return _mm_xor_si128(a, b);
+    }
+
+    static vector saturating_sub(vector a, vector b)
+    {
+        return _mm_subs_epu8(a, b);
+    }
+
+    static bool is_ascii(vector value)
+    {
+        return _mm_movemask_epi8(value) == 0;
+    }
+
+    static bool is_zero(vector value)
+    {
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(value, _mm_setzero_si128())) == 0xffff;
+    }
+};
+
+#endif
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+
+template<class Simd>
+class validator
+{
+public:
+    using vector = typename Simd::vector;
+
+    void check(vector input)
+    {
+        // All-ASCII blocks only need to complete the sequence left open before them.
+        if (Simd::is_ascii(input))
+        {
+            _error = Simd::bit_or(_error, _previous_incomplete);
+            _previous_incomplete = Simd::zero();
+        }
+        else
+        {
+            _error = Simd::bit_or(_error, check_bytes(input));
+            _previous_incomplete = is_incomplete(input);
+        }
+        _previous = input;
+    }
+
+    bool finish()
+    {
+        return Simd::is_zero(Simd::bit_or(_error, _previous_incomplete));
+    }
+
+private:
+    vector check_bytes(vector input)
+    {
+        auto prev1 = Simd::template prev<1>(input, _previous);
+        auto byte_1_high = Simd::lookup(Simd::table(byte_1_high_table), Simd::high_nibbles(prev1));
+        auto byte_1_low = Simd::lookup(Simd::table(byte_1_low_table), Simd::low_nibbles(prev1));
+        auto byte_2_high = Simd::lookup(Simd::table(byte_2_high_table), Simd::high_nibbles(input));
+        auto special_cases = Simd::bit_and(Simd::bit_and(byte_1_high, byte_1_low), byte_2_high);
+
+        // Bytes two and three after a three- or four-byte lead must be continuations,
+        // which is where special_cases reports two_continuations.
+        auto is_third_byte = Simd::saturating_sub(Simd::template prev<2>(input, _previous), Simd::splat(0xe0 - 0x80));
+        auto is_fourth_byte = Simd::saturating_sub(Simd::template prev<3>(input, _previous), Simd::splat(0xf0 - 0x80));
+        auto must_be_continuation = Simd::bit_and(Simd::bit_or(is_third_byte, is_fourth_byte), Simd::splat(0x80));
+
+        return Simd::bit_xor(must_be_continuation, special_cases);
+    }
+
+    // Non-zero when the block ends inside a multi-byte sequence.
+    static vector is_incomplete(vector input)
+    {
+        static constexpr auto max_values = [] {
+            std::array<uint8_t, Simd::size> values{};
+            values.fill(0xff);
+            values[Simd::size - 3] = 0xf0 - 1;
+            values[Simd::size - 2] = 0xe0 - 1;
+            values[Simd::size - 1] = 0xc0 - 1;
+            return values;
+        }();
+
+        return Simd::saturating_sub(input, Simd::load(max_values.data()));
+    }
+
+    vector _error = Simd::zero();
+    vector _previous = Simd::zero();
+    vector _previous_incomplete = Simd::zero();
+};
+
+template<class Simd>
+inline bool is_valid_simd(const uint8_t *data, size_t size)
+{
+    validator<Simd> state;
+    size_t i = 0;
+    for (; i + Simd::size <= size; i += Simd::size)
+    {
+        state.check(Simd::load(data + i));
+    }
+
+    // The tail is padded with ASCII zeros.
+    if (i < size)
+    {
+        uint8_t tail[Simd::size] = {};
+        std::memcpy(tail, data + i, size - i);
+        state.check(Simd::load(tail));
+    }
+
+    return state.finish();
+}
+
+#endif
+
+} // namespace detail
+
+// Whether value is well-formed UTF-8: no overlong forms, surrogates or code points
+// above U+10FFFF. Uses AVX2 or SSSE3 (and so any SSE4 target) when enabled at
+// compile time; blocks of ASCII cost one load and one test.
+inline bool is_valid(std::string_view value)
+{
+    auto data = reinterpret_cast<const uint8_t *>(value.data());
+#if defined(__AVX2__)
+    return detail::is_valid_simd<detail::avx2>(data, value.size());
+#elif defined(__SSSE3__)
+    return detail::is_valid_simd<detail::ssse3>(data, value.size());
+#else
+    return detail::is_valid_scalar(data, value.size());
+#endif
+}
+
+} // namespace utf8
+
+// proto3 string fields decoded by a generator run with "utf8=strict": like
+// length_delimited, but payloads that are not valid UTF-8 fail the decode.
+template<>
+struct type_traits<utf8_string> : type_traits<length_delimited>
+{
+    static bool deserialize(std::string_view &data, std::string_view &value)
+    {
+        return type_traits<length_delimited>::deserialize(data, value) && utf8::is_valid(value);
+    }
+
+    template<class String, typename = std::enable_if_t<!std::is_same_v<String, std::string_view>>>
+    static bool deserialize(std::string_view &data, String &value)
+    {
+        std::string_view source_value;
+        if (deserialize(data, source_value))
+        {
+            value.assign(source_value.data(), source_value.size());
+
+            return true;
+        }
+
+        return false;
+    }
+};
+
+} // namespace protoflat
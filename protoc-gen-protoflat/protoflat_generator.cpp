@@ -3,7 +3,81 @@
 #include <protoflat.h>
 
 #include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
 #include <google/protobuf/io/printer.h>
+#include <google/protobuf/unknown_field_set.h>
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <optional>
+#include <sstream>
+
+struct GeneratorOptions
+{
+    // Emit protoflat::columns<T> struct-of-arrays batches and their decoders.
+    bool columns = false;
+    // Describe messages with constant field tables run by the shared interpreter in
+    // protoflat.h instead of unrolled per-field code ("codec=table").
+    bool table_codec = false;
+    // Inline capacity of repeated fields ("small_vector=N") and of string and bytes
+    // fields ("small_string=N"); 0 keeps std::vector and std::string. A field can
+    // override it with the (protoflat.inline_capacity) option.
+    size_t small_vector_capacity = 0;
+    size_t small_string_capacity = 0;
+    // Order members by alignment and track presence of submessages and proto3
+    // optional fields in a packed has-bits word instead of std::optional
+    // ("layout=compact"). "layout=declaration", the default, keeps the members in
+    // declaration order with std::optional presence.
+    bool compact_layout = false;
+    // Emit proto3 JSON mapping to_json/from_json and enum name tables ("json").
+    bool json = false;
+    // Fail decoding of proto3 string fields that are not valid UTF-8 ("utf8=strict");
+    // "utf8=lenient", the default, accepts any bytes like bytes fields.
+    bool strict_utf8 = false;
+    // Declare type_traits members in the header and define them in the source file,
+    // split into "shards=N" files, except for "hot=package.Message" messages which
+    // stay inline ("out_of_line").
+    bool out_of_line = false;
+    size_t shards = 1;
+    std::vector<std::string> hot_messages;
+    // Field occurrence counts by message full name and field number, read from the
+    // file field_stats::dump writes ("profile=path"). Decoders test the hottest
+    // fields first and members are declared in descending order of counts.
+    std::map<std::string, std::map<int, uint64_t>> field_counts;
+    // Full names of singular submessage fields stored as protoflat::shared<T>, in
+    // addition to those marked with (protoflat.shared) ("shared=package.Message.field").
+    std::vector<std::string> shared_fields;
+};
+
+// Where a type_traits member function is defined.
+enum class Definition
+{
+    in_class,
+    // Declared in the class, defined out of line in the source file.
+    declaration,
+    out_of_line
+};
+
+// Field numbers of the options in protoflat_options.proto. The plugin is not linked
+// against that file, so they arrive as unknown fields.
+constexpr int inline_capacity_option_number = 50201;
+constexpr int boxed_option_number = 50202;
+constexpr int shared_option_number = 50203;
+
+// Upper bounds of "small_vector=", "small_string=" and "shards=".
+constexpr size_t max_inline_capacity = 4096;
+constexpr size_t max_shards = 1024;
+
+// Parses a decimal count no greater than max_count.
+bool parse_count(const std::string &value, size_t max_count, size_t &count)
+{
+    auto end = value.data() + value.size();
+    auto [last, error] = std::from_chars(value.data(), end, count);
+    return error == std::errc() && last == end && count <= max_count;
+}
 
 std::string substitute(const std::string &text, std::string_view search, std::string_view replace)
 {
@@ -141,266 +215,1668 @@ std::string protoflat_file_name(const google::protobuf::FileDescriptor *file)
     return substitute(file->name(), ".proto", ".protoflat");
 }
 
-void generate_field(const google::protobuf::FieldDescriptor *field_type, Printer &printer)
+std::optional<uint64_t> field_option(const google::protobuf::FieldDescriptor *field_type, int option_number)
 {
-    if (field_type->is_repeated())
+    auto &field_options = field_type->options();
+    auto &unknown_fields = field_options.GetReflection()->GetUnknownFields(field_options);
+    for (int i = 0; i < unknown_fields.field_count(); ++i)
     {
-        printer.Print("std::vector<");
+        auto &unknown_field = unknown_fields.field(i);
+        if (unknown_field.number() == option_number && unknown_field.type() == google::protobuf::UnknownField::TYPE_VARINT)
+        {
+            return unknown_field.varint();
+        }
     }
-    else if (field_type->type() == google::protobuf::FieldDescriptor::TYPE_MESSAGE)
+
+    return std::nullopt;
+}
+
+uint64_t protoflat_vector_capacity(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options)
+{
+    if (!field_type->is_repeated())
     {
-        printer.Print("std::optional<");
+        return 0;
     }
 
-    printer.Print(protoflat_field_type(field_type));
+    return field_option(field_type, inline_capacity_option_number).value_or(options.small_vector_capacity);
+}
+
+uint64_t protoflat_string_capacity(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options)
+{
+    if (field_type->cpp_type() != google::protobuf::FieldDescriptor::CPPTYPE_STRING)
+    {
+        return 0;
+    }
 
-    if (field_type->is_repeated() || field_type->type() == google::protobuf::FieldDescriptor::TYPE_MESSAGE)
+    // On repeated fields the option sizes the vector; elements use the file default.
+    if (!field_type->is_repeated())
     {
-        printer.Print(">");
+        return field_option(field_type, inline_capacity_option_number).value_or(options.small_string_capacity);
     }
 
-    printer.Println(" " + field_type->name() + ";");
+    return options.small_string_capacity;
 }
 
-void generate_oneof(const google::protobuf::OneofDescriptor *oneof_type, Printer &printer)
+bool is_message_field(const google::protobuf::FieldDescriptor *field_type)
 {
-    printer.Println("std::optional<std::variant<");
-    printer.Indent();
-    for (int i = 0; i < oneof_type->field_count(); ++i)
+    return field_type->type() == google::protobuf::FieldDescriptor::TYPE_MESSAGE;
+}
+
+// proto3 `optional` fields are wrapped in a synthetic single-field oneof.
+bool is_proto3_optional_field(const google::protobuf::FieldDescriptor *field_type)
+{
+    return field_type->containing_oneof() != nullptr && field_type->real_containing_oneof() == nullptr;
+}
+
+enum class FieldPresence
+{
+    // Presence is not tracked, the field is absent when it has its default value.
+    none,
+    // std::optional<T> member.
+    optional,
+    // protoflat::boxed<T> member, selected with (protoflat.boxed).
+    boxed,
+    // protoflat::shared<T> member, selected with (protoflat.shared) or "shared=".
+    shared,
+    // Plain member plus a bit of the message's _has_bits ("layout=compact").
+    has_bit
+};
+
+FieldPresence field_presence(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options)
+{
+    if (field_type->is_repeated() || (!is_message_field(field_type) && !is_proto3_optional_field(field_type)))
     {
-        printer.Print(protoflat_field_type(oneof_type->field(i)));
-        if (i + 1 < oneof_type->field_count())
-        {
-            printer.Println(",");
-        }
-        else
-        {
-            printer.Println();
-        }
+        return FieldPresence::none;
     }
-    printer.Outdent();
-    printer.Println(">> " + oneof_type->name() + ";");
+    if (is_message_field(field_type) && field_option(field_type, boxed_option_number).value_or(0) != 0)
+    {
+        return FieldPresence::boxed;
+    }
+    auto &shared_fields = options.shared_fields;
+    if (is_message_field(field_type) && (field_option(field_type, shared_option_number).value_or(0) != 0 || std::find(shared_fields.begin(), shared_fields.end(), field_type->full_name()) != shared_fields.end()))
+    {
+        return FieldPresence::shared;
+    }
+
+    return options.compact_layout ? FieldPresence::has_bit : FieldPresence::optional;
 }
 
-void generate_message(const google::protobuf::Descriptor *message_type, Printer &printer)
+// Field access used by all generated code, so that it does not depend on how a
+// field stores its presence. object is the expression naming the message.
+std::string field_is_set(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, const std::string &object)
 {
-    printer.Println("struct " + message_type->name());
-    printer.Println("{");
-    printer.Indent();
+    if (field_presence(field_type, options) == FieldPresence::has_bit)
+    {
+        return object + ".has_" + field_type->name() + "()";
+    }
 
-    for (int i = 0; i < message_type->enum_type_count(); ++i)
+    return object + "." + field_type->name();
+}
+
+std::string field_value(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, const std::string &object)
+{
+    auto presence = field_presence(field_type, options);
+    if (presence == FieldPresence::optional || presence == FieldPresence::boxed || presence == FieldPresence::shared)
     {
-        generate_enum(message_type->enum_type(i), printer);
+        return "*" + object + "." + field_type->name();
     }
 
-    for (int i = 0; i < message_type->nested_type_count(); ++i)
+    return object + "." + field_type->name();
+}
+
+// Marks the field as present and names its value. Shared submessages are named as a
+// whole: a reference into them would stop their node from being shared.
+std::string field_mutable_value(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, const std::string &object)
+{
+    switch (field_presence(field_type, options))
     {
-        generate_message(message_type->nested_type(i), printer);
+    case FieldPresence::optional:
+    case FieldPresence::boxed:
+        return "mutable_value(" + object + "." + field_type->name() + ")";
+    case FieldPresence::has_bit:
+        return object + ".mutable_" + field_type->name() + "()";
+    default:
+        return object + "." + field_type->name();
     }
+}
 
-    for (int i = 0; i < message_type->field_count(); ++i)
+std::string field_clear(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, const std::string &object)
+{
+    switch (field_presence(field_type, options))
     {
-        if (message_type->field(i)->containing_oneof() == nullptr)
-        {
-            generate_field(message_type->field(i), printer);
-        }
+    case FieldPresence::optional:
+    case FieldPresence::boxed:
+    case FieldPresence::shared:
+        return object + "." + field_type->name() + ".reset();";
+    case FieldPresence::has_bit:
+        return object + ".clear_" + field_type->name() + "();";
+    default:
+        return object + "." + field_type->name() + " = {};";
     }
+}
 
-    for (int i = 0; i < message_type->oneof_decl_count(); ++i)
+int has_bit_index(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options)
+{
+    auto message_type = field_type->containing_type();
+    int index = 0;
+    for (int i = 0; i < field_type->index(); ++i)
     {
-        generate_oneof(message_type->oneof_decl(i), printer);
+        index += field_presence(message_type->field(i), options) == FieldPresence::has_bit;
     }
 
-    printer.Outdent();
-    printer.Println("};");
-    printer.Println();
+    return index;
 }
 
-void generate_type_traits_field_header(const google::protobuf::FieldDescriptor *field_type, Printer &printer)
+int has_bit_count(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options)
 {
-    printer.Println("inline static constexpr field_header " + field_type->name() + "_header{" + std::to_string(field_type->number()) + ", wire_type::" + std::string(protoflat::wire_type_string(protoflat_wire_type(field_type, true))) + "};");
+    int count = 0;
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        count += field_presence(message_type->field(i), options) == FieldPresence::has_bit;
+    }
+
+    return count;
 }
 
-void generate_type_traits_field_size(const google::protobuf::FieldDescriptor *field_type, Printer &printer)
+std::string protoflat_element_type(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options)
 {
-    if (field_type->is_packed() || field_type->is_repeated() || field_type->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_STRING)
+    auto capacity = protoflat_string_capacity(field_type, options);
+    if (capacity > 0)
     {
-        printer.Println("if (!value." + field_type->name() + ".empty())");
+        return "protoflat::small_string<" + std::to_string(capacity) + ">";
     }
-    else if (field_type->type() == google::protobuf::FieldDescriptor::TYPE_ENUM)
+
+    return protoflat_field_type(field_type);
+}
+
+std::string protoflat_field_storage_type(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options)
+{
+    auto element_type = protoflat_element_type(field_type, options);
+    if (field_type->is_repeated())
     {
-        printer.Println("if (value." + field_type->name() + " == " + encode_full_name(field_type->enum_type()->full_name()) + "(0))");
+        auto capacity = protoflat_vector_capacity(field_type, options);
+        if (capacity > 0)
+        {
+            return "protoflat::small_vector<" + element_type + ", " + std::to_string(capacity) + ">";
+        }
+
+        return "std::vector<" + element_type + ">";
     }
-    else
+
+    switch (field_presence(field_type, options))
     {
-        printer.Println("if (value." + field_type->name() + ")");
+    case FieldPresence::optional:
+        return "std::optional<" + element_type + ">";
+    case FieldPresence::boxed:
+        return "protoflat::boxed<" + element_type + ">";
+    case FieldPresence::shared:
+        return "protoflat::shared<" + element_type + ">";
+    default:
+        return element_type;
     }
-    printer.Println("{");
-    printer.Indent();
+}
 
-    auto wire_type = protoflat_wire_type(field_type, false);
-    auto field_name = "value." + field_type->name();
-    if (wire_type == protoflat::wire_type::length_delimited && field_type->is_repeated())
+bool any_field(const google::protobuf::Descriptor *message_type, const std::function<bool(const google::protobuf::FieldDescriptor *)> &predicate)
+{
+    for (int i = 0; i < message_type->field_count(); ++i)
     {
-        printer.Println("for (auto &field : value." + field_type->name() + ")");
-        printer.Println("{");
-        printer.Indent();
-
-        field_name = "field";
+        if (predicate(message_type->field(i)))
+        {
+            return true;
+        }
     }
-    else if (field_type->type() == google::protobuf::FieldDescriptor::TYPE_MESSAGE)
+
+    for (int i = 0; i < message_type->nested_type_count(); ++i)
     {
-        field_name = "*" + field_name;
+        if (any_field(message_type->nested_type(i), predicate))
+        {
+            return true;
+        }
     }
 
-    std::string specialization_type(protoflat::protoflat_specialization_type(wire_type, field_type->is_packed()));
-    if (field_type->type() == google::protobuf::FieldDescriptor::TYPE_MESSAGE)
+    return false;
+}
+
+bool any_field(const google::protobuf::FileDescriptor *file, const std::function<bool(const google::protobuf::FieldDescriptor *)> &predicate)
+{
+    for (int i = 0; i < file->message_type_count(); ++i)
     {
-        specialization_type = encode_full_name(field_type->message_type()->full_name());
+        if (any_field(file->message_type(i), predicate))
+        {
+            return true;
+        }
     }
-    printer.Println("size += type_traits<varint>::size(field_header::encode(" + field_type->name() + "_header));");
-    printer.Println("size += type_traits<" + specialization_type + ">::size(" + field_name + ");");
 
-    if (wire_type == protoflat::wire_type::length_delimited && field_type->is_repeated())
+    return false;
+}
+
+size_t message_alignment(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, int depth);
+
+// Approximate alignment of a member on common 64-bit targets, used to order members
+// in the compact layout.
+size_t field_alignment(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, int depth = 0)
+{
+    using namespace google::protobuf;
+    auto presence = field_presence(field_type, options);
+    if (field_type->is_repeated() || field_type->cpp_type() == FieldDescriptor::CPPTYPE_STRING || presence == FieldPresence::boxed || presence == FieldPresence::shared)
     {
-        printer.Outdent();
-        printer.Println("}");
+        return alignof(void *);
     }
 
-    printer.Outdent();
-    printer.Println("}");
-    printer.Println();
+    switch (field_type->cpp_type())
+    {
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+        return message_alignment(field_type->message_type(), options, depth + 1);
+    case FieldDescriptor::CPPTYPE_INT64:
+    case FieldDescriptor::CPPTYPE_UINT64:
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+        return 8;
+    case FieldDescriptor::CPPTYPE_BOOL:
+        return 1;
+    default:
+        return 4;
+    }
 }
 
-void generate_type_traits_field_serialize(const google::protobuf::FieldDescriptor *field_type, Printer &printer)
+size_t message_alignment(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, int depth)
 {
-    if (field_type->is_packed() || field_type->is_repeated() || field_type->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_STRING)
+    // Inline recursion cannot compile anyway, such fields have to be boxed.
+    if (depth > 32 || message_type->real_oneof_decl_count() > 0)
     {
-        printer.Println("if (!value." + field_type->name() + ".empty())");
+        return alignof(void *);
     }
-    else if (field_type->type() == google::protobuf::FieldDescriptor::TYPE_ENUM)
+
+    size_t alignment = has_bit_count(message_type, options) > 0 ? 4 : 1;
+    for (int i = 0; i < message_type->field_count(); ++i)
     {
-        printer.Println("if (value." + field_type->name() + " == " + encode_full_name(field_type->enum_type()->full_name()) + "(0))");
+        alignment = std::max(alignment, field_alignment(message_type->field(i), options, depth));
     }
-    else
+
+    return alignment;
+}
+
+uint64_t field_profile_count(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options)
+{
+    auto message_counts = options.field_counts.find(field_type->containing_type()->full_name());
+    if (message_counts == options.field_counts.end())
     {
-        printer.Println("if (value." + field_type->name() + ")");
+        return 0;
     }
-    printer.Println("{");
-    printer.Indent();
 
-    auto field_name = "value." + field_type->name();
-    auto wire_type = protoflat_wire_type(field_type, false);
-    if (wire_type == protoflat::wire_type::length_delimited && field_type->is_repeated())
+    auto count = message_counts->second.find(field_type->number());
+    return count != message_counts->second.end() ? count->second : 0;
+}
+
+// Fields in descending order of profile counts, declaration order without a profile.
+std::vector<const google::protobuf::FieldDescriptor *> fields_by_hotness(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options)
+{
+    std::vector<const google::protobuf::FieldDescriptor *> fields;
+    for (int i = 0; i < message_type->field_count(); ++i)
     {
-        printer.Println("for (auto &field : value." + field_type->name() + ")");
-        printer.Println("{");
-        printer.Indent();
+        fields.push_back(message_type->field(i));
+    }
+    std::stable_sort(fields.begin(), fields.end(), [&](auto a, auto b) { return field_profile_count(a, options) > field_profile_count(b, options); });
 
-        field_name = "field";
+    return fields;
+}
+
+// How many of the hottest fields get a test before the switch: at most four, each
+// with at least an eighth of the message's occurrences. Rarer fields would only add
+// a mispredicted compare in front of the jump table.
+size_t fast_path_field_count(const std::vector<const google::protobuf::FieldDescriptor *> &fields, const GeneratorOptions &options)
+{
+    uint64_t total = 0;
+    for (auto field_type : fields)
+    {
+        total += field_profile_count(field_type, options);
     }
-    else if (field_type->type() == google::protobuf::FieldDescriptor::TYPE_MESSAGE)
+
+    size_t count = 0;
+    while (count < std::min<size_t>(fields.size(), 4) && field_profile_count(fields[count], options) > 0 && field_profile_count(fields[count], options) >= total / 8)
     {
-        field_name = "*" + field_name;
+        ++count;
     }
 
-    std::string specialization_type(protoflat::protoflat_specialization_type(wire_type, field_type->is_packed()));
-    if (field_type->type() == google::protobuf::FieldDescriptor::TYPE_MESSAGE)
+    return count;
+}
+
+// Reads the lines "<message full name> <field number> <count>" of a profile.
+bool read_field_counts(const std::string &path, std::map<std::string, std::map<int, uint64_t>> &field_counts, std::string *error)
+{
+    std::ifstream stream(path);
+    if (!stream)
     {
-        specialization_type = encode_full_name(field_type->message_type()->full_name());
+        *error = "Cannot open profile: " + path;
+        return false;
     }
-    printer.Println("type_traits<varint>::serialize(field_header::encode(" + field_type->name() + "_header), data);");
-    printer.Println("type_traits<" + specialization_type + ">::serialize(" + field_name + ", data);");
 
-    if (wire_type == protoflat::wire_type::length_delimited && field_type->is_repeated())
+    std::string line;
+    while (std::getline(stream, line))
     {
-        printer.Outdent();
-        printer.Println("}");
+        std::istringstream line_stream(line);
+        std::string message_name;
+        int number = 0;
+        uint64_t count = 0;
+        if (!(line_stream >> message_name))
+        {
+            continue;
+        }
+        if (!(line_stream >> number >> count))
+        {
+            *error = "Malformed profile line: " + line;
+            return false;
+        }
+        field_counts[message_name][number] += count;
     }
 
-    printer.Outdent();
-    printer.Println("}");
+    return true;
+}
+
+void generate_field(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, Printer &printer)
+{
+    printer.Println(protoflat_field_storage_type(field_type, options) + " " + field_type->name() + ";");
 }
 
-void generate_message_type_traits_size(const google::protobuf::Descriptor *message_type, Printer &printer)
+// Absent fields always hold their default value, so the defaulted operator== holds.
+void generate_has_bit_accessors(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, Printer &printer)
 {
-    printer.Println("static size_t size(const " + ::encode_full_name(message_type->full_name()) + " &value)");
+    auto name = field_type->name();
+    auto index = has_bit_index(field_type, options);
+    auto word = "_has_bits[" + std::to_string(index / 32) + "]";
+    auto mask = "(1u << " + std::to_string(index % 32) + ")";
+
+    printer.Println();
+    printer.Println("bool has_" + name + "() const");
     printer.Println("{");
     printer.Indent();
-    printer.Println("size_t size = 0;");
+    printer.Println("return (" + word + " & " + mask + ") != 0;");
+    printer.Outdent();
+    printer.Println("}");
     printer.Println();
 
-    for (int i = 0; i < message_type->field_count(); ++i)
-    {
-        generate_type_traits_field_size(message_type->field(i), printer);
-    }
+    printer.Println(protoflat_field_storage_type(field_type, options) + " &mutable_" + name + "()");
+    printer.Println("{");
+    printer.Indent();
+    printer.Println(word + " |= " + mask + ";");
+    printer.Println("return " + name + ";");
+    printer.Outdent();
+    printer.Println("}");
+    printer.Println();
 
-    printer.Println("return size;");
+    printer.Println("void clear_" + name + "()");
+    printer.Println("{");
+    printer.Indent();
+    printer.Println(word + " &= ~" + mask + ";");
+    printer.Println(name + " = {};");
     printer.Outdent();
     printer.Println("}");
 }
 
-void generate_message_type_traits_serialize(const google::protobuf::Descriptor *message_type, Printer &printer)
+void generate_oneof(const google::protobuf::OneofDescriptor *oneof_type, Printer &printer)
 {
-    printer.Println("static void serialize(const " + encode_full_name(message_type->full_name()) + " &value, std::string &data)");
-    printer.Println("{");
+    printer.Println("std::optional<std::variant<");
     printer.Indent();
-
-    for (int i = 0; i < message_type->field_count(); ++i)
+    for (int i = 0; i < oneof_type->field_count(); ++i)
     {
-        generate_type_traits_field_serialize(message_type->field(i), printer);
+        printer.Print(protoflat_field_type(oneof_type->field(i)));
+        if (i + 1 < oneof_type->field_count())
+        {
+            printer.Println(",");
+        }
+        else
+        {
+            printer.Println();
+        }
     }
-
     printer.Outdent();
-    printer.Println("}");
+    printer.Println(">> " + oneof_type->name() + ";");
 }
 
-void generate_message_type_traits(const google::protobuf::Descriptor *message_type, Printer &printer)
+void generate_message(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Printer &printer)
 {
-    for (int i = 0; i < message_type->nested_type_count(); ++i)
+    printer.Println("struct " + message_type->name());
+    printer.Println("{");
+    printer.Indent();
+
+    for (int i = 0; i < message_type->enum_type_count(); ++i)
     {
-        generate_message_type_traits(message_type->nested_type(i), printer);
+        generate_enum(message_type->enum_type(i), printer);
     }
 
-    printer.Println("template<>");
-    printer.Println("struct type_traits<" + encode_full_name(message_type->full_name()) + ">");
-    printer.Println("{");
-    printer.Indent();
+    for (int i = 0; i < message_type->nested_type_count(); ++i)
+    {
+        generate_message(message_type->nested_type(i), options, printer);
+    }
 
+    std::vector<const google::protobuf::FieldDescriptor *> fields;
     for (int i = 0; i < message_type->field_count(); ++i)
     {
-        generate_type_traits_field_header(message_type->field(i), printer);
+        if (message_type->field(i)->real_containing_oneof() == nullptr)
+        {
+            fields.push_back(message_type->field(i));
+        }
+    }
+    // Hot members first share cache lines; the compact layout keeps that order
+    // within each alignment.
+    std::stable_sort(fields.begin(), fields.end(), [&](auto a, auto b) { return field_profile_count(a, options) > field_profile_count(b, options); });
+    if (options.compact_layout)
+    {
+        // Largest alignment first leaves no padding between members.
+        std::stable_sort(fields.begin(), fields.end(), [&](auto a, auto b) { return field_alignment(a, options) > field_alignment(b, options); });
     }
 
-    printer.Println();
-    generate_message_type_traits_size(message_type, printer);
+    auto has_bit_words = (has_bit_count(message_type, options) + 31) / 32;
+    for (auto field_type : fields)
+    {
+        if (has_bit_words > 0 && field_alignment(field_type, options) < 4)
+        {
+            printer.Println("uint32_t _has_bits[" + std::to_string(has_bit_words) + "] = {};");
+            has_bit_words = 0;
+        }
+        generate_field(field_type, options, printer);
+    }
+    if (has_bit_words > 0)
+    {
+        printer.Println("uint32_t _has_bits[" + std::to_string(has_bit_words) + "] = {};");
+    }
+
+    for (int i = 0; i < message_type->real_oneof_decl_count(); ++i)
+    {
+        generate_oneof(message_type->oneof_decl(i), printer);
+    }
+
+    for (auto field_type : fields)
+    {
+        if (field_presence(field_type, options) == FieldPresence::has_bit)
+        {
+            generate_has_bit_accessors(field_type, options, printer);
+        }
+    }
 
     printer.Println();
-    generate_message_type_traits_serialize(message_type, printer);
+    printer.Println("bool operator==(const " + message_type->name() + " &) const = default;");
 
     printer.Outdent();
     printer.Println("};");
     printer.Println();
 }
 
-void generate_header(const google::protobuf::FileDescriptor *file, Printer &printer)
+bool is_element_wise_field(const google::protobuf::FieldDescriptor *field_type)
 {
-    printer.Println("#pragma once");
-    printer.Println();
+    return field_type->is_repeated() && !field_type->is_packed();
+}
 
-    for (int i = 0; i < file->dependency_count(); ++i)
+std::string protoflat_field_specialization_type(const google::protobuf::FieldDescriptor *field_type, bool is_packed)
+{
+    if (is_message_field(field_type))
     {
-        printer.Println("#include \"" + protoflat_file_name(file->dependency(i)) + ".h\"");
+        return "embedded_message<" + encode_full_name(field_type->message_type()->full_name()) + ">";
     }
-    if (file->dependency_count() > 0)
+    if (field_type->type() == google::protobuf::FieldDescriptor::TYPE_SINT32 || field_type->type() == google::protobuf::FieldDescriptor::TYPE_SINT64)
     {
-        printer.Println();
+        return is_packed ? "packed_zigzag_varint" : "zigzag_varint";
     }
 
-    printer.Println("#include <protoflat.h>");
+    return std::string(protoflat::protoflat_specialization_type(protoflat_wire_type(field_type, false), is_packed));
+}
+
+// Specialization a field is decoded with; differs from the encoding one only for
+// validated strings.
+std::string protoflat_field_decode_type(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options)
+{
+    if (options.strict_utf8 && field_type->type() == google::protobuf::FieldDescriptor::TYPE_STRING && field_type->file()->syntax() == google::protobuf::FileDescriptor::SYNTAX_PROTO3)
+    {
+        return "utf8_string";
+    }
+
+    return protoflat_field_specialization_type(field_type, false);
+}
+
+std::string protoflat_field_condition(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options)
+{
+    if (field_presence(field_type, options) != FieldPresence::none)
+    {
+        return field_is_set(field_type, options, "value");
+    }
+    else if (field_type->is_repeated() || field_type->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_STRING)
+    {
+        return "!value." + field_type->name() + ".empty()";
+    }
+    else if (field_type->type() == google::protobuf::FieldDescriptor::TYPE_ENUM)
+    {
+        return "value." + field_type->name() + " != " + encode_full_name(field_type->enum_type()->full_name()) + "(0)";
+    }
+
+    return "value." + field_type->name();
+}
+
+void generate_type_traits_field_header(const google::protobuf::FieldDescriptor *field_type, Printer &printer)
+{
+    printer.Println("inline static constexpr field_header " + field_type->name() + "_header{" + std::to_string(field_type->number()) + ", wire_type::" + std::string(protoflat::wire_type_string(protoflat_wire_type(field_type, true))) + "};");
+}
+
+// Specialization and argument a present field is written with. Shared submessages
+// are passed as a whole to reuse their cached encoding; they are decoded the same way.
+std::string protoflat_field_write_type(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options)
+{
+    if (field_presence(field_type, options) == FieldPresence::shared)
+    {
+        return "embedded_message<protoflat::shared<" + encode_full_name(field_type->message_type()->full_name()) + ">>";
+    }
+
+    return protoflat_field_specialization_type(field_type, field_type->is_packed());
+}
+
+std::string field_write_value(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, const std::string &object)
+{
+    if (field_presence(field_type, options) == FieldPresence::shared)
+    {
+        return object + "." + field_type->name();
+    }
+
+    return field_value(field_type, options, object);
+}
+
+void generate_type_traits_field_size_statements(const google::protobuf::FieldDescriptor *field_type, const std::string &field_name, const GeneratorOptions &options, Printer &printer)
+{
+    auto size = "type_traits<" + protoflat_field_write_type(field_type, options) + ">::size(" + field_name + ")";
+    if (protoflat_wire_type(field_type, true) == protoflat::wire_type::length_delimited)
+    {
+        size = "length_prefixed_size(" + size + ")";
+    }
+
+    printer.Println("size += type_traits<varint>::size(field_header::encode(" + field_type->name() + "_header));");
+    printer.Println("size += " + size + ";");
+}
+
+void generate_type_traits_field_serialize_statements(const google::protobuf::FieldDescriptor *field_type, const std::string &field_name, const GeneratorOptions &options, Printer &printer)
+{
+    printer.Println("type_traits<varint>::serialize(field_header::encode(" + field_type->name() + "_header), data);");
+    printer.Println("type_traits<" + protoflat_field_write_type(field_type, options) + ">::serialize(" + field_name + ", data);");
+}
+
+void generate_type_traits_field_statements(const google::protobuf::FieldDescriptor *field_type, const std::string &field_name, const GeneratorOptions &options, bool is_size, Printer &printer)
+{
+    if (is_size)
+    {
+        generate_type_traits_field_size_statements(field_type, field_name, options, printer);
+    }
+    else
+    {
+        generate_type_traits_field_serialize_statements(field_type, field_name, options, printer);
+    }
+}
+
+void generate_type_traits_field_write(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, bool is_size, Printer &printer)
+{
+    printer.Println("if (" + protoflat_field_condition(field_type, options) + ")");
+    printer.Println("{");
+    printer.Indent();
+
+    auto field_name = field_write_value(field_type, options, "value");
+    if (is_element_wise_field(field_type))
+    {
+        printer.Println("for (const auto &field : value." + field_type->name() + ")");
+        printer.Println("{");
+        printer.Indent();
+
+        field_name = "field";
+    }
+
+    generate_type_traits_field_statements(field_type, field_name, options, is_size, printer);
+
+    if (is_element_wise_field(field_type))
+    {
+        printer.Outdent();
+        printer.Println("}");
+    }
+
+    printer.Outdent();
+    printer.Println("}");
+}
+
+void generate_type_traits_field_size(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, Printer &printer)
+{
+    generate_type_traits_field_write(field_type, options, true, printer);
+    printer.Println();
+}
+
+void generate_type_traits_field_serialize(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, Printer &printer)
+{
+    generate_type_traits_field_write(field_type, options, false, printer);
+}
+
+void generate_type_traits_field_deserialize_call(const std::string &specialization_type, const std::string &field_name, Printer &printer)
+{
+    printer.Println("if (!type_traits<" + specialization_type + ">::deserialize(data, " + field_name + "))");
+    printer.Println("{");
+    printer.Indent();
+    printer.Println("return false;");
+    printer.Outdent();
+    printer.Println("}");
+}
+
+void generate_type_traits_field_deserialize_message_call(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, const std::string &arguments, Printer &printer)
+{
+    printer.Println("if (!type_traits<" + protoflat_field_write_type(field_type, options) + ">::deserialize<mode>(data, " + arguments + "))");
+    printer.Println("{");
+    printer.Indent();
+    printer.Println("return false;");
+    printer.Outdent();
+    printer.Println("}");
+}
+
+void generate_type_traits_field_deserialize(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, Printer &printer)
+{
+    auto name = field_type->name();
+    auto wire_type = protoflat_wire_type(field_type, false);
+    if (field_type->is_repeated() && wire_type != protoflat::wire_type::length_delimited)
+    {
+        // Parsers must accept both packed and element-wise encodings of repeated scalars.
+        printer.Println("if (header.field_type == wire_type::length_delimited)");
+        printer.Println("{");
+        printer.Indent();
+        generate_type_traits_field_deserialize_call(protoflat_field_specialization_type(field_type, true), "value." + name, printer);
+        printer.Println("continue;");
+        printer.Outdent();
+        printer.Println("}");
+
+        printer.Println("if (header.field_type == wire_type::" + std::string(protoflat::wire_type_string(wire_type)) + ")");
+        printer.Println("{");
+        printer.Indent();
+        printer.Println(protoflat_field_type(field_type) + " field{};");
+        generate_type_traits_field_deserialize_call(protoflat_field_specialization_type(field_type, false), "field", printer);
+        printer.Println("value." + name + ".push_back(field);");
+        printer.Println("continue;");
+        printer.Outdent();
+        printer.Println("}");
+    }
+    else
+    {
+        auto field_name = field_mutable_value(field_type, options, "value");
+        if (field_type->is_repeated())
+        {
+            field_name = "next_element<mode>(value." + name + ", " + name + "_count)";
+        }
+        else if (is_message_field(field_type))
+        {
+            field_name += ", " + name + "_is_seen";
+        }
+
+        printer.Println("if (header.field_type == " + name + "_header.field_type)");
+        printer.Println("{");
+        printer.Indent();
+        if (is_message_field(field_type))
+        {
+            generate_type_traits_field_deserialize_message_call(field_type, options, field_name, printer);
+        }
+        else
+        {
+            generate_type_traits_field_deserialize_call(protoflat_field_decode_type(field_type, options), field_name, printer);
+        }
+        printer.Println("continue;");
+        printer.Outdent();
+        printer.Println("}");
+    }
+}
+
+void generate_type_traits_field_delta_compatible(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, Printer &printer)
+{
+    auto name = field_type->name();
+    auto baseline_is_set = field_is_set(field_type, options, "baseline");
+    auto value_is_set = field_is_set(field_type, options, "value");
+    if (field_type->is_repeated())
+    {
+        printer.Println("if (!starts_with(value." + name + ", baseline." + name + "))");
+    }
+    else if (is_message_field(field_type))
+    {
+        printer.Println("if (" + baseline_is_set + " && (!" + value_is_set + " || !type_traits<" + encode_full_name(field_type->message_type()->full_name()) + ">::delta_compatible(" + field_value(field_type, options, "baseline") + ", " + field_value(field_type, options, "value") + ")))");
+    }
+    else if (field_presence(field_type, options) != FieldPresence::none)
+    {
+        printer.Println("if (" + baseline_is_set + " && !" + value_is_set + ")");
+    }
+    else
+    {
+        return;
+    }
+
+    printer.Println("{");
+    printer.Indent();
+    printer.Println("return false;");
+    printer.Outdent();
+    printer.Println("}");
+}
+
+void generate_type_traits_field_delta(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, bool is_size, Printer &printer)
+{
+    auto name = field_type->name();
+    auto field_name = field_value(field_type, options, "value");
+    auto baseline_is_set = field_is_set(field_type, options, "baseline");
+    auto value_is_set = field_is_set(field_type, options, "value");
+    if (field_type->is_repeated())
+    {
+        field_name = "appended_elements(baseline." + name + ", value." + name + ")";
+        if (field_type->is_packed())
+        {
+            printer.Println("if (value." + name + ".size() > baseline." + name + ".size())");
+        }
+        else
+        {
+            printer.Println("for (const auto &field : " + field_name + ")");
+            field_name = "field";
+        }
+    }
+    else if (is_message_field(field_type))
+    {
+        printer.Println("if (" + value_is_set + " && !" + baseline_is_set + ")");
+        printer.Println("{");
+        printer.Indent();
+        generate_type_traits_field_statements(field_type, field_write_value(field_type, options, "value"), options, is_size, printer);
+        printer.Outdent();
+        printer.Println("}");
+
+        auto baseline_name = field_value(field_type, options, "baseline");
+        printer.Println("else if (" + value_is_set + " && " + field_name + " != " + baseline_name + ")");
+        printer.Println("{");
+        printer.Indent();
+        auto specialization_type = protoflat_field_specialization_type(field_type, false);
+        auto arguments = baseline_name + ", " + field_name;
+        if (is_size)
+        {
+            printer.Println("size += type_traits<varint>::size(field_header::encode(" + name + "_header));");
+            printer.Println("size += length_prefixed_size(type_traits<" + specialization_type + ">::delta_size(" + arguments + "));");
+        }
+        else
+        {
+            printer.Println("type_traits<varint>::serialize(field_header::encode(" + name + "_header), data);");
+            printer.Println("type_traits<" + specialization_type + ">::serialize_delta(" + arguments + ", data);");
+        }
+        printer.Outdent();
+        printer.Println("}");
+
+        return;
+    }
+    else if (field_presence(field_type, options) != FieldPresence::none)
+    {
+        printer.Println("if (" + value_is_set + " && (!" + baseline_is_set + " || " + field_name + " != " + field_value(field_type, options, "baseline") + "))");
+    }
+    else
+    {
+        printer.Println("if (value." + name + " != baseline." + name + ")");
+    }
+
+    printer.Println("{");
+    printer.Indent();
+    generate_type_traits_field_statements(field_type, field_name, options, is_size, printer);
+    printer.Outdent();
+    printer.Println("}");
+}
+
+Definition message_definition(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options)
+{
+    auto &hot_messages = options.hot_messages;
+    if (!options.out_of_line || std::find(hot_messages.begin(), hot_messages.end(), message_type->full_name()) != hot_messages.end())
+    {
+        return Definition::in_class;
+    }
+
+    return Definition::declaration;
+}
+
+// Prints the head of a type_traits member function and returns whether its body
+// should follow. signature is the name and parameter list; is_decode_template
+// makes it a template over decode_mode.
+bool generate_member_function_head(const google::protobuf::Descriptor *message_type, const std::string &return_type, const std::string &signature, bool is_decode_template, Definition definition, Printer &printer)
+{
+    switch (definition)
+    {
+    case Definition::in_class:
+        if (is_decode_template)
+        {
+            printer.Println("template<decode_mode mode = decode_mode::merge>");
+        }
+        printer.Println("static " + return_type + " " + signature);
+        return true;
+    case Definition::declaration:
+        if (is_decode_template)
+        {
+            printer.Println("template<decode_mode mode = decode_mode::merge>");
+        }
+        printer.Println("static " + return_type + " " + signature + ";");
+        return false;
+    default:
+        if (is_decode_template)
+        {
+            printer.Println("template<decode_mode mode>");
+        }
+        printer.Println(return_type + " type_traits<" + encode_full_name(message_type->full_name()) + ">::" + signature);
+        return true;
+    }
+}
+
+void generate_message_type_traits_size(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Definition definition, Printer &printer)
+{
+    if (!generate_member_function_head(message_type, "size_t", "size(const " + encode_full_name(message_type->full_name()) + " &value)", false, definition, printer))
+    {
+        return;
+    }
+    printer.Println("{");
+    printer.Indent();
+    printer.Println("size_t size = 0;");
+    printer.Println();
+
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        generate_type_traits_field_size(message_type->field(i), options, printer);
+    }
+
+    printer.Println("return size;");
+    printer.Outdent();
+    printer.Println("}");
+}
+
+void generate_message_type_traits_serialize(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Definition definition, Printer &printer)
+{
+    if (!generate_member_function_head(message_type, "void", "serialize(const " + encode_full_name(message_type->full_name()) + " &value, std::string &data)", false, definition, printer))
+    {
+        return;
+    }
+    printer.Println("{");
+    printer.Indent();
+
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        generate_type_traits_field_serialize(message_type->field(i), options, printer);
+    }
+
+    printer.Outdent();
+    printer.Println("}");
+}
+
+bool is_reused_field(const google::protobuf::FieldDescriptor *field_type)
+{
+    return is_message_field(field_type) || (field_type->is_repeated() && protoflat_wire_type(field_type, false) == protoflat::wire_type::length_delimited);
+}
+
+void generate_type_traits_deserialize_reuse_block(const std::vector<std::string> &statements, Printer &printer)
+{
+    if (statements.empty())
+    {
+        return;
+    }
+
+    printer.Println("if constexpr (mode == decode_mode::reuse)");
+    printer.Println("{");
+    printer.Indent();
+    for (auto &statement : statements)
+    {
+        printer.Println(statement);
+    }
+    printer.Outdent();
+    printer.Println("}");
+    printer.Println();
+}
+
+void generate_type_traits_deserialize_reuse_prologue(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Printer &printer)
+{
+    std::vector<std::string> statements;
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        auto field_type = message_type->field(i);
+        if (field_type->is_repeated() && is_reused_field(field_type))
+        {
+            printer.Println("size_t " + field_type->name() + "_count = 0;");
+        }
+        else if (is_reused_field(field_type))
+        {
+            printer.Println("bool " + field_type->name() + "_is_seen = false;");
+        }
+        else if (field_presence(field_type, options) == FieldPresence::none && (field_type->is_repeated() || field_type->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_STRING))
+        {
+            statements.push_back("value." + field_type->name() + ".clear();");
+        }
+        else
+        {
+            statements.push_back(field_clear(field_type, options, "value"));
+        }
+    }
+    if (statements.size() < static_cast<size_t>(message_type->field_count()))
+    {
+        printer.Println();
+    }
+
+    generate_type_traits_deserialize_reuse_block(statements, printer);
+}
+
+void generate_type_traits_deserialize_reuse_epilogue(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Printer &printer)
+{
+    std::vector<std::string> statements;
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        auto field_type = message_type->field(i);
+        if (field_type->is_repeated() && is_reused_field(field_type))
+        {
+            statements.push_back("value." + field_type->name() + ".resize(" + field_type->name() + "_count);");
+        }
+        else if (is_reused_field(field_type))
+        {
+            statements.push_back("if (!" + field_type->name() + "_is_seen)");
+            statements.push_back("{");
+            statements.push_back("    " + field_clear(field_type, options, "value"));
+            statements.push_back("}");
+        }
+    }
+
+    generate_type_traits_deserialize_reuse_block(statements, printer);
+}
+
+// Decodes fields with a switch on the field number. generate_field_case prints the
+// checks of one field's wire types, each ending in continue. Fields the profile
+// shows to dominate are tested with an if before the switch, hottest first.
+void generate_deserialize_loop(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, const std::function<void(const google::protobuf::FieldDescriptor *)> &generate_field_case, Printer &printer)
+{
+    auto fields = fields_by_hotness(message_type, options);
+    auto fast_path_count = fast_path_field_count(fields, options);
+
+    printer.Println("#ifdef PROTOFLAT_FIELD_STATS");
+    printer.Println("static auto &field_counters = field_stats::register_message(\"" + message_type->full_name() + "\");");
+    printer.Println("#endif");
+    printer.Println("while (!data.empty())");
+    printer.Println("{");
+    printer.Indent();
+    printer.Println("uint64_t header_value = 0;");
+    printer.Println("if (!type_traits<varint>::deserialize(data, header_value))");
+    printer.Println("{");
+    printer.Indent();
+    printer.Println("return false;");
+    printer.Outdent();
+    printer.Println("}");
+    printer.Println();
+
+    printer.Println("auto header = field_header::decode(header_value);");
+    printer.Println("#ifdef PROTOFLAT_FIELD_STATS");
+    printer.Println("field_counters.record(header.field_number);");
+    printer.Println("#endif");
+    for (size_t i = 0; i < fast_path_count; ++i)
+    {
+        printer.Println("if (header.field_number == " + std::to_string(fields[i]->number()) + ")");
+        printer.Println("{");
+        printer.Indent();
+        generate_field_case(fields[i]);
+        printer.Outdent();
+        printer.Println("}");
+    }
+    printer.Println("switch (header.field_number)");
+    printer.Println("{");
+    for (size_t i = fast_path_count; i < fields.size(); ++i)
+    {
+        printer.Println("case " + std::to_string(fields[i]->number()) + ":");
+        printer.Indent();
+        generate_field_case(fields[i]);
+        printer.Println("break;");
+        printer.Outdent();
+    }
+    printer.Println("default:");
+    printer.Indent();
+    printer.Println("break;");
+    printer.Outdent();
+    printer.Println("}");
+    printer.Println();
+
+    printer.Println("if (!skip_field(data, header.field_type))");
+    printer.Println("{");
+    printer.Indent();
+    printer.Println("return false;");
+    printer.Outdent();
+    printer.Println("}");
+    printer.Outdent();
+    printer.Println("}");
+    printer.Println();
+}
+
+void generate_message_type_traits_deserialize(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Definition definition, Printer &printer)
+{
+    if (!generate_member_function_head(message_type, "bool", "deserialize(std::string_view &data, " + encode_full_name(message_type->full_name()) + " &value)", true, definition, printer))
+    {
+        return;
+    }
+    printer.Println("{");
+    printer.Indent();
+    generate_type_traits_deserialize_reuse_prologue(message_type, options, printer);
+    generate_deserialize_loop(
+        message_type, options, [&](auto field_type) { generate_type_traits_field_deserialize(field_type, options, printer); }, printer);
+    generate_type_traits_deserialize_reuse_epilogue(message_type, options, printer);
+    printer.Println("return true;");
+    printer.Outdent();
+    printer.Println("}");
+}
+
+void generate_message_type_traits_delta(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Definition definition, Printer &printer)
+{
+    auto full_name = encode_full_name(message_type->full_name());
+
+    if (generate_member_function_head(message_type, "bool", "delta_compatible(const " + full_name + " &baseline, const " + full_name + " &value)", false, definition, printer))
+    {
+        printer.Println("{");
+        printer.Indent();
+        for (int i = 0; i < message_type->field_count(); ++i)
+        {
+            generate_type_traits_field_delta_compatible(message_type->field(i), options, printer);
+        }
+        printer.Println("return true;");
+        printer.Outdent();
+        printer.Println("}");
+    }
+    printer.Println();
+
+    if (generate_member_function_head(message_type, "size_t", "delta_size(const " + full_name + " &baseline, const " + full_name + " &value)", false, definition, printer))
+    {
+        printer.Println("{");
+        printer.Indent();
+        printer.Println("size_t size = 0;");
+        printer.Println();
+        for (int i = 0; i < message_type->field_count(); ++i)
+        {
+            generate_type_traits_field_delta(message_type->field(i), options, true, printer);
+            printer.Println();
+        }
+        printer.Println("return size;");
+        printer.Outdent();
+        printer.Println("}");
+    }
+    printer.Println();
+
+    if (generate_member_function_head(message_type, "void", "serialize_delta(const " + full_name + " &baseline, const " + full_name + " &value, std::string &data)", false, definition, printer))
+    {
+        printer.Println("{");
+        printer.Indent();
+        for (int i = 0; i < message_type->field_count(); ++i)
+        {
+            generate_type_traits_field_delta(message_type->field(i), options, false, printer);
+        }
+        printer.Outdent();
+        printer.Println("}");
+    }
+}
+
+std::string protoflat_field_codec(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options)
+{
+    auto storage_type = protoflat_field_storage_type(field_type, options);
+    if (field_presence(field_type, options) == FieldPresence::shared)
+    {
+        return "codec::shared_message<" + storage_type + ">";
+    }
+    if (is_message_field(field_type))
+    {
+        return std::string(field_type->is_repeated() ? "codec::repeated_message<" : "codec::message<") + storage_type + ">";
+    }
+
+    std::string codec = "codec::singular<";
+    if (field_presence(field_type, options) == FieldPresence::optional)
+    {
+        codec = "codec::optional<";
+    }
+    else if (field_type->is_packed())
+    {
+        codec = "codec::packed<";
+    }
+    else if (field_type->is_repeated())
+    {
+        codec = "codec::repeated<";
+    }
+
+    return codec + protoflat_field_decode_type(field_type, options) + ", " + storage_type + ">";
+}
+
+void generate_message_type_traits_table_entries(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Printer &printer)
+{
+    auto full_name = encode_full_name(message_type->full_name());
+
+    std::vector<const google::protobuf::FieldDescriptor *> fields;
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        fields.push_back(message_type->field(i));
+    }
+    std::sort(fields.begin(), fields.end(), [](auto a, auto b) { return a->number() < b->number(); });
+
+    printer.Println("inline static constexpr field_entry fields[] = {");
+    printer.Indent();
+    for (auto field_type : fields)
+    {
+        printer.Println("{field_header::encode(" + field_type->name() + "_header), offsetof(" + full_name + ", " + field_type->name() + "), &codec::instance<" + protoflat_field_codec(field_type, options) + ">},");
+    }
+    printer.Outdent();
+    printer.Println("};");
+    printer.Println("inline static constexpr message_table table{fields, " + std::to_string(fields.size()) + "};");
+}
+
+void generate_message_type_traits_table(const google::protobuf::Descriptor *message_type, Definition definition, Printer &printer)
+{
+    auto full_name = encode_full_name(message_type->full_name());
+
+    if (generate_member_function_head(message_type, "size_t", "size(const " + full_name + " &value)", false, definition, printer))
+    {
+        printer.Println("{");
+        printer.Indent();
+        printer.Println("return table_size(table, &value);");
+        printer.Outdent();
+        printer.Println("}");
+    }
+    printer.Println();
+
+    if (generate_member_function_head(message_type, "void", "serialize(const " + full_name + " &value, std::string &data)", false, definition, printer))
+    {
+        printer.Println("{");
+        printer.Indent();
+        printer.Println("table_serialize(table, &value, data);");
+        printer.Outdent();
+        printer.Println("}");
+    }
+    printer.Println();
+
+    // Reuse mode only keeps the capacity of this message's own strings and vectors.
+    if (generate_member_function_head(message_type, "bool", "deserialize(std::string_view &data, " + full_name + " &value)", true, definition, printer))
+    {
+        printer.Println("{");
+        printer.Indent();
+        printer.Println("if constexpr (mode == decode_mode::reuse)");
+        printer.Println("{");
+        printer.Indent();
+        printer.Println("table_clear(table, &value);");
+        printer.Outdent();
+        printer.Println("}");
+        printer.Println();
+        printer.Println("return table_deserialize(table, data, &value);");
+        printer.Outdent();
+        printer.Println("}");
+    }
+}
+
+bool is_bytes_field(const google::protobuf::FieldDescriptor *field_type)
+{
+    return field_type->type() == google::protobuf::FieldDescriptor::TYPE_BYTES;
+}
+
+void generate_message_type_traits_to_json(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Definition definition, Printer &printer)
+{
+    if (!generate_member_function_head(message_type, "void", "to_json(const " + encode_full_name(message_type->full_name()) + " &value, std::string &data)", false, definition, printer))
+    {
+        return;
+    }
+    printer.Println("{");
+    printer.Indent();
+    if (message_type->field_count() > 0)
+    {
+        printer.Println("bool is_first = true;");
+    }
+    printer.Println("data += '{';");
+
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        auto field_type = message_type->field(i);
+        auto write = field_type->is_repeated() ? (is_bytes_field(field_type) ? "write_bytes_array" : "write_array") : (is_bytes_field(field_type) ? "write_bytes" : "write_value");
+
+        printer.Println("if (" + protoflat_field_condition(field_type, options) + ")");
+        printer.Println("{");
+        printer.Indent();
+        printer.Println("json::write_key(\"\\\"" + field_type->json_name() + "\\\":\", is_first, data);");
+        printer.Println("json::" + std::string(write) + "(" + field_value(field_type, options, "value") + ", data);");
+        printer.Outdent();
+        printer.Println("}");
+    }
+
+    printer.Println("data += '}';");
+    printer.Outdent();
+    printer.Println("}");
+}
+
+void generate_message_type_traits_from_json(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Definition definition, Printer &printer)
+{
+    if (!generate_member_function_head(message_type, "bool", "from_json(json::reader &reader, " + encode_full_name(message_type->full_name()) + " &value)", false, definition, printer))
+    {
+        return;
+    }
+    printer.Println("{");
+    printer.Indent();
+    printer.Println("return reader.read_object([&](std::string_view key) {");
+    printer.Indent();
+
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        auto field_type = message_type->field(i);
+        auto condition = "key == \"" + field_type->json_name() + "\"";
+        if (field_type->json_name() != field_type->name())
+        {
+            condition += " || key == \"" + field_type->name() + "\"";
+        }
+
+        std::string read;
+        if (field_type->is_repeated())
+        {
+            read = "reader." + std::string(is_bytes_field(field_type) ? "read_bytes_array" : "read_array") + "(value." + field_type->name() + ")";
+        }
+        else if (field_presence(field_type, options) == FieldPresence::shared)
+        {
+            read = "value." + field_type->name() + ".mutate([&](auto &field) { return reader.read_value(field); })";
+        }
+        else
+        {
+            read = "reader." + std::string(is_bytes_field(field_type) ? "read_bytes" : "read_value") + "(" + field_mutable_value(field_type, options, "value") + ")";
+        }
+
+        printer.Println("if (" + condition + ")");
+        printer.Println("{");
+        printer.Indent();
+        printer.Println("return " + read + ";");
+        printer.Outdent();
+        printer.Println("}");
+    }
+
+    printer.Println("return reader.skip_value();");
+    printer.Outdent();
+    printer.Println("});");
+    printer.Outdent();
+    printer.Println("}");
+}
+
+void generate_enum_type_traits(const google::protobuf::EnumDescriptor *enum_type, Printer &printer)
+{
+    auto type_name = encode_full_name(enum_type->full_name());
+    printer.Println("template<>");
+    printer.Println("struct type_traits<" + type_name + ">");
+    printer.Println("{");
+    printer.Indent();
+
+    printer.Println("static std::string_view name(" + type_name + " value)");
+    printer.Println("{");
+    printer.Indent();
+    printer.Println("switch (value)");
+    printer.Println("{");
+    std::vector<int> numbers;
+    for (int i = 0; i < enum_type->value_count(); ++i)
+    {
+        // Aliases share a number; the first name is the canonical one.
+        auto enum_value = enum_type->value(i);
+        if (std::find(numbers.begin(), numbers.end(), enum_value->number()) != numbers.end())
+        {
+            continue;
+        }
+        numbers.push_back(enum_value->number());
+
+        printer.Println("case " + type_name + "::" + enum_value->name() + ":");
+        printer.Indent();
+        printer.Println("return \"" + enum_value->name() + "\";");
+        printer.Outdent();
+    }
+    printer.Println("default:");
+    printer.Indent();
+    printer.Println("return {};");
+    printer.Outdent();
+    printer.Println("}");
+    printer.Outdent();
+    printer.Println("}");
+    printer.Println();
+
+    printer.Println("static bool parse(std::string_view name, " + type_name + " &value)");
+    printer.Println("{");
+    printer.Indent();
+    for (int i = 0; i < enum_type->value_count(); ++i)
+    {
+        auto enum_value = enum_type->value(i);
+        printer.Println("if (name == \"" + enum_value->name() + "\")");
+        printer.Println("{");
+        printer.Indent();
+        printer.Println("value = " + type_name + "::" + enum_value->name() + ";");
+        printer.Println("return true;");
+        printer.Outdent();
+        printer.Println("}");
+    }
+    printer.Println("return false;");
+    printer.Outdent();
+    printer.Println("}");
+
+    printer.Outdent();
+    printer.Println("};");
+    printer.Println();
+}
+
+void generate_message_enum_type_traits(const google::protobuf::Descriptor *message_type, Printer &printer)
+{
+    for (int i = 0; i < message_type->enum_type_count(); ++i)
+    {
+        generate_enum_type_traits(message_type->enum_type(i), printer);
+    }
+
+    for (int i = 0; i < message_type->nested_type_count(); ++i)
+    {
+        generate_message_enum_type_traits(message_type->nested_type(i), printer);
+    }
+}
+
+void generate_message_type_traits_members(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Definition definition, Printer &printer)
+{
+    if (options.table_codec)
+    {
+        generate_message_type_traits_table(message_type, definition, printer);
+    }
+    else
+    {
+        generate_message_type_traits_size(message_type, options, definition, printer);
+
+        printer.Println();
+        generate_message_type_traits_serialize(message_type, options, definition, printer);
+
+        printer.Println();
+        generate_message_type_traits_deserialize(message_type, options, definition, printer);
+    }
+
+    printer.Println();
+    generate_message_type_traits_delta(message_type, options, definition, printer);
+
+    if (options.json)
+    {
+        printer.Println();
+        generate_message_type_traits_to_json(message_type, options, definition, printer);
+
+        printer.Println();
+        generate_message_type_traits_from_json(message_type, options, definition, printer);
+    }
+}
+
+void generate_message_type_traits(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Printer &printer)
+{
+    for (int i = 0; i < message_type->nested_type_count(); ++i)
+    {
+        generate_message_type_traits(message_type->nested_type(i), options, printer);
+    }
+
+    printer.Println("template<>");
+    printer.Println("struct type_traits<" + encode_full_name(message_type->full_name()) + ">");
+    printer.Println("{");
+    printer.Indent();
+
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        generate_type_traits_field_header(message_type->field(i), printer);
+    }
+
+    printer.Println();
+    if (options.table_codec)
+    {
+        generate_message_type_traits_table_entries(message_type, options, printer);
+        printer.Println();
+    }
+    generate_message_type_traits_members(message_type, options, message_definition(message_type, options), printer);
+
+    printer.Outdent();
+    printer.Println("};");
+    printer.Println();
+}
+
+// Defines the members generate_message_type_traits only declared, with explicit
+// instantiations of both decode modes.
+void generate_message_type_traits_definitions(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Printer &printer)
+{
+    auto full_name = encode_full_name(message_type->full_name());
+
+    generate_message_type_traits_members(message_type, options, Definition::out_of_line, printer);
+    printer.Println();
+
+    for (auto mode : {"merge", "reuse"})
+    {
+        printer.Println(std::string("template bool type_traits<") + full_name + ">::deserialize<decode_mode::" + mode + ">(std::string_view &data, " + full_name + " &value);");
+    }
+    printer.Println();
+}
+
+std::string protoflat_column_value_type(const google::protobuf::FieldDescriptor *field_type)
+{
+    using namespace google::protobuf;
+    switch (field_type->cpp_type())
+    {
+    case FieldDescriptor::CPPTYPE_BOOL:
+        return "bitmap";
+    case FieldDescriptor::CPPTYPE_STRING:
+        return field_type->type() == FieldDescriptor::TYPE_STRING ? "utf8_column" : "binary_column";
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+        return field_type->is_repeated() ? "columns<" + protoflat_field_type(field_type) + ">" : "struct_column<" + protoflat_field_type(field_type) + ">";
+    default:
+        return "std::vector<" + protoflat_field_type(field_type) + ">";
+    }
+}
+
+std::string protoflat_column_type(const google::protobuf::FieldDescriptor *field_type)
+{
+    if (field_type->is_repeated())
+    {
+        return "list_column<" + protoflat_column_value_type(field_type) + ">";
+    }
+
+    return protoflat_column_value_type(field_type);
+}
+
+void generate_columns_deserialize_call(const std::string &columns_type, const std::string &column_name, Printer &printer)
+{
+    printer.Println("if (!type_traits<" + columns_type + ">::deserialize(field, " + column_name + "))");
+    printer.Println("{");
+    printer.Indent();
+    printer.Println("return false;");
+    printer.Outdent();
+    printer.Println("}");
+}
+
+void generate_columns_field_deserialize(const google::protobuf::FieldDescriptor *field_type, const GeneratorOptions &options, Printer &printer)
+{
+    using namespace google::protobuf;
+    auto name = field_type->name();
+    auto column_name = "value." + name;
+    auto wire_type = protoflat_wire_type(field_type, false);
+    auto field_wire_type = "wire_type::" + std::string(protoflat::wire_type_string(wire_type));
+
+    if (field_type->is_repeated() && wire_type != protoflat::wire_type::length_delimited)
+    {
+        printer.Println("if (header.field_type == wire_type::length_delimited)");
+        printer.Println("{");
+        printer.Indent();
+        generate_type_traits_field_deserialize_call(protoflat_field_specialization_type(field_type, true), column_name + ".values", printer);
+        printer.Println(column_name + ".offsets.back() = static_cast<int64_t>(" + column_name + ".values.size());");
+        printer.Println("continue;");
+        printer.Outdent();
+        printer.Println("}");
+    }
+
+    printer.Println("if (header.field_type == " + field_wire_type + ")");
+    printer.Println("{");
+    printer.Indent();
+    if (wire_type == protoflat::wire_type::length_delimited)
+    {
+        printer.Println("std::string_view field;");
+        generate_type_traits_field_deserialize_call(is_message_field(field_type) ? "length_delimited" : protoflat_field_decode_type(field_type, options), "field", printer);
+        if (field_type->is_repeated() && is_message_field(field_type))
+        {
+            auto columns_type = protoflat_column_value_type(field_type);
+            printer.Println("type_traits<" + columns_type + ">::emplace_back(" + column_name + ".values);");
+            printer.Println("++" + column_name + ".offsets.back();");
+            generate_columns_deserialize_call(columns_type, column_name + ".values", printer);
+        }
+        else if (field_type->is_repeated())
+        {
+            printer.Println(column_name + ".values.push_back(field);");
+            printer.Println(column_name + ".offsets.back() = static_cast<int64_t>(" + column_name + ".values.size());");
+        }
+        else if (is_message_field(field_type))
+        {
+            printer.Println(column_name + ".validity.assign_back(true);");
+            generate_columns_deserialize_call("columns<" + protoflat_field_type(field_type) + ">", column_name + ".fields", printer);
+        }
+        else
+        {
+            printer.Println(column_name + ".assign_back(field);");
+        }
+    }
+    else if (field_type->is_repeated() || field_type->cpp_type() == FieldDescriptor::CPPTYPE_BOOL)
+    {
+        printer.Println(protoflat_field_type(field_type) + " field{};");
+        generate_type_traits_field_deserialize_call(protoflat_field_specialization_type(field_type, false), "field", printer);
+        if (field_type->is_repeated())
+        {
+            printer.Println(column_name + ".values.push_back(field);");
+            printer.Println(column_name + ".offsets.back() = static_cast<int64_t>(" + column_name + ".values.size());");
+        }
+        else
+        {
+            printer.Println(column_name + ".assign_back(field);");
+        }
+    }
+    else
+    {
+        generate_type_traits_field_deserialize_call(protoflat_field_specialization_type(field_type, false), column_name + ".back()", printer);
+    }
+    printer.Println("continue;");
+    printer.Outdent();
+    printer.Println("}");
+}
+
+void generate_message_columns(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, Printer &printer)
+{
+    for (int i = 0; i < message_type->nested_type_count(); ++i)
+    {
+        generate_message_columns(message_type->nested_type(i), options, printer);
+    }
+
+    auto columns_type = "columns<" + encode_full_name(message_type->full_name()) + ">";
+
+    printer.Println("template<>");
+    printer.Println("struct " + columns_type);
+    printer.Println("{");
+    printer.Indent();
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        printer.Println(protoflat_column_type(message_type->field(i)) + " " + message_type->field(i)->name() + ";");
+    }
+    printer.Outdent();
+    printer.Println("};");
+    printer.Println();
+
+    printer.Println("template<>");
+    printer.Println("struct type_traits<" + columns_type + ">");
+    printer.Println("{");
+    printer.Indent();
+
+    printer.Println("inline static constexpr size_t field_count = " + std::to_string(message_type->field_count()) + ";");
+    printer.Println();
+
+    printer.Println("template<class Visitor>");
+    printer.Println("static void visit(const " + columns_type + " &value, Visitor &&visitor)");
+    printer.Println("{");
+    printer.Indent();
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        printer.Println("visitor(\"" + message_type->field(i)->name() + "\", value." + message_type->field(i)->name() + ");");
+    }
+    printer.Outdent();
+    printer.Println("}");
+    printer.Println();
+
+    printer.Println("static void emplace_back(" + columns_type + " &value)");
+    printer.Println("{");
+    printer.Indent();
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        printer.Println("value." + message_type->field(i)->name() + ".emplace_back();");
+    }
+    printer.Outdent();
+    printer.Println("}");
+    printer.Println();
+
+    printer.Println("static void clear(" + columns_type + " &value)");
+    printer.Println("{");
+    printer.Indent();
+    for (int i = 0; i < message_type->field_count(); ++i)
+    {
+        printer.Println("value." + message_type->field(i)->name() + ".clear();");
+    }
+    printer.Outdent();
+    printer.Println("}");
+    printer.Println();
+
+    // Decodes a message into the last row, which emplace_back must have added.
+    printer.Println("static bool deserialize(std::string_view &data, " + columns_type + " &value)");
+    printer.Println("{");
+    printer.Indent();
+    generate_deserialize_loop(
+        message_type, options, [&](auto field_type) { generate_columns_field_deserialize(field_type, options, printer); }, printer);
+    printer.Println("return true;");
+    printer.Outdent();
+    printer.Println("}");
+
+    printer.Outdent();
+    printer.Println("};");
+    printer.Println();
+}
+
+void generate_header(const google::protobuf::FileDescriptor *file, const GeneratorOptions &options, Printer &printer)
+{
+    printer.Println("#pragma once");
+    printer.Println();
+
+    // Files without types, e.g. protoflat_options.proto, have nothing to include.
+    bool has_dependency_includes = false;
+    for (int i = 0; i < file->dependency_count(); ++i)
+    {
+        auto dependency = file->dependency(i);
+        if (dependency->message_type_count() > 0 || dependency->enum_type_count() > 0)
+        {
+            printer.Println("#include \"" + protoflat_file_name(dependency) + ".h\"");
+            has_dependency_includes = true;
+        }
+    }
+    if (has_dependency_includes)
+    {
+        printer.Println();
+    }
+
+    printer.Println("#include <protoflat.h>");
+    printer.Println("#ifdef PROTOFLAT_FIELD_STATS");
+    printer.Println("#include <protoflat_stats.h>");
+    printer.Println("#endif");
+    if (options.json)
+    {
+        printer.Println("#include <protoflat_json.h>");
+    }
+    if (options.columns)
+    {
+        printer.Println("#include <protoflat_columns.h>");
+    }
+    if (any_field(file, [&](auto field_type) { return protoflat_field_decode_type(field_type, options) == "utf8_string"; }))
+    {
+        printer.Println("#include <protoflat_utf8.h>");
+    }
+    if (any_field(file, [&](auto field_type) { return field_presence(field_type, options) == FieldPresence::boxed; }))
+    {
+        printer.Println("#include <protoflat_boxed.h>");
+    }
+    if (any_field(file, [&](auto field_type) { return field_presence(field_type, options) == FieldPresence::shared; }))
+    {
+        printer.Println("#include <protoflat_shared.h>");
+    }
+    if (any_field(file, [&](auto field_type) { return protoflat_vector_capacity(field_type, options) > 0 || protoflat_string_capacity(field_type, options) > 0; }))
+    {
+        printer.Println("#include <protoflat_small_vector.h>");
+    }
     printer.Println();
+    if (options.table_codec)
+    {
+        printer.Println("#include <cstddef>");
+    }
     printer.Println("#include <optional>");
     printer.Println("#include <string>");
+    if (options.json)
+    {
+        printer.Println("#include <string_view>");
+    }
     printer.Println("#include <variant>");
     printer.Println("#include <vector>");
     printer.Println();
@@ -416,7 +1892,7 @@ void generate_header(const google::protobuf::FileDescriptor *file, Printer &prin
 
     for (int i = 0; i < file->message_type_count(); ++i)
     {
-        generate_message(file->message_type(i), printer);
+        generate_message(file->message_type(i), options, printer);
     }
 
     printer.Println("}");
@@ -426,35 +1902,187 @@ void generate_header(const google::protobuf::FileDescriptor *file, Printer &prin
     printer.Println("{");
     printer.Println();
 
+    if (options.json)
+    {
+        for (int i = 0; i < file->enum_type_count(); ++i)
+        {
+            generate_enum_type_traits(file->enum_type(i), printer);
+        }
+
+        for (int i = 0; i < file->message_type_count(); ++i)
+        {
+            generate_message_enum_type_traits(file->message_type(i), printer);
+        }
+    }
+
     for (int i = 0; i < file->message_type_count(); ++i)
     {
-        generate_message_type_traits(file->message_type(i), printer);
+        generate_message_type_traits(file->message_type(i), options, printer);
+    }
+
+    if (options.columns)
+    {
+        for (int i = 0; i < file->message_type_count(); ++i)
+        {
+            generate_message_columns(file->message_type(i), options, printer);
+        }
     }
 
     printer.Println("}");
 }
 
-void generate_source(const google::protobuf::FileDescriptor *file, Printer &printer)
+void collect_out_of_line_messages(const google::protobuf::Descriptor *message_type, const GeneratorOptions &options, std::vector<const google::protobuf::Descriptor *> &message_types)
+{
+    for (int i = 0; i < message_type->nested_type_count(); ++i)
+    {
+        collect_out_of_line_messages(message_type->nested_type(i), options, message_types);
+    }
+
+    if (message_definition(message_type, options) == Definition::declaration)
+    {
+        message_types.push_back(message_type);
+    }
+}
+
+// Spreads out-of-line messages over options.shards source files, each message going
+// to the file with the fewest fields so far.
+std::vector<std::vector<const google::protobuf::Descriptor *>> shard_out_of_line_messages(const google::protobuf::FileDescriptor *file, const GeneratorOptions &options)
+{
+    std::vector<const google::protobuf::Descriptor *> message_types;
+    for (int i = 0; i < file->message_type_count(); ++i)
+    {
+        collect_out_of_line_messages(file->message_type(i), options, message_types);
+    }
+
+    std::vector<std::vector<const google::protobuf::Descriptor *>> shards(options.shards);
+    std::vector<size_t> field_counts(options.shards);
+    for (auto message_type : message_types)
+    {
+        auto shard = std::min_element(field_counts.begin(), field_counts.end()) - field_counts.begin();
+        shards[shard].push_back(message_type);
+        field_counts[shard] += message_type->field_count() + 1;
+    }
+
+    return shards;
+}
+
+void generate_source(const google::protobuf::FileDescriptor *file, const std::vector<const google::protobuf::Descriptor *> &message_types, const GeneratorOptions &options, Printer &printer)
 {
     printer.Println("#include \"" + protoflat_file_name(file) + ".h\"");
     printer.Println();
     printer.Println("namespace " + substitute(file->package(), ".", "::"));
     printer.Println("{");
     printer.Println("}");
+
+    if (message_types.empty())
+    {
+        return;
+    }
+
+    printer.Println();
+    printer.Println("namespace protoflat");
+    printer.Println("{");
+    printer.Println();
+
+    for (auto message_type : message_types)
+    {
+        generate_message_type_traits_definitions(message_type, options, printer);
+    }
+
+    printer.Println("}");
+}
+
+uint64_t ProtoflatGenerator::GetSupportedFeatures() const
+{
+    return FEATURE_PROTO3_OPTIONAL;
 }
 
 bool ProtoflatGenerator::Generate(const google::protobuf::FileDescriptor *file, const std::string &parameter,
                                   google::protobuf::compiler::GeneratorContext *generator_context, std::string *error) const
 {
+    GeneratorOptions options;
+    std::vector<std::pair<std::string, std::string>> parameters;
+    google::protobuf::compiler::ParseGeneratorParameter(parameter, &parameters);
+    for (auto &[key, value] : parameters)
+    {
+        size_t count = 0;
+        if (key == "columns")
+        {
+            options.columns = true;
+        }
+        else if (key == "json")
+        {
+            options.json = true;
+        }
+        else if (key == "codec" && (value == "table" || value == "inline"))
+        {
+            options.table_codec = value == "table";
+        }
+        else if (key == "utf8" && (value == "strict" || value == "lenient"))
+        {
+            options.strict_utf8 = value == "strict";
+        }
+        else if (key == "layout" && (value == "compact" || value == "declaration"))
+        {
+            options.compact_layout = value == "compact";
+        }
+        else if ((key == "small_vector" || key == "small_string" || key == "shards") && parse_count(value, key == "shards" ? max_shards : max_inline_capacity, count))
+        {
+            (key == "small_vector" ? options.small_vector_capacity : key == "small_string" ? options.small_string_capacity : options.shards) = count;
+        }
+        else if (key == "out_of_line")
+        {
+            options.out_of_line = true;
+        }
+        else if (key == "hot" && !value.empty())
+        {
+            options.hot_messages.push_back(value);
+        }
+        else if (key == "shared" && !value.empty())
+        {
+            options.shared_fields.push_back(value);
+        }
+        else if (key == "profile" && !value.empty())
+        {
+            if (!read_field_counts(value, options.field_counts, error))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            *error = "Unknown parameter: " + key + (value.empty() ? "" : "=" + value);
+            return false;
+        }
+    }
+
+    if (options.compact_layout && options.table_codec)
+    {
+        // Table entries address presence through std::optional-like members only.
+        *error = "layout=compact cannot be combined with codec=table";
+        return false;
+    }
+
+    if (options.shards == 0 || (!options.out_of_line && (options.shards > 1 || !options.hot_messages.empty())))
+    {
+        *error = "shards and hot need out_of_line, and shards must be positive";
+        return false;
+    }
+
     auto name = protoflat_file_name(file);
 
     auto header_stream = generator_context->Open(name + ".h");
     Printer header_printer(header_stream);
-    generate_header(file, header_printer);
+    generate_header(file, options, header_printer);
 
-    auto source_stream = generator_context->Open(name + ".cpp");
-    Printer source_printer(source_stream);
-    generate_source(file, source_printer);
+    // The first shard keeps the usual name, the others are numbered from 1.
+    auto shards = shard_out_of_line_messages(file, options);
+    for (size_t i = 0; i < shards.size(); ++i)
+    {
+        auto source_stream = generator_context->Open(name + (i == 0 ? "" : "." + std::to_string(i)) + ".cpp");
+        Printer source_printer(source_stream);
+        generate_source(file, shards[i], options, source_printer);
+    }
 
     return true;
 }
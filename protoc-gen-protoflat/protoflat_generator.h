@@ -8,4 +8,5 @@ class ProtoflatGenerator
 public:
     bool Generate(const google::protobuf::FileDescriptor *file, const std::string &parameter,
                   google::protobuf::compiler::GeneratorContext *generator_context, std::string *error) const override;
+    uint64_t GetSupportedFeatures() const override;
 };
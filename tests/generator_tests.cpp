@@ -0,0 +1,176 @@
+#include <catch2/catch.hpp>
+
+#include "tests.h"
+
+#include <compact.protoflat.h>
+#include <profiled.protoflat.h>
+#include <small_vector.protoflat.h>
+#include <strict_utf8.protoflat.h>
+
+#include <protoflat.h>
+
+#include <functional>
+#include <string>
+#include <type_traits>
+
+// Code generated with parameters other than the defaults, see CMakeLists.txt.
+
+TEST_CASE("small_vector and small_string fields round-trip through libprotobuf")
+{
+    using test_small_vector::Entry;
+    static_assert(std::is_same_v<decltype(Entry::name), protoflat::small_string<16>>);
+    static_assert(std::is_same_v<decltype(Entry::payload), protoflat::small_string<32>>);
+    static_assert(std::is_same_v<decltype(Entry::values), protoflat::small_vector<int64_t, 4>>);
+    static_assert(std::is_same_v<decltype(Entry::tags), protoflat::small_vector<protoflat::small_string<16>, 2>>);
+
+    // Inline and spilled to the heap.
+    const std::string text = R"(
+        id: 1 name: "short" payload: "a payload longer than thirty-two bytes"
+        values: [-1, 2, -3, 4, -5] tags: ["a", "a tag longer than sixteen bytes", "c"]
+        children { id: 2 values: [9223372036854775807] }
+    )";
+    auto data = libprotobuf_serialize("test_small_vector.Entry", text);
+
+    Entry value{};
+    REQUIRE(deserialize_all(data, value));
+    CHECK(value.name == "short");
+    CHECK(value.values.size() == 5);
+    CHECK(value.tags[1] == "a tag longer than sixteen bytes");
+    REQUIRE(value.children.size() == 1);
+    CHECK(value.children[0].values[0] == 9223372036854775807);
+    CHECK(protoflat::serialize(value) == data);
+
+    auto reused_data = libprotobuf_serialize("test_small_vector.Entry", "values: [7] tags: ['x']");
+    std::string_view input = reused_data;
+    REQUIRE(protoflat::deserialize_reuse(input, value));
+    CHECK(value.name.empty());
+    CHECK(value.values.size() == 1);
+    CHECK(protoflat::serialize(value) == reused_data);
+}
+
+TEST_CASE("compact layout with boxed submessages round-trips through libprotobuf")
+{
+    using test_compact::Node;
+    static_assert(std::is_same_v<decltype(Node::left), protoflat::boxed<Node>>);
+    static_assert(std::is_same_v<decltype(Node::id), int32_t>);
+
+    // Present fields holding their default value are written, absent ones are not.
+    Node value{};
+    value.mutable_id() = 0;
+    value.mutable_name() = "root";
+    value.size = 3;
+    auto &left = value.left.emplace();
+    left.mutable_is_leaf() = false;
+    left.right.emplace().mutable_weight() = 0.25;
+    value.mutable_metadata().owner = "owner";
+    value.children.emplace_back().mutable_id() = 7;
+
+    const std::string text = R"(
+        id: 0 name: "root" size: 3
+        left { is_leaf: false right { weight: 0.25 } }
+        metadata { owner: "owner" }
+        children { id: 7 }
+    )";
+    auto data = protoflat::serialize(value);
+    CHECK(data == libprotobuf_serialize("test_compact.Node", text));
+
+    Node decoded{};
+    REQUIRE(deserialize_all(data, decoded));
+    CHECK(decoded == value);
+    CHECK(decoded.has_id());
+    CHECK_FALSE(decoded.has_is_leaf());
+    CHECK_FALSE(decoded.has_weight());
+    REQUIRE(decoded.left);
+    CHECK(decoded.left->has_is_leaf());
+    CHECK_FALSE(decoded.right);
+    CHECK(decoded.has_metadata());
+    CHECK_FALSE(decoded.metadata.has_version());
+
+    decoded.clear_name();
+    decoded.clear_metadata();
+    decoded.left.reset();
+    CHECK(libprotobuf_decodes_to("test_compact.Node", protoflat::serialize(decoded), "id: 0 size: 3 children { id: 7 }"));
+
+    auto reused_data = libprotobuf_serialize("test_compact.Node", "weight: 1.5 right { id: 2 }");
+    std::string_view input = reused_data;
+    REQUIRE(protoflat::deserialize_reuse(input, decoded));
+    CHECK_FALSE(decoded.has_id());
+    CHECK(decoded.children.empty());
+    CHECK(protoflat::serialize(decoded) == reused_data);
+}
+
+TEST_CASE("utf8=strict rejects malformed string fields but not bytes fields")
+{
+    using test_strict_utf8::Text;
+    const std::string malformed = "caf\xe9";
+
+    Text value{};
+    value.text = "caf\xc3\xa9";
+    value.data = malformed;
+    value.lines = {"one", "two"};
+    auto data = protoflat::serialize(value);
+    CHECK(libprotobuf_decodes_to("test_strict_utf8.Text", data, R"(text: "caf\303\251" data: "caf\351" lines: "one" lines: "two")"));
+
+    Text decoded{};
+    REQUIRE(deserialize_all(data, decoded));
+    CHECK(decoded.text == value.text);
+    CHECK(decoded.data == malformed);
+
+    value.text = malformed;
+    decoded = {};
+    CHECK_FALSE(deserialize_all(protoflat::serialize(value), decoded));
+
+    value.text.clear();
+    value.lines.back() = malformed;
+    decoded = {};
+    CHECK_FALSE(deserialize_all(protoflat::serialize(value), decoded));
+}
+
+TEST_CASE("code generated from a profile round-trips through libprotobuf")
+{
+    using test_profiled::Trace;
+
+    // profiled.profile makes points and samples the hottest fields of Trace.
+    Trace value{};
+    std::less<const void *> is_before;
+    CHECK(is_before(&value.points, &value.name));
+    CHECK(is_before(&value.samples, &value.name));
+    CHECK(is_before(&value.weight, &value.origin));
+
+    value.name = "trace";
+    value.timestamp = 1700000000;
+    value.points = {{1, -2, true}, {-3, 4, false}};
+    value.samples = {5, 6, 70000};
+    value.origin = test_profiled::Point{-1, 0, true};
+    value.payload = std::string("\0\1", 2);
+    value.weight = 0.5;
+
+    const std::string text = R"(
+        name: "trace" timestamp: 1700000000
+        points { x: 1 y: -2 is_visible: true } points { x: -3 y: 4 }
+        samples: [5, 6, 70000]
+        origin { x: -1 is_visible: true }
+        payload: "\000\001" weight: 0.5
+    )";
+    auto data = protoflat::serialize(value);
+    CHECK(libprotobuf_decodes_to("test_profiled.Trace", data, text));
+
+    // libprotobuf writes fields in number order, not in the profile's.
+    Trace decoded{};
+    REQUIRE(deserialize_all(libprotobuf_serialize("test_profiled.Trace", text), decoded));
+    CHECK(decoded == value);
+
+    decoded = {};
+    REQUIRE(deserialize_all(data, decoded));
+    CHECK(decoded == value);
+
+    auto reused_data = libprotobuf_serialize("test_profiled.Trace", "points { y: 9 } weight: 2");
+    std::string_view input = reused_data;
+    REQUIRE(protoflat::deserialize_reuse(input, decoded));
+    CHECK(decoded.name.empty());
+    REQUIRE(decoded.points.size() == 1);
+    CHECK(decoded.points[0] == test_profiled::Point{0, 9, false});
+    CHECK(decoded.samples.empty());
+    CHECK_FALSE(decoded.origin);
+    CHECK(decoded.weight == 2);
+}
@@ -0,0 +1,8 @@
+test_profiled.Point 1 90000
+test_profiled.Point 2 90000
+test_profiled.Point 3 1200
+test_profiled.Trace 1 1000
+test_profiled.Trace 2 1000
+test_profiled.Trace 3 30000
+test_profiled.Trace 4 12000
+test_profiled.Trace 7 400
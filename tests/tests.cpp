@@ -1,169 +1,1081 @@
-//#include "test.pb.h"
-#include "test.protoflat.h"
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
+
+#include "tests.h"
+
+#include <test.protoflat.h>
 
 #include <protoflat.h>
+#include <protoflat_arrow.h>
+#include <protoflat_async.h>
+#include <protoflat_columns.h>
+#include <protoflat_dynamic.h>
+#include <protoflat_json.h>
+#include <protoflat_pool.h>
+#include <protoflat_record.h>
+#include <protoflat_ring.h>
+#include <protoflat_small_vector.h>
+#include <protoflat_stats.h>
+
+#include <google/protobuf/message.h>
+#include <google/protobuf/util/json_util.h>
+#include <google/protobuf/util/message_differencer.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
-#include <iomanip>
-#include <iostream>
+namespace
+{
+
+const std::string sint_text = R"(
+    numeric_32 { a: -3 c: -7 c_list: [-4, 5, -2147483648, 2147483647] }
+    numeric_64 { c: -9223372036854775808 c_list: [-1, 0, 9223372036854775807] }
+)";
 
-struct Message
+test2::Data sint_data()
 {
-    int32_t id;
-    std::string text;
-    std::vector<int32_t> data;
-    std::vector<std::string> messages;
+    test2::Data value{};
+    value.numeric_32.emplace();
+    value.numeric_32->a = -3;
+    value.numeric_32->c = -7;
+    value.numeric_32->c_list = {-4, 5, std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max()};
+    value.numeric_64.emplace();
+    value.numeric_64->c = std::numeric_limits<int64_t>::min();
+    value.numeric_64->c_list = {-1, 0, std::numeric_limits<int64_t>::max()};
+
+    return value;
+}
+
+test2::Data sample_data()
+{
+    test2::Data value{};
+    value.numeric_32.emplace();
+    value.numeric_32->a = 1;
+    value.numeric_32->b = 2;
+    value.numeric_32->d = 4;
+    value.numeric_32->e = 0.5f;
+    value.numeric_32->a_list = {1, -1, 300};
+    value.numeric_32->d_list = {7, 8};
+    value.is_enabled = true;
+    value.is_enabled_list = {true, false, true};
+    value.global_enum = test2::GlobalEnum::BBB;
+    value.global_enum_list = {test2::GlobalEnum::AAA, test2::GlobalEnum::CCC};
+    value.text = "Hello!";
+    value.text_list = {"Hello!", "World!"};
+    value.buffer = std::string("\0\1\2", 3);
+
+    return value;
+}
+
+const std::string sample_text = R"(
+    numeric_32 { a: 1 b: 2 d: 4 e: 0.5 a_list: [1, -1, 300] d_list: [7, 8] }
+    is_enabled: true is_enabled_list: [true, false, true]
+    global_enum: BBB global_enum_list: [AAA, CCC]
+    text: "Hello!" text_list: ["Hello!", "World!"]
+    buffer: "\000\001\002"
+)";
+
+} // namespace
+
+TEST_CASE("messages round-trip through libprotobuf")
+{
+    auto value = sample_data();
+    CHECK(libprotobuf_decodes_to("test2.Data", protoflat::serialize(value), sample_text));
+
+    test2::Data decoded;
+    CHECK(deserialize_all(libprotobuf_serialize("test2.Data", sample_text), decoded));
+    CHECK(decoded == value);
+}
 
-    bool operator!=(const Message &another) const
+TEST_CASE("sint fields are zigzag-encoded")
+{
+    auto value = sint_data();
+    auto data = protoflat::serialize(value);
+    CHECK(data == libprotobuf_serialize("test2.Data", sint_text));
+    CHECK(libprotobuf_decodes_to("test2.Data", data, sint_text));
+
+    test2::Data decoded;
+    CHECK(deserialize_all(libprotobuf_serialize("test2.Data", sint_text), decoded));
+    CHECK(decoded == value);
+
+    SECTION("element-wise repeated sint fields are accepted")
+    {
+        // c_list = 8, written unpacked: -4 and 5.
+        std::string data("\x0a\x04\x40\x07\x40\x0a", 6);
+        test2::Data decoded;
+        REQUIRE(deserialize_all(data, decoded));
+        CHECK(decoded.numeric_32->c_list == std::vector<int32_t>{-4, 5});
+    }
+
+    SECTION("columns decode sint fields")
+    {
+        protoflat::column_batch<test2::Data> batch;
+        REQUIRE(protoflat::append_row(data, batch));
+        CHECK(batch.fields.numeric_32.fields.c == std::vector<int32_t>{-7});
+        CHECK(batch.fields.numeric_32.fields.c_list.values == value.numeric_32->c_list);
+        CHECK(batch.fields.numeric_64.fields.c == std::vector<int64_t>{std::numeric_limits<int64_t>::min()});
+    }
+}
+
+TEST_CASE("deltas merge into the baseline")
+{
+    auto baseline = sample_data();
+    auto value = baseline;
+    value.numeric_32->a = 5;
+    value.numeric_32->c = -7;
+    value.numeric_32->a_list.push_back(-8);
+    value.text = "Changed";
+    value.text_list.push_back("!");
+
+    std::string delta;
+    REQUIRE(protoflat::serialize_delta_to_string(baseline, value, delta));
+    CHECK(delta.size() < protoflat::serialize(value).size());
+
+    auto patched = baseline;
+    std::string_view delta_view(delta);
+    REQUIRE(protoflat::apply_delta(delta_view, patched));
+    CHECK(patched == value);
+
+    auto libprotobuf_patched = parse_text("test2.Data", sample_text);
+    REQUIRE(libprotobuf_patched->MergeFromString(delta));
+    CHECK(libprotobuf_decodes_to("test2.Data", libprotobuf_patched->SerializeAsString(), R"(
+        numeric_32 { a: 5 b: 2 c: -7 d: 4 e: 0.5 a_list: [1, -1, 300, -8] d_list: [7, 8] }
+        is_enabled: true is_enabled_list: [true, false, true]
+        global_enum: BBB global_enum_list: [AAA, CCC]
+        text: "Changed" text_list: ["Hello!", "World!", "!"]
+        buffer: "\000\001\002"
+    )"));
+
+    SECTION("removals need a full snapshot")
     {
-        return std::tie(id, text, data, messages) != std::tie(another.id, another.text, another.data, messages);
+        value.text_list.pop_back();
+        value.text_list.pop_back();
+        std::string data;
+        CHECK_FALSE(protoflat::serialize_delta_to_string(baseline, value, data));
+        CHECK(data.empty());
     }
+}
+
+TEST_CASE("malformed input is rejected")
+{
+    auto data = libprotobuf_serialize("test2.Data", sample_text);
+    test2::Data decoded;
+
+    SECTION("truncated messages")
+    {
+        // Cuts between two top-level fields leave a valid shorter message.
+        for (size_t size = 1; size < data.size(); ++size)
+        {
+            std::string truncated = data.substr(0, size);
+            CHECK(deserialize_all(truncated, decoded) == new_libprotobuf_message("test2.Data")->ParseFromString(truncated));
+        }
+        CHECK_FALSE(deserialize_all(std::string_view(data).substr(0, data.size() - 1), decoded));
+    }
+
+    SECTION("overlong varint")
+    {
+        CHECK_FALSE(deserialize_all(std::string("\x50\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01", 12), decoded));
+    }
+
+    SECTION("length past the end")
+    {
+        CHECK_FALSE(deserialize_all(std::string("\xf2\x01\x10" "abc", 6), decoded));
+    }
+
+    SECTION("unsupported wire type")
+    {
+        CHECK_FALSE(deserialize_all(std::string("\x53\x00", 2), decoded));
+    }
+}
+
+TEST_CASE("merge follows libprotobuf MergeFrom")
+{
+    auto first = sample_data();
+    auto second = sint_data();
+    second.text = "Merged";
+
+    auto merged = first;
+    auto data = protoflat::serialize(second);
+    std::string_view data_view(data);
+    REQUIRE(protoflat::merge(data_view, merged));
+
+    auto libprotobuf_merged = parse_text("test2.Data", sample_text);
+    REQUIRE(libprotobuf_merged->MergeFromString(data));
+    CHECK(protoflat::serialize(merged) == libprotobuf_merged->SerializeAsString());
+}
+
+TEST_CASE("deserialize_reuse matches deserialize")
+{
+    auto value = sample_data();
+    value.text_list.assign(8, std::string(64, 'x'));
+
+    auto data = libprotobuf_serialize("test2.Data", sint_text);
+    test2::Data expected;
+    REQUIRE(deserialize_all(data, expected));
+
+    auto text_list_capacity = value.text_list.capacity();
+    auto a_list_capacity = value.numeric_32->a_list.capacity();
+    std::string_view data_view(data);
+    REQUIRE(protoflat::deserialize_reuse(data_view, value));
+    CHECK(value == expected);
+    CHECK(value.text_list.capacity() == text_list_capacity);
+#ifndef PROTOFLAT_TESTS_TABLE_CODEC
+    // The table codec clears a message before reusing it, which resets submessages.
+    CHECK(value.numeric_32->a_list.capacity() == a_list_capacity);
+#endif
+}
+
+TEST_CASE("column batches hold one row per message")
+{
+    test::Message message;
+    message.data.push_back(sample_data());
+    message.data.emplace_back();
+    message.data.back().text = "second";
+    message.data.back().text_list = {"a", "bc"};
+    message.data.push_back(sint_data());
+
+    protoflat::column_batch<test2::Data> batch;
+    REQUIRE(protoflat::append_field_rows(protoflat::serialize(message), protoflat::type_traits<test::Message>::data_header, batch));
+    REQUIRE(batch.size == 3);
+
+    auto &fields = batch.fields;
+    CHECK(fields.numeric_32.size() == 3);
+    CHECK(fields.numeric_32.validity[0]);
+    CHECK_FALSE(fields.numeric_32.validity[1]);
+    CHECK(fields.numeric_32.validity[2]);
+    CHECK(fields.numeric_32.fields.a == std::vector<int32_t>{1, 0, -3});
+    CHECK(fields.numeric_32.fields.a_list.offsets == std::vector<int64_t>{0, 3, 3, 3});
+    CHECK(fields.numeric_32.fields.a_list.values == std::vector<int32_t>{1, -1, 300});
+    CHECK(fields.is_enabled.size() == 3);
+    CHECK(fields.is_enabled[0]);
+    CHECK_FALSE(fields.is_enabled[1]);
+    CHECK(fields.global_enum == std::vector<test2::GlobalEnum>{test2::GlobalEnum::BBB, test2::GlobalEnum::UNKNOWN, test2::GlobalEnum::UNKNOWN});
+    CHECK(fields.text[0] == "Hello!");
+    CHECK(fields.text[1] == "second");
+    CHECK(fields.text[2].empty());
+    CHECK(fields.text_list.offsets == std::vector<int64_t>{0, 2, 4, 4});
+    CHECK(fields.text_list.values[3] == "bc");
+
+    SECTION("a failed row keeps the columns aligned")
+    {
+        CHECK_FALSE(protoflat::append_row(std::string_view("\xf2\x01\x10", 3), batch));
+        CHECK(batch.size == 4);
+        CHECK(fields.text.size() == 4);
+        CHECK(fields.numeric_32.size() == 4);
+        CHECK(fields.text_list.size() == 4);
+    }
+
+    SECTION("clear drops all rows")
+    {
+        batch.clear();
+        CHECK(batch.size == 0);
+        CHECK(fields.text.size() == 0);
+        CHECK(fields.text_list.values.size() == 0);
+    }
+}
+
+TEST_CASE("column batches export through the Arrow C data interface")
+{
+    protoflat::column_batch<test2::Data> batch;
+    REQUIRE(protoflat::append_row(protoflat::serialize(sample_data()), batch));
+    REQUIRE(protoflat::append_row(protoflat::serialize(test2::Data{}), batch));
+
+    ArrowSchema schema;
+    ArrowArray array;
+    protoflat::export_arrow(std::move(batch), &schema, &array);
+
+    CHECK(std::string_view(schema.format) == "+s");
+    REQUIRE(schema.n_children == 10);
+    CHECK(array.length == 2);
+    REQUIRE(array.n_children == 10);
+
+    auto numeric_32 = array.children[0];
+    CHECK(std::string_view(schema.children[0]->format) == "+s");
+    CHECK(schema.children[0]->flags == ARROW_FLAG_NULLABLE);
+    CHECK(numeric_32->null_count == 1);
+    CHECK((static_cast<const uint8_t *>(numeric_32->buffers[0])[0] & 3) == 1);
+
+    CHECK(std::string_view(schema.children[0]->children[0]->name) == "a");
+    CHECK(std::string_view(schema.children[0]->children[0]->format) == "i");
+    CHECK(static_cast<const int32_t *>(numeric_32->children[0]->buffers[1])[0] == 1);
+
+    auto text_list = array.children[7];
+    CHECK(std::string_view(schema.children[7]->format) == "+L");
+    CHECK(std::string_view(schema.children[7]->children[0]->format) == "U");
+    CHECK(text_list->children[0]->length == 2);
+    auto offsets = static_cast<const int64_t *>(text_list->children[0]->buffers[1]);
+    auto values = static_cast<const char *>(text_list->children[0]->buffers[2]);
+    CHECK(std::string_view(values + offsets[1], offsets[2] - offsets[1]) == "World!");
+
+    // Children stay valid until released on their own, after their parent.
+    ArrowArray child = *array.children[6];
+    array.children[6]->release = nullptr;
+    array.release(&array);
+    schema.release(&schema);
+    CHECK(std::string_view(static_cast<const char *>(child.buffers[2]), 6) == "Hello!");
+    child.release(&child);
+    CHECK(child.release == nullptr);
+}
+
+TEST_CASE("table codec matches the inline code")
+{
+    using namespace protoflat;
+    using Numeric32 = test2::Data::Numeric32;
+
+    static constexpr field_entry fields[] = {
+        {field_header::encode({1, wire_type::varint}), offsetof(Numeric32, a), &codec::instance<codec::singular<varint, int32_t>>},
+        {field_header::encode({2, wire_type::varint}), offsetof(Numeric32, b), &codec::instance<codec::singular<varint, uint32_t>>},
+        {field_header::encode({3, wire_type::varint}), offsetof(Numeric32, c), &codec::instance<codec::singular<zigzag_varint, int32_t>>},
+        {field_header::encode({4, wire_type::fixed32}), offsetof(Numeric32, d), &codec::instance<codec::singular<fixed, uint32_t>>},
+        {field_header::encode({5, wire_type::fixed32}), offsetof(Numeric32, e), &codec::instance<codec::singular<fixed, float>>},
+        {field_header::encode({6, wire_type::length_delimited}), offsetof(Numeric32, a_list), &codec::instance<codec::packed<varint, std::vector<int32_t>>>},
+        {field_header::encode({7, wire_type::length_delimited}), offsetof(Numeric32, b_list), &codec::instance<codec::packed<varint, std::vector<uint32_t>>>},
+        {field_header::encode({8, wire_type::length_delimited}), offsetof(Numeric32, c_list), &codec::instance<codec::packed<zigzag_varint, std::vector<int32_t>>>},
+        {field_header::encode({9, wire_type::length_delimited}), offsetof(Numeric32, d_list), &codec::instance<codec::packed<fixed, std::vector<uint32_t>>>},
+        {field_header::encode({10, wire_type::length_delimited}), offsetof(Numeric32, e_list), &codec::instance<codec::packed<fixed, std::vector<float>>>},
+    };
+    static constexpr message_table table{fields, 10};
+
+    auto value = *sint_data().numeric_32;
+    value.b = 2;
+    value.d = 4;
+    value.e = -1.5f;
+    value.a_list = {1, -1};
+    value.d_list = {7};
+    value.e_list = {0.25f};
+
+    std::string data;
+    table_serialize(table, &value, data);
+    CHECK(table_size(table, &value) == data.size());
+    CHECK(data == serialize(value));
+    CHECK(libprotobuf_decodes_to("test2.Data.Numeric32", data, R"(
+        a: -3 b: 2 c: -7 d: 4 e: -1.5 a_list: [1, -1] c_list: [-4, 5, -2147483648, 2147483647] d_list: [7] e_list: [0.25]
+    )"));
+
+    Numeric32 decoded{};
+    std::string_view data_view(data);
+    REQUIRE(table_deserialize(table, data_view, &decoded));
+    CHECK(decoded == value);
+
+    SECTION("unknown fields and mismatched wire types are skipped")
+    {
+        // 11: varint 1, c as fixed32, then c_list = 8 element-wise: -4.
+        std::string data("\x58\x01\x1d\x01\x02\x03\x04\x40\x07", 9);
+        Numeric32 decoded{};
+        std::string_view data_view(data);
+        REQUIRE(table_deserialize(table, data_view, &decoded));
+        CHECK(decoded.c == 0);
+        CHECK(decoded.c_list == std::vector<int32_t>{-4});
+    }
+
+    SECTION("clear resets every field")
+    {
+        table_clear(table, &decoded);
+        CHECK(decoded == Numeric32{});
+    }
+
+    SECTION("truncated input is rejected")
+    {
+        std::string_view truncated(data.data(), data.size() - 1);
+        CHECK_FALSE(table_deserialize(table, truncated, &decoded));
+    }
+}
+
+namespace
+{
+
+// Container with a single block, whose index entry is written as given.
+std::string record_container(std::string_view block, uint64_t uncompressed_size, uint64_t record_count, uint8_t codec)
+{
+    using namespace protoflat;
+
+    std::string data(record_magic);
+    data += static_cast<char>(record_version);
+    uint64_t offset = data.size();
+    data.append(block);
+
+    uint64_t index_offset = data.size();
+    type_traits<varint>::serialize(1, data);
+    type_traits<varint>::serialize(offset, data);
+    type_traits<varint>::serialize(block.size(), data);
+    type_traits<varint>::serialize(uncompressed_size, data);
+    type_traits<varint>::serialize(record_count, data);
+    data += static_cast<char>(codec);
+    type_traits<fixed>::serialize(index_offset, data);
+    data.append(record_magic);
+
+    return data;
+}
+
+} // namespace
+
+TEST_CASE("record containers round-trip")
+{
+    auto codec = GENERATE(0, 1);
+    std::vector<test2::Data> values;
+    for (int i = 0; i < 1000; ++i)
+    {
+        values.push_back(i % 2 ? sample_data() : sint_data());
+        values.back().text = "record " + std::to_string(i);
+    }
+
+    std::string data;
+    protoflat::record_writer writer(data, *protoflat::default_block_codecs()[codec], 4096);
+    for (auto &value : values)
+    {
+        writer.write(value);
+    }
+    writer.finish();
+
+    protoflat::record_reader reader;
+    REQUIRE(reader.open(data));
+    REQUIRE(reader.blocks().size() > 1);
+
+    std::vector<test2::Data> decoded;
+    for (size_t i = 0; i < reader.blocks().size(); ++i)
+    {
+        REQUIRE(reader.read_messages(i, decoded));
+    }
+    CHECK(decoded == values);
+
+    std::atomic<uint64_t> record_count{0};
+    CHECK(reader.for_each_block([&](size_t index, std::string_view records) {
+        uint64_t count = 0;
+        std::string_view record;
+        while (protoflat::type_traits<protoflat::length_delimited>::deserialize(records, record))
+        {
+            ++count;
+        }
+        record_count += count;
+        return records.empty() && count == reader.blocks()[index].record_count;
+    }, 2));
+    CHECK(record_count == values.size());
+}
+
+TEST_CASE("record containers with a corrupt index are rejected")
+{
+    protoflat::record_reader reader;
+    std::string records("\x01" "a" "\x01" "b", 4);
+    auto data = record_container(records, 4, 2, 0);
+    REQUIRE(reader.open(data));
+
+    std::string block;
+    REQUIRE(reader.read_block(0, block));
+    CHECK(block == records);
+
+    SECTION("sizes beyond the codec's expansion ratio")
+    {
+        CHECK_FALSE(reader.open(record_container(records, 5, 2, 0)));
+        CHECK_FALSE(reader.open(record_container(records, 4 * 255 + 1, 2, 1)));
+        CHECK_FALSE(reader.open(record_container(records, std::numeric_limits<uint64_t>::max(), 2, 1)));
+    }
+
+    SECTION("blocks larger than the reader allows")
+    {
+        protoflat::record_reader small_reader(protoflat::default_block_codecs(), 3);
+        CHECK_FALSE(small_reader.open(record_container(records, 4, 2, 0)));
+    }
+
+    SECTION("more records than bytes")
+    {
+        CHECK_FALSE(reader.open(record_container(records, 4, 5, 0)));
+        CHECK_FALSE(reader.open(record_container(records, 4, std::numeric_limits<uint64_t>::max(), 0)));
+    }
+
+    SECTION("unknown codecs")
+    {
+        auto data = record_container(records, 4, 2, 200);
+        REQUIRE(reader.open(data));
+        CHECK_FALSE(reader.read_block(0, block));
+        CHECK_FALSE(reader.open(record_container(records, std::numeric_limits<uint64_t>::max(), 2, 200)));
+    }
+
+    SECTION("truncated containers")
+    {
+        for (size_t size = 0; size < data.size(); ++size)
+        {
+            CHECK_FALSE(reader.open(std::string_view(data).substr(0, size)));
+        }
+    }
+}
+
+namespace
+{
+
+struct socket_pair
+{
+    socket_pair()
+    {
+        REQUIRE(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+    }
+
+    ~socket_pair()
+    {
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    int fds[2];
 };
 
-//namespace protoflat
-//{
-
-//template<>
-//struct type_traits<Message>
-//{
-//    inline static constexpr field_header id_header{1, wire_type::varint};
-//    inline static constexpr field_header text_header{2, wire_type::length_delimited};
-//    inline static constexpr field_header data_header{3, wire_type::length_delimited};
-//    inline static constexpr field_header messages_header{4, wire_type::length_delimited};
-
-//    static size_t size(const Message &value)
-//    {
-//        size_t size = 0;
-
-//        size += type_traits<varint>::size(field_header::encode(id_header));
-//        size += type_traits<varint>::size(value.id);
-
-//        size += type_traits<varint>::size(field_header::encode(text_header));
-//        size += type_traits<std::string>::size(value.text);
-
-//        size += type_traits<varint>::size(field_header::encode(data_header));
-//        size += type_traits<std::vector<varint>>::size(value.data);
-
-//        for (auto &message : value.messages)
-//        {
-//            size += type_traits<varint>::size(field_header::encode(messages_header));
-//            size += type_traits<std::string>::size(message);
-//        }
-
-//        return size;
-//    }
-
-//    static void serialize(const Message &value, std::string &data)
-//    {
-//        if (value.id)
-//        {
-//            type_traits<varint>::serialize(field_header::encode(id_header), data);
-//            type_traits<varint>::serialize(value.id, data);
-//        }
-
-//        if (!value.text.empty())
-//        {
-//            type_traits<varint>::serialize(field_header::encode(text_header), data);
-//            type_traits<std::string>::serialize(value.text, data);
-//        }
-
-//        if (!value.data.empty())
-//        {
-//            type_traits<varint>::serialize(field_header::encode(data_header), data);
-//            type_traits<std::vector<varint>>::serialize(value.data, data);
-//        }
-
-//        if (!value.messages.empty())
-//        {
-//            for (auto &message : value.messages)
-//            {
-//                type_traits<varint>::serialize(field_header::encode(messages_header), data);
-//                type_traits<std::string>::serialize(message, data);
-//            }
-//        }
-//    }
-
-//    static bool deserialize(std::string_view &data, Message &value)
-//    {
-//        while (true)
-//        {
-//            uint64_t header_value = 0;
-//            if (!type_traits<varint>::deserialize(data, header_value))
-//            {
-//                break;
-//            }
-
-//            auto header = field_header::decode(header_value);
-//            switch (header.field_number)
-//            {
-//            case 1:
-//                if (header.field_type != id_header.field_type || !type_traits<varint>::deserialize(data, value.id))
-//                {
-//                    return false;
-//                }
-//                break;
-//            case 2:
-//                if (header.field_type != text_header.field_type || !type_traits<std::string>::deserialize(data, value.text))
-//                {
-//                    return false;
-//                }
-//                break;
-//            case 3:
-//                if (header.field_type != data_header.field_type || !type_traits<std::vector<varint>>::deserialize(data, value.data))
-//                {
-//                    return false;
-//                }
-//            case 4:
-//            {
-//                std::string message;
-//                if (header.field_type != messages_header.field_type || !type_traits<std::string>::deserialize(data, message))
-//                {
-//                    return false;
-//                }
-//                value.messages.push_back(std::move(message));
-//            }
-//            default:
-//                break;
-//            }
-//        }
-
-//        return true;
-//    }
-//};
-
-//}
-
-void print(const std::string &data)
-{
-    for (auto c : data)
-    {
-        std::cout << std::hex << std::setw(2) << std::setfill('0') << (0xff & static_cast<uint32_t>(c)) << " ";
-    }
-    std::cout << std::endl;
-}
-
-int main()
-{
-    //    Message message{0, "Hello!", {}, {"Hello!", "World!"}};
-    //    auto data = protoflat::serialize(message);
-    //    print(data);
-
-    //    Message message_deserialized;
-    //    std::string_view data_view(data);
-    //    if (!protoflat::deserialize(data_view, message_deserialized) || message != message_deserialized)
-    //    {
-    //        std::cout << "failed" << std::endl;
-    //    }
-
-    test::Message message2;
-    //    message2.set_id(0);
-    //    message2.set_text("Hello!");
-    //    message2.add_data(3);
-    //    message2.add_data(270);
-    //    message2.add_data(86942);
-    //    message2.add_messages("Hello!");
-    //    message2.add_messages("World!");
-
-    //    print(message2.SerializeAsString());
-
-    return 0;
+} // namespace
+
+TEST_CASE("async streams carry framed messages")
+{
+    protoflat::epoll_executor executor;
+    REQUIRE(executor.is_valid());
+    socket_pair sockets;
+
+    std::vector<test2::Data> values(200, sample_data());
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        values[i].text = std::string(i * 100, 'x');
+    }
+
+    std::vector<test2::Data> decoded;
+    executor.spawn([](protoflat::epoll_executor &executor, int fd, const std::vector<test2::Data> &values) -> protoflat::task<> {
+        protoflat::async_stream stream(executor, fd);
+        for (auto &value : values)
+        {
+            co_await stream.write_message(value);
+        }
+        shutdown(fd, SHUT_WR);
+    }(executor, sockets.fds[0], values));
+    executor.spawn([](protoflat::epoll_executor &executor, int fd, std::vector<test2::Data> &decoded) -> protoflat::task<> {
+        protoflat::async_stream stream(executor, fd, 4096);
+        test2::Data value;
+        while (co_await stream.read_message(value))
+        {
+            decoded.push_back(value);
+        }
+    }(executor, sockets.fds[1], decoded));
+
+    REQUIRE(executor.run());
+    CHECK(decoded == values);
+}
+
+TEST_CASE("async streams reject frames above max_message_size")
+{
+    protoflat::epoll_executor executor;
+    socket_pair sockets;
+
+    // A 1 GiB length with no data behind it: reading must fail right away instead
+    // of buffering, although the peer keeps the connection open.
+    std::string header;
+    protoflat::type_traits<protoflat::varint>::serialize(1 << 30, header);
+    REQUIRE(write(sockets.fds[0], header.data(), header.size()) == static_cast<ssize_t>(header.size()));
+
+    std::optional<bool> result;
+    executor.spawn([](protoflat::epoll_executor &executor, int fd, std::optional<bool> &result) -> protoflat::task<> {
+        protoflat::async_stream stream(executor, fd, 4096, 1 << 20);
+        test2::Data value;
+        result = co_await stream.read_message(value);
+    }(executor, sockets.fds[1], result));
+
+    REQUIRE(executor.run());
+    REQUIRE(result.has_value());
+    CHECK_FALSE(*result);
+}
+
+TEST_CASE("small_vector and small_string")
+{
+    using protoflat::small_string;
+    using protoflat::small_vector;
+    using protoflat::type_traits;
+
+    SECTION("elements move to the heap past the inline capacity")
+    {
+        small_vector<std::string, 2> values{"a", "b"};
+        auto inline_data = values.data();
+        values.push_back(std::string(100, 'c'));
+        CHECK(values.data() != inline_data);
+        CHECK(values.size() == 3);
+        CHECK(values[2] == std::string(100, 'c'));
+
+        auto copy = values;
+        auto moved = std::move(values);
+        CHECK(copy == moved);
+        copy.resize(1);
+        CHECK(copy.size() == 1);
+        moved = copy;
+        CHECK(moved.size() == 1);
+        CHECK(moved[0] == "a");
+    }
+
+    SECTION("packed encodings match std::vector")
+    {
+        std::vector<int32_t> reference{-4, 5, -2147483648, 2147483647, 0, 300};
+        small_vector<int32_t, 4> values;
+        values.assign(reference.begin(), reference.end());
+        std::string expected;
+        std::string data;
+        type_traits<protoflat::packed_zigzag_varint>::serialize(reference, expected);
+        type_traits<protoflat::packed_zigzag_varint>::serialize(values, data);
+        CHECK(data == expected);
+
+        small_vector<int32_t, 4> decoded;
+        std::string_view data_view(data);
+        REQUIRE(type_traits<protoflat::packed_zigzag_varint>::deserialize(data_view, decoded));
+        CHECK(decoded == values);
+
+        small_vector<float, 2> floats{0.5f, -1.0f, 2.0f};
+        data.clear();
+        type_traits<protoflat::packed_fixed>::serialize(floats, data);
+        small_vector<float, 2> decoded_floats;
+        data_view = data;
+        REQUIRE(type_traits<protoflat::packed_fixed>::deserialize(data_view, decoded_floats));
+        CHECK(decoded_floats == floats);
+    }
+
+    SECTION("strings decode inline when short")
+    {
+        std::string data;
+        type_traits<protoflat::length_delimited>::serialize("short", data);
+        type_traits<protoflat::length_delimited>::serialize(std::string(64, 'x'), data);
+
+        small_string<16> first;
+        small_string<16> second;
+        std::string_view data_view(data);
+        REQUIRE(type_traits<protoflat::length_delimited>::deserialize(data_view, first));
+        REQUIRE(type_traits<protoflat::length_delimited>::deserialize(data_view, second));
+        CHECK(first == std::string_view("short"));
+        CHECK(first.capacity() == 16);
+        CHECK(second == std::string_view(std::string(64, 'x')));
+        CHECK(second.capacity() >= 64);
+    }
+}
+
+TEST_CASE("JSON round-trips through libprotobuf")
+{
+    auto value = sint_data();
+    value.text = "tab\there \"quoted\" \xc3\xa9";
+    value.buffer = std::string("\0\xff", 2);
+    value.global_enum = test2::GlobalEnum::CCC;
+
+    auto expected = parse_text("test2.Data", sint_text);
+    REQUIRE(expected->ParseFromString(protoflat::serialize(value)));
+
+    auto json = protoflat::to_json(value);
+    auto actual = new_libprotobuf_message("test2.Data");
+    REQUIRE(google::protobuf::util::JsonStringToMessage(json, actual.get()).ok());
+    CHECK(google::protobuf::util::MessageDifferencer::Equals(*expected, *actual));
+
+    std::string libprotobuf_json;
+    REQUIRE(google::protobuf::util::MessageToJsonString(*expected, &libprotobuf_json).ok());
+    test2::Data decoded;
+    REQUIRE(protoflat::from_json(libprotobuf_json, decoded));
+    CHECK(decoded == value);
+}
+
+TEST_CASE("malformed JSON is rejected")
+{
+    test2::Data value;
+
+    SECTION("nesting deeper than max_depth")
+    {
+        CHECK_FALSE(protoflat::from_json("{\"unknown\":" + std::string(1000000, '['), value));
+        CHECK_FALSE(protoflat::from_json("{\"unknown\":" + std::string(1000000, '{'), value));
+
+        auto nested = [](size_t depth) {
+            return "{\"unknown\":" + std::string(depth - 2, '[') + "{}" + std::string(depth - 2, ']') + "}";
+        };
+        CHECK(protoflat::from_json(nested(protoflat::json::reader::max_depth), value));
+        CHECK_FALSE(protoflat::from_json(nested(protoflat::json::reader::max_depth + 1), value));
+    }
+
+    SECTION("unescaped control characters in strings")
+    {
+        CHECK(protoflat::from_json("{\"text\":\"a\\u0001b\\tc\"}", value));
+        CHECK(value.text == "a\x01" "b\tc");
+        CHECK_FALSE(protoflat::from_json("{\"text\":\"a\x01" "b\"}", value));
+        CHECK_FALSE(protoflat::from_json("{\"text\":\"a\\tb\tc\"}", value));
+        CHECK_FALSE(protoflat::from_json("{\"text\":\"" + std::string(40, 'a') + "\n\"}", value));
+        CHECK_FALSE(protoflat::from_json("{\"te\x1fxt\":1}", value));
+    }
+
+    SECTION("integers out of range")
+    {
+        CHECK(protoflat::from_json(R"({"numeric64":{"a":"9223372036854775807","b":"18446744073709551615"}})", value));
+        CHECK(value.numeric_64->a == std::numeric_limits<int64_t>::max());
+        CHECK(value.numeric_64->b == std::numeric_limits<uint64_t>::max());
+        CHECK(protoflat::from_json(R"({"numeric64":{"a":-9.223372036854775808e18}})", value));
+        CHECK(value.numeric_64->a == std::numeric_limits<int64_t>::min());
+
+        CHECK_FALSE(protoflat::from_json(R"({"numeric64":{"a":9.223372036854775807e18}})", value));
+        CHECK_FALSE(protoflat::from_json(R"({"numeric64":{"a":"9223372036854775808"}})", value));
+        CHECK_FALSE(protoflat::from_json(R"({"numeric64":{"b":1.8446744073709551615e19}})", value));
+        CHECK_FALSE(protoflat::from_json(R"({"numeric32":{"a":2.147483648e9}})", value));
+        CHECK_FALSE(protoflat::from_json(R"({"numeric32":{"b":-1}})", value));
+    }
+}
+
+TEST_CASE("dynamic messages decode what protoflat and libprotobuf write")
+{
+    std::ifstream stream(PROTOFLAT_TESTS_DIR "/test.desc", std::ios::binary);
+    std::string files(std::istreambuf_iterator<char>(stream), {});
+    protoflat::dynamic::schema schema;
+    REQUIRE(schema.load(files));
+
+    auto data_type = schema.find("test2.Data");
+    auto numeric_32_type = schema.find("test2.Data.Numeric32");
+    REQUIRE(data_type != nullptr);
+    REQUIRE(numeric_32_type != nullptr);
+    auto &numeric_32 = *data_type->find("numeric_32");
+    auto &c = *numeric_32_type->find("c");
+    auto &c_list = *numeric_32_type->find("c_list");
+
+    auto data = protoflat::serialize(sint_data());
+    protoflat::dynamic::dynamic_message message(*data_type);
+    std::string_view input = data;
+    REQUIRE(message.deserialize(input));
+    CHECK(input.empty());
+
+    REQUIRE(message.has(numeric_32));
+    auto &submessage = message.get_message(numeric_32);
+    CHECK(submessage.get<int32_t>(c) == -7);
+    REQUIRE(submessage.count(c_list) == 4);
+    CHECK(submessage.get<int32_t>(c_list, 0) == -4);
+    CHECK(submessage.get<int32_t>(c_list, 2) == std::numeric_limits<int32_t>::min());
+
+    std::string reserialized;
+    message.serialize(reserialized);
+    CHECK(reserialized == libprotobuf_serialize("test2.Data", sint_text));
+
+    message.mutable_message(numeric_32).set<int32_t>(c, 7);
+    message.serialize(reserialized = {});
+    test2::Data decoded;
+    REQUIRE(deserialize_all(reserialized, decoded));
+    CHECK(decoded.numeric_32->c == 7);
+
+    struct visitor
+    {
+        const protoflat::dynamic::field *c_list;
+        std::vector<int32_t> values;
+
+        void on_scalar(const protoflat::dynamic::field &entry, uint64_t bits)
+        {
+            if (&entry == c_list)
+            {
+                values.push_back(protoflat::dynamic::from_bits<int32_t>(bits));
+            }
+        }
+
+        void on_string(const protoflat::dynamic::field &, std::string_view)
+        {
+        }
+
+        bool on_message_begin(const protoflat::dynamic::field &)
+        {
+            return true;
+        }
+
+        void on_message_end(const protoflat::dynamic::field &)
+        {
+        }
+    } c_list_values{&c_list, {}};
+    REQUIRE(protoflat::dynamic::visit(*data_type, data, c_list_values));
+    CHECK(c_list_values.values == std::vector<int32_t>{-4, 5, std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max()});
+
+    for (size_t size = 0; size < data.size(); ++size)
+    {
+        std::string_view truncated(data.data(), size);
+        protoflat::dynamic::dynamic_message partial(*data_type);
+        CHECK(partial.deserialize(truncated) == new_libprotobuf_message("test2.Data")->ParseFromString(std::string(data, 0, size)));
+    }
+}
+
+TEST_CASE("buffer and object pools")
+{
+    SECTION("buffers keep their capacity up to the limits")
+    {
+        protoflat::buffer_pool pool(2, 1024);
+        auto buffer = pool.acquire();
+        buffer.assign(512, 'x');
+        auto capacity = buffer.capacity();
+        pool.release(std::move(buffer));
+        REQUIRE(pool.size() == 1);
+
+        auto reused = pool.acquire();
+        CHECK(reused.empty());
+        CHECK(reused.capacity() == capacity);
+        CHECK(pool.size() == 0);
+
+        pool.release(std::string(4096, 'x'));
+        CHECK(pool.size() == 0);
+        pool.release({});
+        pool.release({});
+        pool.release({});
+        CHECK(pool.size() == 2);
+
+        pool.set_limits(1, 1024);
+        CHECK(pool.size() == 1);
+    }
+
+    SECTION("pooled serialization matches serialize")
+    {
+        auto value = sample_data();
+        {
+            auto data = protoflat::serialize_pooled(value);
+            CHECK(std::string_view(data) == protoflat::serialize(value));
+        }
+        CHECK(protoflat::buffer_pool::local().size() >= 1);
+
+        protoflat::buffer_pool pool;
+        protoflat::pooled_buffer first(pool);
+        first->assign("abc");
+        protoflat::pooled_buffer second(std::move(first));
+        CHECK(*second == "abc");
+        CHECK(pool.size() == 0);
+        second = protoflat::pooled_buffer(pool);
+        CHECK(pool.size() == 1);
+    }
+
+    SECTION("objects are reset when they are recycled")
+    {
+        protoflat::object_pool<test2::Data> pool(1);
+        test2::Data *address = nullptr;
+        size_t text_capacity = 0;
+        {
+            auto value = pool.acquire();
+            *value = sample_data();
+            value->text.assign(100, 'x');
+            address = value.get();
+            text_capacity = value->text.capacity();
+        }
+        REQUIRE(pool.size() == 1);
+
+        auto value = pool.acquire();
+        CHECK(value.get() == address);
+        CHECK(*value == test2::Data{});
+        CHECK(value->text.capacity() == text_capacity);
+
+        auto data = libprotobuf_serialize("test2.Data", sint_text);
+        std::string_view input = data;
+        REQUIRE(protoflat::deserialize_reuse(input, *value));
+        CHECK(*value == sint_data());
+
+        auto other = pool.acquire();
+        value.reset();
+        other.reset();
+        CHECK(pool.size() == 1);
+        CHECK(*pool.acquire() == test2::Data{});
+    }
+}
+
+TEST_CASE("batched decode matches one message at a time")
+{
+    std::vector<std::string> inputs;
+    for (int i = 0; i < 40; ++i)
+    {
+        inputs.push_back(protoflat::serialize(i % 3 ? sample_data() : sint_data()));
+    }
+
+    std::vector<test2::Data> values(inputs.size());
+    REQUIRE(protoflat::deserialize_batch(inputs, values) == inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        CHECK(values[i] == (i % 3 ? sample_data() : sint_data()));
+    }
+
+    CHECK(protoflat::deserialize_batch_reuse(inputs, values) == inputs.size());
+    CHECK(values[0] == sint_data());
+
+    std::vector<test2::Data> fewer_values(3);
+    CHECK(protoflat::deserialize_batch(inputs, fewer_values) == 3);
+
+    inputs[25].pop_back();
+    CHECK(protoflat::deserialize_batch(inputs, values) == 25);
+}
+
+TEST_CASE("field statistics are dumped in the profile format")
+{
+    auto &counters = protoflat::field_stats::register_message("test.Stats");
+    CHECK(&protoflat::field_stats::register_message("test.Stats") == &counters);
+
+    counters.record(2);
+    counters.record(2);
+    counters.record(7);
+    counters.record(protoflat::field_stats::counters::max_field_number + 100);
+    CHECK(counters.count(2) == 2);
+    CHECK(counters.count(protoflat::field_stats::counters::max_field_number + 100) == 0);
+
+    std::ostringstream stream;
+    protoflat::field_stats::dump(stream);
+    CHECK(stream.str().find("test.Stats 2 2\ntest.Stats 7 1\n") != std::string::npos);
+
+    protoflat::field_stats::reset();
+    CHECK(counters.count(2) == 0);
+}
+
+TEST_CASE("shared rings carry messages between mappings")
+{
+    protoflat::shared_ring producer;
+    REQUIRE(producer.create(4, 256));
+    protoflat::shared_ring consumer;
+    REQUIRE(consumer.open(producer.fd()));
+    CHECK(consumer.slot_size() == 256);
+
+    auto value = sint_data();
+    for (int i = 0; i < 4; ++i)
+    {
+        CHECK(producer.try_push_message(value));
+    }
+    CHECK_FALSE(producer.try_push_message(value));
+    CHECK_FALSE(producer.try_push(std::string(257, 'x')));
+
+    for (int i = 0; i < 4; ++i)
+    {
+        test2::Data decoded;
+        bool is_decoded = false;
+        REQUIRE(consumer.try_pop_message(decoded, is_decoded));
+        CHECK(is_decoded);
+        CHECK(decoded == value);
+    }
+    std::string_view data;
+    CHECK_FALSE(consumer.try_pop(data));
+
+    SECTION("the geometry is not read back from the shared header")
+    {
+        // A peer scribbling over the header must not move slots or lift the size limit.
+        auto address = mmap(nullptr, 64, PROT_READ | PROT_WRITE, MAP_SHARED, producer.fd(), 0);
+        REQUIRE(address != MAP_FAILED);
+        auto header = static_cast<uint32_t *>(address);
+        header[2] = 1u << 31;
+        header[3] = UINT32_MAX;
+        munmap(address, 64);
+
+        CHECK(consumer.slot_size() == 256);
+        CHECK_FALSE(producer.try_push(std::string(257, 'x')));
+        CHECK(producer.try_push("abc"));
+        REQUIRE(consumer.try_pop(data));
+        CHECK(data == "abc");
+        consumer.release();
+
+        protoflat::shared_ring late;
+        CHECK_FALSE(late.open(producer.fd()));
+    }
+
+    SECTION("named rings that fail to initialize leave no object behind")
+    {
+        auto name = "/protoflat-tests-" + std::to_string(getpid());
+        protoflat::shared_ring named;
+        CHECK_FALSE(named.create(name, 3, 256));
+        REQUIRE(named.create(name, 4, 256));
+        CHECK(shm_unlink(name.c_str()) == 0);
+    }
+}
+
+TEST_CASE("shared submessages stay copy-on-write")
+{
+    SECTION("writes through emplace are serialized")
+    {
+        test::Fanout value{};
+        auto &data = value.data.emplace();
+        data.text = "first";
+        CHECK(libprotobuf_decodes_to("test.Fanout", protoflat::serialize(value), "data { text: 'first' }"));
+        data.text = "second";
+        CHECK(libprotobuf_decodes_to("test.Fanout", protoflat::serialize(value), "data { text: 'second' }"));
+    }
+
+    SECTION("writes through emplace do not reach copies")
+    {
+        test::Fanout value{};
+        auto &data = value.data.emplace();
+        data.text = "first";
+        auto copy = value;
+        data.text = "second";
+        CHECK(std::as_const(copy).data->text == "first");
+        CHECK_FALSE(value.data.is_shared());
+    }
+
+    SECTION("messages with handed out references serialize from several threads")
+    {
+        test::Fanout value{};
+        auto &data = value.data.emplace();
+        data.text = "first";
+        data.numeric_32.emplace().c = -7;
+        const auto &shared_value = value;
+        auto expected = libprotobuf_serialize("test.Fanout", "data { text: 'first' numeric_32 { c: -7 } }");
+
+        std::string results[2];
+        std::thread threads[2];
+        for (size_t i = 0; i < 2; ++i)
+        {
+            threads[i] = std::thread([&, i] {
+                for (int j = 0; j < 1000; ++j)
+                {
+                    results[i] = protoflat::serialize(shared_value);
+                }
+            });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        CHECK(results[0] == expected);
+        CHECK(results[1] == expected);
+    }
+
+    SECTION("mutate keeps the node shared and cached")
+    {
+        test::Fanout value{};
+        value.data.mutate([](test2::Data &data) { data.text = "first"; });
+        auto first = protoflat::serialize(value);
+        auto copy = value;
+        CHECK(value.data.is_shared());
+        CHECK(protoflat::serialize(copy) == first);
+
+        value.data.mutate([](test2::Data &data) { data.text = "second"; });
+        CHECK_FALSE(value.data.is_shared());
+        CHECK(protoflat::serialize(copy) == first);
+        CHECK(libprotobuf_decodes_to("test.Fanout", protoflat::serialize(value), "data { text: 'second' }"));
+    }
+
+    SECTION("decoding matches libprotobuf")
+    {
+        const std::string text = "id: 3 data { text: 'x' numeric_32 { c: -7 } }";
+        auto data = libprotobuf_serialize("test.Fanout", text);
+        test::Fanout value{};
+        REQUIRE(deserialize_all(data, value));
+        CHECK(value.data->text == "x");
+        CHECK(protoflat::serialize(value) == data);
+
+        std::string json;
+        REQUIRE(google::protobuf::util::MessageToJsonString(*parse_text("test.Fanout", text), &json).ok());
+        test::Fanout from_json{};
+        REQUIRE(protoflat::from_json(json, from_json));
+        CHECK(from_json == value);
+    }
+
+    SECTION("reuse decoding replaces a node others hold")
+    {
+        test::Fanout value{};
+        REQUIRE(deserialize_all(libprotobuf_serialize("test.Fanout", "data { text: 'first' }"), value));
+        auto copy = value;
+        REQUIRE(copy.data.is_shared());
+
+        auto data = libprotobuf_serialize("test.Fanout", "data { text_list: 'second' }");
+        std::string_view input = data;
+        REQUIRE(protoflat::deserialize_reuse(input, value));
+        CHECK(value.data->text.empty());
+        CHECK(value.data->text_list == std::vector<std::string>{"second"});
+        CHECK(copy.data->text == "first");
+        CHECK_FALSE(copy.data.is_shared());
+        CHECK(protoflat::serialize(value) == data);
+    }
 }
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <catch2/catch.hpp>
+
+#include <protoflat.h>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/dynamic_message.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/text_format.h>
+#include <google/protobuf/util/message_differencer.h>
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// libprotobuf messages are built at run time from the descriptor sets protoc writes
+// next to the generated code: the *.pb.cc classes have the same names as the
+// protoflat structs and cannot be linked into the same program.
+class libprotobuf_types
+{
+public:
+    libprotobuf_types()
+    {
+        for (const auto &entry : std::filesystem::directory_iterator(PROTOFLAT_TESTS_DIR))
+        {
+            if (entry.path().extension() == ".desc")
+            {
+                load(entry.path());
+            }
+        }
+    }
+
+    static libprotobuf_types &instance()
+    {
+        static libprotobuf_types types;
+        return types;
+    }
+
+    std::unique_ptr<google::protobuf::Message> new_message(const std::string &type_name)
+    {
+        auto descriptor = _pool.FindMessageTypeByName(type_name);
+        REQUIRE(descriptor != nullptr);
+
+        return std::unique_ptr<google::protobuf::Message>(_factory.GetPrototype(descriptor)->New());
+    }
+
+private:
+    // Every set carries its imports, so files shared by several sets are built once.
+    void load(const std::filesystem::path &path)
+    {
+        std::ifstream stream(path, std::ios::binary);
+        google::protobuf::FileDescriptorSet files;
+        REQUIRE(files.ParseFromIstream(&stream));
+        for (const auto &file : files.file())
+        {
+            if (_pool.FindFileByName(file.name()) == nullptr)
+            {
+                REQUIRE(_pool.BuildFile(file) != nullptr);
+            }
+        }
+    }
+
+    google::protobuf::DescriptorPool _pool;
+    google::protobuf::DynamicMessageFactory _factory;
+};
+
+inline std::unique_ptr<google::protobuf::Message> new_libprotobuf_message(const std::string &type_name)
+{
+    return libprotobuf_types::instance().new_message(type_name);
+}
+
+inline std::unique_ptr<google::protobuf::Message> parse_text(const std::string &type_name, const std::string &text)
+{
+    auto message = new_libprotobuf_message(type_name);
+    REQUIRE(google::protobuf::TextFormat::ParseFromString(text, message.get()));
+
+    return message;
+}
+
+// Wire bytes libprotobuf writes for a message given in text format.
+inline std::string libprotobuf_serialize(const std::string &type_name, const std::string &text)
+{
+    return parse_text(type_name, text)->SerializeAsString();
+}
+
+// Whether libprotobuf decodes data to the message given in text format.
+inline bool libprotobuf_decodes_to(const std::string &type_name, const std::string &data, const std::string &text)
+{
+    auto expected = parse_text(type_name, text);
+    auto actual = new_libprotobuf_message(type_name);
+
+    return actual->ParseFromString(data) && google::protobuf::util::MessageDifferencer::Equals(*expected, *actual);
+}
+
+template<class T>
+bool deserialize_all(std::string_view data, T &value)
+{
+    return protoflat::deserialize(data, value) && data.empty();
+}
@@ -0,0 +1,146 @@
+#include <catch2/catch.hpp>
+
+#include <protoflat.h>
+#include <protoflat_utf8.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <string_view>
+
+// Part of protoflat-tests, and also built on its own with -mssse3 and -mavx2 (see
+// CMakeLists.txt), so that each SIMD validator is compared with the scalar one.
+
+namespace
+{
+
+const std::string valid_sequences[] = {
+    "",
+    "ascii",
+    "\xc2\x80",
+    "\xdf\xbf",
+    "\xe0\xa0\x80",
+    "\xed\x9f\xbf",
+    "\xee\x80\x80",
+    "\xef\xbf\xbf",
+    "\xf0\x90\x80\x80",
+    "\xf4\x8f\xbf\xbf",
+    std::string(1, '\0'),
+};
+
+const std::string invalid_sequences[] = {
+    "\x80",
+    "\xbf",
+    "\xc0\x80",
+    "\xc1\xbf",
+    "\xc2",
+    "\xc2\x41",
+    "\xe0\x80\x80",
+    "\xe0\x9f\xbf",
+    "\xed\xa0\x80",
+    "\xed\xbf\xbf",
+    "\xef\xbf",
+    "\xf0\x80\x80\x80",
+    "\xf0\x8f\xbf\xbf",
+    "\xf4\x90\x80\x80",
+    "\xf5\x80\x80\x80",
+    "\xff",
+    "\xc2\x80\x80",
+};
+
+bool is_valid_scalar(std::string_view value)
+{
+    return protoflat::utf8::detail::is_valid_scalar(reinterpret_cast<const uint8_t *>(value.data()), value.size());
+}
+
+// Whether is_valid and every SIMD validator compiled into this build return expected.
+bool validators_return(std::string_view value, bool expected)
+{
+    [[maybe_unused]] auto data = reinterpret_cast<const uint8_t *>(value.data());
+    auto is_expected = protoflat::utf8::is_valid(value) == expected;
+#if defined(__SSSE3__)
+    is_expected = is_expected && protoflat::utf8::detail::is_valid_simd<protoflat::utf8::detail::ssse3>(data, value.size()) == expected;
+#endif
+#if defined(__AVX2__)
+    is_expected = is_expected && protoflat::utf8::detail::is_valid_simd<protoflat::utf8::detail::avx2>(data, value.size()) == expected;
+#endif
+
+    return is_expected;
+}
+
+} // namespace
+
+TEST_CASE("UTF-8 validation")
+{
+    // Every offset in and across 16 and 32 byte blocks, so that the state carried
+    // between blocks and the padded tail are exercised.
+    for (size_t offset : {0, 1, 15, 16, 31, 32, 62, 63, 64, 100})
+    {
+        for (auto &sequence : valid_sequences)
+        {
+            auto value = std::string(offset, 'a') + sequence + std::string(offset % 7, 'b');
+            CHECK(is_valid_scalar(value));
+            CHECK(validators_return(value, true));
+        }
+        for (auto &sequence : invalid_sequences)
+        {
+            auto value = std::string(offset, 'a') + sequence + std::string(offset % 7, 'b');
+            CHECK_FALSE(is_valid_scalar(value));
+            CHECK(validators_return(value, false));
+        }
+    }
+}
+
+TEST_CASE("UTF-8 validators agree on random input")
+{
+    // Mostly well-formed text with occasional stray bytes, which is where the
+    // validators can disagree; purely random bytes are rejected almost at once.
+    std::mt19937 random(20240229);
+    std::uniform_int_distribution<int> byte(0, 255);
+    size_t valid_count = 0;
+    for (int i = 0; i < 20000; ++i)
+    {
+        std::string value;
+        auto pieces = random() % 24;
+        for (size_t j = 0; j < pieces; ++j)
+        {
+            switch (random() % 4)
+            {
+            case 0:
+                value.append(random() % 40, 'x');
+                break;
+            case 1:
+                value += valid_sequences[random() % std::size(valid_sequences)];
+                break;
+            case 2:
+                value += invalid_sequences[random() % std::size(invalid_sequences)];
+                break;
+            default:
+                value += static_cast<char>(byte(random));
+                break;
+            }
+        }
+
+        auto expected = is_valid_scalar(value);
+        valid_count += expected;
+        INFO("input of " << value.size() << " bytes, case " << i);
+        CHECK(validators_return(value, expected));
+    }
+
+    // Both outcomes have to be well represented for the comparison to mean anything.
+    CHECK(valid_count > 2000);
+    CHECK(valid_count < 18000);
+}
+
+TEST_CASE("utf8_string rejects malformed payloads")
+{
+    std::string data;
+    protoflat::type_traits<protoflat::length_delimited>::serialize(std::string_view("caf\xc3\xa9"), data);
+    protoflat::type_traits<protoflat::length_delimited>::serialize(std::string_view("caf\xe9"), data);
+    std::string_view input = data;
+    std::string value;
+    CHECK(protoflat::type_traits<protoflat::utf8_string>::deserialize(input, value));
+    CHECK(value == "caf\xc3\xa9");
+    CHECK_FALSE(protoflat::type_traits<protoflat::utf8_string>::deserialize(input, value));
+}